@@ -23,11 +23,11 @@
 #include "hal.h"
 
 #include <math.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <unistd.h>
+#include <string.h>
 
 #include "picnc.h"
+#include "planner.h"
+#include "transport.h"
 
 #if !defined(BUILD_SYS_USER_DSO)
 #error "This driver is for usermode threads only"
@@ -37,7 +37,6 @@
 #error "This driver is for the Raspberry Pi platform only"
 #endif
 
-#define MODNAME "picnc"
 #define PREFIX "picnc"
 
 MODULE_AUTHOR("GP Orcullo");
@@ -45,11 +44,82 @@ MODULE_DESCRIPTION("Driver for Raspberry Pi PICnc board");
 MODULE_LICENSE("GPL v2");
 
 static int stepwidth = 1;
-RTAPI_MP_INT(stepwidth, "Step width in 1/BASEFREQ");
+RTAPI_MP_INT(stepwidth, "Step width in 1/basefreq");
+
+static int basefreq = BASEFREQ;
+RTAPI_MP_INT(basefreq, "Base frequency of the PIC stepgen in Hz");
 
 static long pwmfreq = 500;
 RTAPI_MP_LONG(pwmfreq, "PWM frequency in Hz");
 
+static int queue = 0;
+RTAPI_MP_INT(queue, "Segment queue depth on the board, 0 to disable");
+
+static int batch = 0;
+RTAPI_MP_INT(batch, "Velocity samples per servo period (>BAT), 0 to disable");
+
+static int posmode = 0;
+RTAPI_MP_INT(posmode, "Send position commands: 1 the board ramps the velocity, 2 it follows cubic segments");
+
+static char *planner = "double";
+RTAPI_MP_STRING(planner, "Velocity planner: double, or fixed (approximate)");
+
+static char *transport = "devmem";
+RTAPI_MP_STRING(transport, "SPI transport: devmem, spidev or loopback");
+
+static char *spidev = "/dev/spidev0.0";
+RTAPI_MP_STRING(spidev, "Device node for transport=spidev");
+
+static int dma = 0;
+RTAPI_MP_INT(dma, "DMA channel for SPI TX, RX uses the next one, 0 for PIO");
+
+static int boards = 1;
+RTAPI_MP_INT(boards, "Boards on the SPI bus, 2 puts the second one on CE1");
+
+static int spiclkdiv = 0;
+RTAPI_MP_INT(spiclkdiv, "SPI clock divisor of the 250 MHz core clock, even, 0 to calibrate");
+
+static int probe_rise = 0;
+RTAPI_MP_INT(probe_rise, "Inputs whose rising edge latches the positions, bit mask");
+
+static int probe_fall = 0;
+RTAPI_MP_INT(probe_fall, "Inputs whose falling edge latches the positions, bit mask");
+
+static int adc_average = 16;
+RTAPI_MP_INT(adc_average, "ADC samples averaged per reading, a power of 2");
+
+static int compact = 0;
+RTAPI_MP_INT(compact, "Read the feedback in 16 bit halves (>STC)");
+
+/* run time of the exported functions, of the wait for RDY and of the
+   SPI transfers in a servo cycle, in ns; histogram bucket n counts the
+   times below 2^(10+n) ns, the last one all longer ones */
+#define TIMING_BUCKETS		10
+
+enum {
+	TIMING_READ,
+	TIMING_UPDATE,
+	TIMING_WRITE,
+	TIMING_HANDSHAKE,
+	TIMING_TRANSFER,
+	TIMING_STAGES
+};
+
+static const char *timing_names[TIMING_STAGES] = {
+	"read", "update", "write", "handshake", "transfer"
+};
+
+/* firmware health items, see picnc_proto.h; ISR times are in ns */
+static const char *health_names[HEALTH_ITEMS] = {
+	"isr-time", "isr-max", "missed-ticks", "frames", "unknown-cmds",
+	"timeouts", "queue-underruns", "crc-errors", "encoder-errors"
+};
+
+typedef struct {
+	hal_u32_t   *last, *max, *mean;
+	hal_u32_t   hist[TIMING_BUCKETS];
+} timing_t;
+
 typedef struct {
 	hal_float_t *position_cmd[NUMAXES],
 		    *position_fb[NUMAXES],
@@ -62,45 +132,704 @@ typedef struct {
 		    maxaccel[NUMAXES],
 		    adc_scale[3],
 		    pwm_scale[3];
-	hal_u32_t   *test;
+	hal_u32_t   *test,
+		    *queue_level,
+		    *crc_errors;
+	hal_u32_t   *health[HEALTH_ITEMS];
+	hal_float_t *isr_load;
+	hal_s32_t   *enc_count[PICNC_ENCODERS];
+	hal_float_t *enc_position[PICNC_ENCODERS],
+		    *enc_velocity[PICNC_ENCODERS];
+	hal_float_t enc_scale[PICNC_ENCODERS];
+	hal_bit_t   *probe_enable, *probe_tripped;
+	hal_u32_t   *probe_inputs, *probe_timestamp;
+	hal_float_t *probe_position[NUMAXES];
 } data_t;
 
-static data_t *data;
+/* pins of the driver as a whole, its functions serve all boards */
+typedef struct {
+	hal_bit_t   *timing_reset;
+	timing_t    timing[TIMING_STAGES];
+	hal_u32_t   *spi_clock;
+} driver_t;
+
+static driver_t *drv;
+
+/* segments sent to the board queue, indexed by sequence number */
+#define SEG_HIST_SIZE		(2*PICNC_QUEUE_SIZE)
+#define SEG_HIST_MASK		(SEG_HIST_SIZE - 1)
+
+/* everything kept for one board */
+typedef struct {
+	int n;					/* chip select */
+	char prefix[HAL_NAME_LEN + 1];		/* of its pins */
+	data_t *data;
+
+	volatile int32_t txBuf[BUFSIZE], rxBuf[BUFSIZE];
+	u32 caps;				/* firmware capabilities */
+	u32 oc_axes;				/* stepped by output compare */
+
+	double scale_inv[NUMAXES],		/* inverse of scale */
+	       old_vel[NUMAXES],
+	       old_pos[NUMAXES],
+	       old_pos2[NUMAXES],		/* the one before old_pos */
+	       old_scale[NUMAXES],
+	       max_vel[NUMAXES];		/* step rate limit, counts/sec */
+	s32 old_count[NUMAXES];
+	s64 accum[NUMAXES];			/* 64 bit DDS accumulator */
+
+	/* encoder counts, extended to 64 bits the same way; the board
+	   keeps counting across loads, so the first reply only primes
+	   them */
+	s32 enc_old[PICNC_ENCODERS];
+	s64 enc_accum[PICNC_ENCODERS];
+	int enc_primed;
+
+	/* the >STC halves followed back to 32 bits, see expand_reply() */
+	u32 fbc_pos[NUMAXES], fbc_enc[PICNC_ENCODERS];
+
+	/* latch number of the last probe latch, the first reply only
+	   primes it as well */
+	u32 probe_seq;
+	int probe_primed;
+
+	/* planner=fixed, its constants follow scale, maxaccel and the
+	   period */
+	planner_axis plan[NUMAXES];
+	double plan_scale[NUMAXES],
+	       plan_accel[NUMAXES],
+	       plan_pos_scale[NUMAXES];		/* position-cmd to DDS */
+	long plan_dtns[NUMAXES];
+
+	struct {
+		s32 vel[NUMAXES];
+		u32 ticks;
+	} seg_hist[SEG_HIST_SIZE];
+	u32 seg_seq;				/* next sequence number */
+	double seg_level;			/* filtered queue level */
+	s64 inflight[NUMAXES];			/* DDS travel still queued */
+
+	int32_t limBuf[LIM_WORDS],		/* >LIM, sent when changed */
+		limRx[LIM_WORDS];
+	int lim_pending;
+	int lim_sent;				/* not yet seen through */
+	int lim_age;				/* cycles since sent */
+	int32_t outBuf[OUT_WORDS],		/* >OUT, sent when changed */
+		outRx[OUT_WORDS];
+	int out_pending;
+	int out_age;				/* cycles since sent */
+
+	u32 health_raw[HEALTH_ITEMS];		/* last 24 bit values */
+	int crc_run;				/* bad replies in a row */
+	int startup;				/* a reply came in */
+} board_t;
+
+static board_t board[PICNC_BOARDS_MAX];
 
 static int comp_id;
 static const char *modname = MODNAME;
 static const char *prefix = PREFIX;
 
-volatile unsigned *gpio, *spi;
+static const picnc_transport *xport;
 
-volatile int32_t txBuf[BUFSIZE], rxBuf[BUFSIZE];
 static u32 pwm_period = 0;
+static u32 spi_div = SPICLKDIV;			/* SPI clock divisor in use */
+
+/* SPI clock divisors the calibration tries, slowest first */
+static const u32 spiclk_divs[] = { 128, 64, 48, 32, 24, 20, 16, 12, 10, 8 };
+#define SPICLK_DIVS		(sizeof(spiclk_divs) / sizeof(spiclk_divs[0]))
+
+static int32_t tstBuf[SPICLK_BATCH][BUFSIZE],	/* >TST, calibration only */
+	       tstRx[SPICLK_BATCH][BUFSIZE];
+
+/* the ISR rate the boards set up for >CFG, every scale follows it */
+double picnc_basefreq = BASEFREQ;
 
 static double dt = 0,				/* update_freq period in seconds */
 	      recip_dt = 0,			/* reciprocal of period, avoids divides */
-	      scale_inv[NUMAXES] = { 1.0 },	/* inverse of scale */
-	      old_vel[NUMAXES] = { 0 },
-	      old_pos[NUMAXES] = { 0 },
-	      old_scale[NUMAXES] = { 0 },
-	      max_vel;
+	      dds_max_vel;			/* step rate limit of the ISR */
 static long old_dtns = 0;			/* update_freq funct period in nsec */
-static s32 accum_diff = 0,
-	   old_count[NUMAXES] = { 0 };
-static s64 accum[NUMAXES] = { 0 };		/* 64 bit DDS accumulator */
+
+/* planner=fixed */
+static int fixed = 0;
+
+static int req_pending = 0;			/* REQ low since write_spi */
+
+static s64 timing_sum[TIMING_STAGES];
+static u64 timing_count[TIMING_STAGES];		/* u32 wraps in 50 days */
+static long long xfer_ns = 0;			/* SPI time this servo cycle */
+static int old_timing_reset = 0;
 
 static void read_spi(void *arg, long period);
 static void write_spi(void *arg, long period);
 static void update(void *arg, long period);
-void transfer_data();
-static void reset_board();
-static int map_gpio();
-static void setup_gpio();
-static void restore_gpio();
+static void transfer_data(board_t *b);
+static void board_frame(board_t *b, picnc_frame *f);
+static void transfer_wait();
+static int check_version(board_t *b);
+static int check_basefreq(board_t *b);
+
+const volatile int32_t *picnc_command(int n)
+{
+	return board[n].txBuf;
+}
+
+/* the reply to >VER arrives with the next frame, so send it twice */
+static int exchange_version(board_t *b)
+{
+	picnc_frame f[2];
+
+	b->txBuf[0] = PICNC_VER;
+	picnc_crc_seal((void *)b->txBuf, VER_WORDS);
+	f[0].tx = f[1].tx = (const void *)b->txBuf;
+	f[0].rx = f[1].rx = (void *)b->rxBuf;
+	f[0].len = f[1].len = VER_WORDS * 4;
+	f[0].board = f[1].board = b->n;
+	xport->start(f, 2);
+	xport->wait();
+
+	if (b->rxBuf[0] != (PICNC_VER ^ ~0)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: no response from board\n", b->prefix);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int check_version(board_t *b)
+{
+	if (exchange_version(b) < 0)
+		return -1;
+
+	if (b->rxBuf[VER_VERSION] != PICNC_PROTO_VERSION) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware protocol version %d, "
+			"driver expects %d\n", b->prefix,
+			b->rxBuf[VER_VERSION], PICNC_PROTO_VERSION);
+		return -1;
+	}
+
+	if (b->rxBuf[VER_AXES] != NUMAXES) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware built for %d axes, "
+			"driver for %d\n", b->prefix, b->rxBuf[VER_AXES],
+			NUMAXES);
+		return -1;
+	}
+
+	if (b->rxBuf[VER_ENCODERS] != PICNC_ENCODERS) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware built for %d encoders, "
+			"driver for %d\n", b->prefix, b->rxBuf[VER_ENCODERS],
+			PICNC_ENCODERS);
+		return -1;
+	}
+
+	if (b->rxBuf[VER_BATCH] != PICNC_BATCH) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware built for batches of %d, "
+			"driver for %d\n", b->prefix, b->rxBuf[VER_BATCH],
+			PICNC_BATCH);
+		return -1;
+	}
+
+	b->caps = b->rxBuf[VER_CAPS];
+	b->oc_axes = b->rxBuf[VER_OC];
+
+	return 0;
+}
+
+/* what the module parameters ask of the firmware */
+static int check_caps(board_t *b)
+{
+	if ((probe_rise || probe_fall) && !(b->caps & PICNC_CAP_PROBE)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware has no probe latch\n", b->prefix);
+		return -1;
+	}
+
+	if (posmode && !(b->caps & PICNC_CAP_POSITION)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware has no position mode\n",
+			b->prefix);
+		return -1;
+	}
+
+	if ((posmode == 2) && !(b->caps & PICNC_CAP_PVT)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware has no cubic segments\n",
+			b->prefix);
+		return -1;
+	}
+
+	if (queue && !(b->caps & PICNC_CAP_QUEUE)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware has no segment queue\n",
+			b->prefix);
+		return -1;
+	}
+
+	if (batch && !(b->caps & PICNC_CAP_BATCH)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: firmware has no batch frames\n",
+			b->prefix);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* after >CFG, the board reports the ISR period it could set up; all
+   boards run the same firmware, so they have to agree on it */
+static int check_basefreq(board_t *b)
+{
+	u32 tick;
+
+	if (exchange_version(b) < 0)
+		return -1;
+
+	tick = b->rxBuf[VER_TICK];
+	if ((tick < CORE_TIMER_FREQ / PICNC_BASEFREQ_MAX) ||
+	    (tick > CORE_TIMER_FREQ / PICNC_BASEFREQ_MIN)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: board reports an ISR period of %u "
+			"core timer counts\n", b->prefix, tick);
+		return -1;
+	}
+
+	if (b->n && (picnc_basefreq != (double)CORE_TIMER_FREQ / tick)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: ISR period of %u core timer counts, "
+			"board 0 runs another\n", b->prefix, tick);
+		return -1;
+	}
+
+	picnc_basefreq = (double)CORE_TIMER_FREQ / tick;
+	rtapi_print_msg(RTAPI_MSG_INFO, "%s: base frequency %.1f Hz\n",
+		b->prefix, picnc_basefreq);
+
+	return 0;
+}
+
+/* neighbouring bits and words flip, with a walking one on top */
+static inline u32 test_pattern(int k, int i)
+{
+	static const u32 base[4] = {
+		0x55555555, 0xAAAAAAAA, 0x00000000, 0xFFFFFFFF
+	};
+
+	return base[(k + i) & 3] ^ (1u << ((k + 3 * i) & 31));
+}
+
+/* the board answers >TST with the complement of the whole frame,
+   sealed as a >STA reply */
+static int check_echo(const int32_t *tx, const int32_t *rx)
+{
+	int i;
+
+	if (!picnc_crc_check(rx, FB_WORDS))
+		return 0;
+
+	for (i = 0; i < BUFSIZE; i++)
+		if ((i != FB_WORDS - 1) && (rx[i] != ~tx[i]))
+			return 0;
+
+	return 1;
+}
+
+/* n >TST exchanges with board b, in transfers of SPICLK_BATCH frames;
+   the reply to a frame arrives with the next one, so the first reply
+   of a transfer is not checked. Returns 0 if all came back intact */
+static int exchange_test(board_t *b, int n)
+{
+	picnc_frame f[SPICLK_BATCH];
+	int i, k, seq = 0;
+
+	for (k = 0; k < SPICLK_BATCH; k++) {
+		f[k].tx = tstBuf[k];
+		f[k].rx = tstRx[k];
+		f[k].len = BUFSIZE * 4;
+		f[k].board = b->n;
+	}
+
+	while (n > 0) {
+		for (k = 0; k < SPICLK_BATCH; k++, seq++) {
+			tstBuf[k][0] = PICNC_TST;
+			for (i = 1; i < BUFSIZE - 1; i++)
+				tstBuf[k][i] = test_pattern(seq, i);
+			picnc_crc_seal(tstBuf[k], BUFSIZE);
+		}
+
+		xport->start(f, SPICLK_BATCH);
+		xport->wait();
+
+		for (k = 1; (k < SPICLK_BATCH) && (n > 0); k++, n--)
+			if (!check_echo(tstBuf[k - 1], tstRx[k]))
+				return -1;
+	}
+
+	return 0;
+}
+
+/* sweep the divisors from the slowest up to the first one that fails
+   on any board, then settle SPICLK_MARGIN steps back from the fastest
+   that passed; the boards share the clock */
+static int calibrate_spiclk()
+{
+	int n, i, pass = -1;
+
+	for (n = 0; n < (int)SPICLK_DIVS; n++) {
+		xport->clock(spiclk_divs[n]);
+		for (i = 0; i < boards; i++)
+			if (exchange_test(&board[i], SPICLK_EXCHANGES) < 0)
+				break;
+		if (i < boards)
+			break;
+		pass = n;
+	}
+
+	if (pass < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: no clean >TST echo at any SPI clock\n",
+			modname);
+		return -1;
+	}
+
+	spi_div = spiclk_divs[pass > SPICLK_MARGIN ? pass - SPICLK_MARGIN : 0];
+	xport->clock(spi_div);
+	rtapi_print_msg(RTAPI_MSG_INFO,
+		"%s: SPI clock %lu Hz, clean up to %lu Hz\n", modname,
+		BCM2835_CORE_CLK / spi_div,
+		BCM2835_CORE_CLK / spiclk_divs[pass]);
+
+	return 0;
+}
+
+/* a failed exchange may have left a board out of step with the
+   frames, they are reset once the clock is set */
+static int setup_spiclk()
+{
+	if (!xport->clock)
+		return 0;
+
+	if (spiclkdiv) {
+		spi_div = spiclkdiv;
+		xport->clock(spi_div);
+		return 0;
+	}
+
+	if (calibrate_spiclk() < 0)
+		return -1;
+
+	xport->reset();
+	return 0;
+}
+
+/* an axis stepped by output compare runs up to PICNC_OC_MAX_VEL, as
+   long as its 32 bit feedback count moves less than 2^30 per period */
+static void set_max_vel()
+{
+	double oc_vel = PICNC_OC_MAX_VEL;
+	board_t *b;
+	int i;
+
+	if ((recip_dt > 0) && (oc_vel > (1L << 30) / STEP_MASK * recip_dt))
+		oc_vel = (1L << 30) / STEP_MASK * recip_dt;
+
+	for (b = board; b < board + boards; b++)
+		for (i = 0; i < NUMAXES; i++)
+			b->max_vel[i] = (b->oc_axes & (1 << i)) ?
+				oc_vel : dds_max_vel;
+}
+
+static int export_timing(driver_t *d, int n)
+{
+	timing_t *t = &(d->timing[n]);
+	int b, retval;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(t->last), comp_id,
+		"%s.timing.%s.last", prefix, timing_names[n]);
+	if (retval < 0) return retval;
+	*(t->last) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(t->max), comp_id,
+		"%s.timing.%s.max", prefix, timing_names[n]);
+	if (retval < 0) return retval;
+	*(t->max) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(t->mean), comp_id,
+		"%s.timing.%s.mean", prefix, timing_names[n]);
+	if (retval < 0) return retval;
+	*(t->mean) = 0;
+
+	for (b = 0; b < TIMING_BUCKETS; b++) {
+		retval = hal_param_u32_newf(HAL_RO, &(t->hist[b]), comp_id,
+			"%s.timing.%s.hist-%01d", prefix, timing_names[n], b);
+		if (retval < 0) return retval;
+		t->hist[b] = 0;
+	}
+
+	return 0;
+}
+
+static inline void timing_add(driver_t *d, int n, long long ns)
+{
+	timing_t *t = &(d->timing[n]);
+	u32 x = (ns > 0xFFFFFFFFll) ? 0xFFFFFFFF : (ns < 0 ? 0 : ns);
+	int b;
+
+	*(t->last) = x;
+	if (x > *(t->max))
+		*(t->max) = x;
+
+	timing_sum[n] += x;
+	timing_count[n]++;
+	*(t->mean) = timing_sum[n] / timing_count[n];
+
+	for (b = 0; (b < TIMING_BUCKETS - 1) && (x >> (10 + b)); b++);
+	t->hist[b]++;
+}
+
+/* on a rising edge of the reset pin */
+static inline void timing_check_reset(driver_t *d)
+{
+	int n, b;
+
+	if (*(d->timing_reset) && !old_timing_reset) {
+		for (n = 0; n < TIMING_STAGES; n++) {
+			*(d->timing[n].last) = 0;
+			*(d->timing[n].max) = 0;
+			*(d->timing[n].mean) = 0;
+			for (b = 0; b < TIMING_BUCKETS; b++)
+				d->timing[n].hist[b] = 0;
+			timing_sum[n] = 0;
+			timing_count[n] = 0;
+		}
+	}
+	old_timing_reset = *(d->timing_reset);
+}
+
+static int open_transport()
+{
+	picnc_transport_opts opts;
+
+	xport = picnc_transport_find(transport);
+	if (!xport) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: unknown transport %s\n", modname,
+			transport);
+		return -1;
+	}
+
+	if (dma && (xport != &picnc_devmem)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: dma needs transport=devmem\n", modname);
+		return -1;
+	}
+
+	if ((boards > 1) && (xport != &picnc_devmem) &&
+	    (xport != &picnc_spidev)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: transport %s has one board only\n",
+			modname, transport);
+		return -1;
+	}
+
+	opts.dma = dma;
+	opts.device = spidev;
+	opts.boards = boards;
+
+	return xport->open(&opts);
+}
+
+/* the pins of board b, named after its prefix */
+static int export_board(board_t *b)
+{
+	data_t *dat = b->data;
+	int n, retval;
+
+	for (n=0; n<NUMAXES; n++) {
+		retval = hal_pin_float_newf(HAL_IN, &(dat->position_cmd[n]),
+			comp_id, "%s.axis.%01d.position-cmd", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->position_cmd[n]) = 0.0;
+
+		retval = hal_pin_float_newf(HAL_OUT, &(dat->position_fb[n]),
+			comp_id, "%s.axis.%01d.position-fb", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->position_fb[n]) = 0.0;
+
+		retval = hal_param_float_newf(HAL_RW, &(dat->scale[n]),
+			comp_id, "%s.axis.%01d.scale", b->prefix, n);
+		if (retval < 0) return retval;
+		dat->scale[n] = 1.0;
+
+		retval = hal_param_float_newf(HAL_RW, &(dat->maxaccel[n]),
+			comp_id, "%s.axis.%01d.maxaccel", b->prefix, n);
+		if (retval < 0) return retval;
+		dat->maxaccel[n] = 1.0;
+	}
+
+	for (n=0; n<3; n++) {
+		retval = hal_pin_float_newf(HAL_IN, &(dat->pwm_duty[n]),
+			comp_id, "%s.pwm.%01d.duty", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->pwm_duty[n]) = 0.0;
+
+		retval = hal_param_float_newf(HAL_RW, &(dat->pwm_scale[n]),
+			comp_id, "%s.pwm.%01d.scale", b->prefix, n);
+		if (retval < 0) return retval;
+		dat->pwm_scale[n] = 1.0;
+
+		retval = hal_pin_float_newf(HAL_OUT, &(dat->adc_in[n]),
+			comp_id, "%s.adc.%01d.val", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->adc_in[n]) = 0.0;
+
+		retval = hal_param_float_newf(HAL_RW, &(dat->adc_scale[n]),
+			comp_id, "%s.adc.%01d.scale", b->prefix, n);
+		if (retval < 0) return retval;
+		dat->adc_scale[n] = 1.0;
+	}
+
+	for (n=0; n<13; n++) {
+		retval = hal_pin_bit_newf(HAL_OUT, &(dat->inp[n]), comp_id,
+			"%s.input.%01d.pin", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->inp[n]) = 0;
+
+		retval = hal_pin_bit_newf(HAL_OUT, &(dat->inp_inv[n]), comp_id,
+			"%s.input.%01d.pin_inv", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->inp_inv[n]) = 1;
+	}
+
+	for (n=0; n<12; n++) {
+		retval = hal_pin_bit_newf(HAL_IN, &(dat->out[n]), comp_id,
+			"%s.output.%01d.pin", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->out[n]) = 0;
+	}
+
+	retval = hal_pin_bit_newf(HAL_OUT, &(dat->ready), comp_id,
+		"%s.ready", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->ready) = 0;
+
+	retval = hal_pin_bit_newf(HAL_IO, &(dat->fault), comp_id,
+		"%s.fault", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->fault) = 0;
+
+	retval = hal_pin_u32_newf(HAL_IN, &(dat->test), comp_id,
+		"%s.test", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->test) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(dat->queue_level), comp_id,
+		"%s.queue-level", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->queue_level) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(dat->crc_errors), comp_id,
+		"%s.crc-errors", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->crc_errors) = 0;
+
+	for (n=0; n<HEALTH_ITEMS; n++) {
+		retval = hal_pin_u32_newf(HAL_OUT, &(dat->health[n]), comp_id,
+			"%s.fw.%s", b->prefix, health_names[n]);
+		if (retval < 0) return retval;
+		*(dat->health[n]) = 0;
+	}
+
+	retval = hal_pin_float_newf(HAL_OUT, &(dat->isr_load), comp_id,
+		"%s.fw.isr-load", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->isr_load) = 0.0;
+
+	for (n=0; n<PICNC_ENCODERS; n++) {
+		retval = hal_pin_s32_newf(HAL_OUT, &(dat->enc_count[n]),
+			comp_id, "%s.encoder.%01d.count", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->enc_count[n]) = 0;
+
+		retval = hal_pin_float_newf(HAL_OUT, &(dat->enc_position[n]),
+			comp_id, "%s.encoder.%01d.position", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->enc_position[n]) = 0.0;
+
+		retval = hal_pin_float_newf(HAL_OUT, &(dat->enc_velocity[n]),
+			comp_id, "%s.encoder.%01d.velocity", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->enc_velocity[n]) = 0.0;
+
+		retval = hal_param_float_newf(HAL_RW, &(dat->enc_scale[n]),
+			comp_id, "%s.encoder.%01d.scale", b->prefix, n);
+		if (retval < 0) return retval;
+		dat->enc_scale[n] = 1.0;
+	}
+
+	retval = hal_pin_bit_newf(HAL_IN, &(dat->probe_enable), comp_id,
+		"%s.probe.enable", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->probe_enable) = 0;
+
+	retval = hal_pin_bit_newf(HAL_OUT, &(dat->probe_tripped), comp_id,
+		"%s.probe.tripped", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->probe_tripped) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(dat->probe_inputs), comp_id,
+		"%s.probe.inputs", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->probe_inputs) = 0;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(dat->probe_timestamp), comp_id,
+		"%s.probe.timestamp", b->prefix);
+	if (retval < 0) return retval;
+	*(dat->probe_timestamp) = 0;
+
+	for (n=0; n<NUMAXES; n++) {
+		retval = hal_pin_float_newf(HAL_OUT,
+			&(dat->probe_position[n]), comp_id,
+			"%s.probe.%01d.position", b->prefix, n);
+		if (retval < 0) return retval;
+		*(dat->probe_position[n]) = 0.0;
+	}
+
+	return 0;
+}
+
+/* the pins of the driver as a whole */
+static int export_driver(driver_t *d)
+{
+	int n, retval;
+
+	retval = hal_pin_u32_newf(HAL_OUT, &(d->spi_clock), comp_id,
+		"%s.spi-clock", prefix);
+	if (retval < 0) return retval;
+	*(d->spi_clock) = xport->clock ? BCM2835_CORE_CLK / spi_div : 0;
+
+	retval = hal_pin_bit_newf(HAL_IN, &(d->timing_reset), comp_id,
+		"%s.timing.reset", prefix);
+	if (retval < 0) return retval;
+	*(d->timing_reset) = 0;
+
+	for (n=0; n<TIMING_STAGES; n++) {
+		retval = export_timing(d, n);
+		if (retval < 0) return retval;
+	}
+
+	return 0;
+}
 
 int rtapi_app_main(void)
 {
 	char name[HAL_NAME_LEN + 1];
-	int n, retval;
+	board_t *b;
+	int retval;
 
 	/* initialise driver */
 	comp_id = hal_init(modname);
@@ -110,114 +839,167 @@ int rtapi_app_main(void)
 		return -1;
 	}
 
-	/* allocate shared memory */
-	data = hal_malloc(sizeof(data_t));
-	if (data == 0) {
-		rtapi_print_msg(RTAPI_MSG_ERR, "%s: ERROR: hal_malloc() failed\n",
-			modname);
+	if ((boards < 1) || (boards > PICNC_BOARDS_MAX)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: boards must be 1 to %d\n", modname,
+			PICNC_BOARDS_MAX);
 		hal_exit(comp_id);
 		return -1;
 	}
 
-	/* configure board */
-	retval = map_gpio();
-	if (retval < 0) {
+	/* allocate shared memory, the pins of a single board keep the
+	   driver's prefix */
+	drv = hal_malloc(sizeof(driver_t));
+	for (b = board; b < board + boards; b++) {
+		b->n = b - board;
+		if (boards > 1)
+			rtapi_snprintf(b->prefix, sizeof(b->prefix), "%s.%d",
+				prefix, b->n);
+		else
+			rtapi_snprintf(b->prefix, sizeof(b->prefix), "%s",
+				prefix);
+		b->data = hal_malloc(sizeof(data_t));
+		b->out_pending = 1;
+		if (!drv || !b->data) {
+			rtapi_print_msg(RTAPI_MSG_ERR,
+				"%s: ERROR: hal_malloc() failed\n", modname);
+			hal_exit(comp_id);
+			return -1;
+		}
+	}
+
+	if ((spiclkdiv < 0) || (spiclkdiv > 0xFFFE) || (spiclkdiv & 1)) {
 		rtapi_print_msg(RTAPI_MSG_ERR,
-			"%s: ERROR: cannot map GPIO memory\n", modname);
-		return retval;
+			"%s: ERROR: spiclkdiv must be even, up to %d, or 0\n",
+			modname, 0xFFFE);
+		hal_exit(comp_id);
+		return -1;
 	}
 
-	setup_gpio();
-	reset_board();
+	if ((queue < 0) || (queue > PICNC_QUEUE_MAX)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: queue must be 0 to %d\n", modname,
+			PICNC_QUEUE_MAX);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-	pwm_period = (SYS_FREQ/pwmfreq) - 1;	/* PeripheralClock/pwmfreq - 1 */
+	if ((basefreq < PICNC_BASEFREQ_MIN) ||
+	    (basefreq > PICNC_BASEFREQ_MAX)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: basefreq must be %d to %d\n", modname,
+			PICNC_BASEFREQ_MIN, PICNC_BASEFREQ_MAX);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-	txBuf[0] = 0x4746433E;			/* this is config data (>CFG) */
-	txBuf[1] = stepwidth;
-	txBuf[2] = pwm_period;
-	transfer_data();			/* send config data */
+	if ((probe_rise & ~0x1FFF) || (probe_fall & ~0x1FFF)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: probe_rise and probe_fall are masks of "
+			"inputs 0 to 12\n", modname);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-	max_vel = BASEFREQ/(4.0 * stepwidth);	/* calculate velocity limit */
+	if ((adc_average < 1) || (adc_average > PICNC_ADC_AVERAGE_MAX) ||
+	    (adc_average & (adc_average - 1))) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: adc_average must be a power of 2 up to "
+			"%d\n", modname, PICNC_ADC_AVERAGE_MAX);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-	/* export pins and parameters */
-	for (n=0; n<NUMAXES; n++) {
-		retval = hal_pin_float_newf(HAL_IN, &(data->position_cmd[n]),
-			comp_id, "%s.axis.%01d.position-cmd", prefix, n);
-		if (retval < 0) goto error;
-		*(data->position_cmd[n]) = 0.0;
+	if ((posmode < 0) || (posmode > 2)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: posmode must be 0 to 2\n", modname);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-		retval = hal_pin_float_newf(HAL_OUT, &(data->position_fb[n]),
-			comp_id, "%s.axis.%01d.position-fb", prefix, n);
-		if (retval < 0) goto error;
-		*(data->position_fb[n]) = 0.0;
+	if (posmode && queue) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: posmode does not use the queue\n", modname);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-		retval = hal_param_float_newf(HAL_RW, &(data->scale[n]),
-			comp_id, "%s.axis.%01d.scale", prefix, n);
-		if (retval < 0) goto error;
-		data->scale[n] = 1.0;
+	/* the samples of a batch are played from the queue */
+	if ((batch < 0) || (batch > PICNC_BATCH)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: batch must be 0 to %d\n", modname,
+			PICNC_BATCH);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-		retval = hal_param_float_newf(HAL_RW, &(data->maxaccel[n]),
-			comp_id, "%s.axis.%01d.maxaccel", prefix, n);
-		if (retval < 0) goto error;
-		data->maxaccel[n] = 1.0;
+	if (batch && (!queue || (queue * batch > PICNC_QUEUE_MAX))) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: batch needs a queue, with queue * batch "
+			"at most %d\n", modname, PICNC_QUEUE_MAX);
+		hal_exit(comp_id);
+		return -1;
 	}
 
-	for (n=0; n<3; n++) {
-		retval = hal_pin_float_newf(HAL_IN, &(data->pwm_duty[n]),
-			comp_id, "%s.pwm.%01d.duty", prefix, n);
-		if (retval < 0) goto error;
-		*(data->pwm_duty[n]) = 0.0;
+	if (!strcmp(planner, "fixed")) {
+		fixed = 1;
+	} else if (strcmp(planner, "double")) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: planner must be double or fixed\n", modname);
+		hal_exit(comp_id);
+		return -1;
+	}
 
-		retval = hal_param_float_newf(HAL_RW, &(data->pwm_scale[n]),
-			comp_id, "%s.pwm.%01d.scale", prefix, n);
-		if (retval < 0) goto error;
-		data->pwm_scale[n] = 1.0;
+	/* configure boards */
+	retval = open_transport();
+	if (retval < 0) {
+		hal_exit(comp_id);
+		return retval;
+	}
 
-		retval = hal_pin_float_newf(HAL_OUT, &(data->adc_in[n]),
-			comp_id, "%s.adc.%01d.val", prefix, n);
-		if (retval < 0) goto error;
-		*(data->adc_in[n]) = 0.0;
+	xport->reset();
 
-		retval = hal_param_float_newf(HAL_RW, &(data->adc_scale[n]),
-			comp_id, "%s.adc.%01d.scale", prefix, n);
-		if (retval < 0) goto error;
-		data->adc_scale[n] = 1.0;
+	retval = setup_spiclk();
+	for (b = board; (retval >= 0) && (b < board + boards); b++) {
+		retval = check_version(b);
+		if (retval >= 0)
+			retval = check_caps(b);
+	}
+	if (retval < 0) {
+		xport->close();
+		hal_exit(comp_id);
+		return retval;
 	}
 
-	for (n=0; n<13; n++) {
-		retval = hal_pin_bit_newf(HAL_OUT, &(data->inp[n]), comp_id,
-			"%s.input.%01d.pin", prefix, n);
-		if (retval < 0) goto error;
-		*(data->inp[n]) = 0;
+	pwm_period = (SYS_FREQ/pwmfreq) - 1;	/* PeripheralClock/pwmfreq - 1 */
 
-		retval = hal_pin_bit_newf(HAL_OUT, &(data->inp_inv[n]), comp_id,
-			"%s.input.%01d.pin_inv", prefix, n);
-		if (retval < 0) goto error;
-		*(data->inp_inv[n]) = 1;
+	for (b = board; b < board + boards; b++) {
+		b->txBuf[0] = PICNC_CFG;	/* this is config data */
+		b->txBuf[CFG_STEPWIDTH] = stepwidth;
+		b->txBuf[CFG_PWM_PERIOD] = pwm_period;
+		b->txBuf[CFG_QUEUE_DEPTH] = batch ? queue * batch : queue;
+		b->txBuf[CFG_BASEFREQ] = basefreq;
+		b->txBuf[CFG_PROBE] = PROBE_EDGES(probe_rise, probe_fall);
+		b->txBuf[CFG_ADC_AVERAGE] = adc_average;
+		b->txBuf[CFG_COMPACT] = compact;
+		transfer_data(b);		/* send config data */
+
+		retval = check_basefreq(b);
+		if (retval < 0) {
+			xport->close();
+			hal_exit(comp_id);
+			return retval;
+		}
 	}
 
-	for (n=0; n<12; n++) {
-		retval = hal_pin_bit_newf(HAL_IN, &(data->out[n]), comp_id,
-			"%s.output.%01d.pin", prefix, n);
-		if (retval < 0) goto error;
-		*(data->out[n]) = 0;
-	}
-
-	retval = hal_pin_bit_newf(HAL_OUT, &(data->ready), comp_id,
-		"%s.ready", prefix);
-	if (retval < 0) goto error;
-	*(data->ready) = 0;
-
-	retval = hal_pin_bit_newf(HAL_IO, &(data->fault), comp_id,
-		"%s.fault", prefix);
-	if (retval < 0) goto error;
-	*(data->fault) = 0;
-
-	retval = hal_pin_u32_newf(HAL_IN, &(data->test), comp_id,
-		"%s.test", prefix);
-	if (retval < 0) goto error;
-	*(data->test) = 0;
-error:
+	/* calculate velocity limit */
+	dds_max_vel = picnc_basefreq / (4.0 * stepwidth);
+	set_max_vel();
+
+	/* export pins and parameters */
+	retval = export_driver(drv);
+	for (b = board; (retval >= 0) && (b < board + boards); b++)
+		retval = export_board(b);
 	if (retval < 0) {
 		rtapi_print_msg(RTAPI_MSG_ERR,
 			"%s: ERROR: pin export failed with err=%i\n",
@@ -226,9 +1008,9 @@ error:
 		return -1;
 	}
 
-	/* export functions */
+	/* export functions, each one serves all boards */
 	rtapi_snprintf(name, sizeof(name), "%s.read", prefix);
-	retval = hal_export_funct(name, read_spi, data, 1, 0, comp_id);
+	retval = hal_export_funct(name, read_spi, drv, 1, 0, comp_id);
 	if (retval < 0) {
 		rtapi_print_msg(RTAPI_MSG_ERR,
 			"%s: ERROR: read function export failed\n", modname);
@@ -237,7 +1019,7 @@ error:
 	}
 	rtapi_snprintf(name, sizeof(name), "%s.write", prefix);
 	/* no FP operations */
-	retval = hal_export_funct(name, write_spi, data, 0, 0, comp_id);
+	retval = hal_export_funct(name, write_spi, drv, 0, 0, comp_id);
 	if (retval < 0) {
 		rtapi_print_msg(RTAPI_MSG_ERR,
 			"%s: ERROR: write function export failed\n", modname);
@@ -245,7 +1027,7 @@ error:
 		return -1;
 	}
 	rtapi_snprintf(name, sizeof(name), "%s.update", prefix);
-	retval = hal_export_funct(name, update, data, 1, 0, comp_id);
+	retval = hal_export_funct(name, update, drv, 1, 0, comp_id);
 	if (retval < 0) {
 		rtapi_print_msg(RTAPI_MSG_ERR,
 			"%s: ERROR: update function export failed\n", modname);
@@ -260,100 +1042,393 @@ error:
 
 void rtapi_app_exit(void)
 {
-	restore_gpio();
-	munmap((void *)gpio,BLOCK_SIZE);
-	munmap((void *)spi,BLOCK_SIZE);
+	transfer_wait();
+	xport->close();
 	hal_exit(comp_id);
 }
 
-static inline void update_inputs(data_t *dat)
+static inline void update_inputs(board_t *b)
 {
+	data_t *dat = b->data;
 	int n;
 	
 	for (n=0; n<13; n++) {
-		*(dat->inp[n])  = (get_inputs() & (1l << n)) ? 1 : 0;
+		*(dat->inp[n])  = (get_inputs(b) & (1l << n)) ? 1 : 0;
 		*(dat->inp_inv[n]) = ~(*(dat->inp[n]));
 	}
 
-	*(dat->adc_in[0]) = dat->adc_scale[0] * ((u32)get_adc(0) >> 16);
-	*(dat->adc_in[1]) = dat->adc_scale[1] * (get_adc(0) & 0xFFFF);
-	*(dat->adc_in[2]) = dat->adc_scale[2] * ((u32)get_adc(1) >> 16);
+	*(dat->adc_in[0]) = dat->adc_scale[0] * ((u32)get_adc(b, 0) >> 16);
+	*(dat->adc_in[1]) = dat->adc_scale[1] * (get_adc(b, 0) & 0xFFFF);
+	*(dat->adc_in[2]) = dat->adc_scale[2] * ((u32)get_adc(b, 1) >> 16);
 }
 
-static void read_spi(void *arg, long period)
+/* position and velocity from the change in count since the last
+   reply, in machine units */
+static inline void update_encoders(board_t *b)
 {
+	data_t *dat = b->data;
+	s32 diff;
+	int n;
+
+	for (n = 0; n < PICNC_ENCODERS; n++) {
+		diff = b->enc_primed ?
+			(s32)b->rxBuf[FB_ENC(n)] - b->enc_old[n] : 0;
+		b->enc_old[n] = b->rxBuf[FB_ENC(n)];
+		b->enc_accum[n] += diff;
+
+		/* scale must not be 0 */
+		if ((dat->enc_scale[n] < 1e-20) && (dat->enc_scale[n] > -1e-20))
+			dat->enc_scale[n] = 1.0;
+
+		*(dat->enc_count[n]) = (s32)b->enc_accum[n];
+		*(dat->enc_position[n]) = b->enc_accum[n] / dat->enc_scale[n];
+		*(dat->enc_velocity[n]) = diff * recip_dt / dat->enc_scale[n];
+	}
+	b->enc_primed = 1;
+}
+
+/* the first latch reported while enable is set trips the probe and
+   holds its positions until enable drops; the latched DDS positions
+   are extended to 64 bits against the feedback they came with */
+static inline void update_probe(board_t *b)
+{
+	data_t *dat = b->data;
+	u32 seq = PROBE_SEQ(b->rxBuf[FB_PROBE]);
+	s32 d;
 	int i;
-	static int startup = 0;
-	data_t *dat = (data_t *)arg;
-	unsigned long timeout = REQ_TIMEOUT;
 
-	/* skip loading velocity command */
-	txBuf[0] = 0x444D4300;
+	if (!*(dat->probe_enable)) {
+		*(dat->probe_tripped) = 0;
+	} else if (b->probe_primed && (seq != b->probe_seq) &&
+		   !*(dat->probe_tripped)) {
+		for (i = 0; i < NUMAXES; i++) {
+			d = (u32)b->rxBuf[FB_PROBE_POS(i)] -
+				(u32)get_position(b, i);
+			*(dat->probe_position[i]) = (b->accum[i] + d) *
+				b->scale_inv[i];
+		}
+		*(dat->probe_inputs) = PROBE_INPUTS(b->rxBuf[FB_PROBE]);
+		*(dat->probe_timestamp) = b->rxBuf[FB_PROBE_TIME];
+		*(dat->probe_tripped) = 1;
+	}
 
-	/* send request */
-	BCM2835_GPCLR0 = (1l << 23);
+	b->probe_seq = seq;
+	b->probe_primed = 1;
+}
 
-	/* wait until ready, signal active low */
-	while ((BCM2835_GPLEV0 & (1l << 25)) && (timeout--));
+/* >LIM and >OUT go out again with the next write_spi */
+static inline void resync_board(board_t *b)
+{
+	b->lim_age = LIM_REFRESH;
+	b->out_age = OUT_REFRESH;
+}
+
+/* one firmware health item comes with each >STA reply, the counters
+   are extended from 24 to 32 bits */
+static inline void update_health(board_t *b)
+{
+	data_t *dat = b->data;
+	u32 x = b->rxBuf[FB_HEALTH],
+	    n = HEALTH_ITEM(x),
+	    val = HEALTH_VALUE(x);
+
+	if (n >= HEALTH_ITEMS)
+		return;
+
+	switch (n) {
+	case HEALTH_ISR_LAST:
+		*(dat->health[n]) = val * CORE_TIMER_NS;
+		break;
+	case HEALTH_ISR_MAX:
+		*(dat->health[n]) = val * CORE_TIMER_NS;
+		/* share of the tick taken by the longest ISR */
+		*(dat->isr_load) = val * CORE_TIMER_NS *
+			(picnc_basefreq * 1e-7);
+		break;
+	default:
+		*(dat->health[n]) += (val - b->health_raw[n]) & HEALTH_MASK;
+		break;
+	}
+
+	/* the board dropped a frame, it may have been >LIM or >OUT */
+	if ((n == HEALTH_CRC) && (val != b->health_raw[n]))
+		resync_board(b);
+
+	b->health_raw[n] = val;
+}
+
+/* work out how far the axes will still travel on the segments that
+   are queued on the board, the current one included */
+static inline void update_queue(board_t *b)
+{
+	data_t *dat = b->data;
+	u32 status = b->rxBuf[FB_QUEUE];
+	u32 level = QUEUE_LEVEL(status),
+	    rem = QUEUE_REMAINING(status),
+	    cur = QUEUE_SEQ(status),
+	    n, s;
+	int i;
+
+	*(dat->queue_level) = level;
+	b->seg_level += 0.1 * (level - b->seg_level);
+
+	/* the waiting segments are the last ones sent */
+	for (i = 0; i < NUMAXES; i++)
+		b->inflight[i] = (s64)rem *
+			b->seg_hist[cur & SEG_HIST_MASK].vel[i];
+
+	for (n = 1; n <= level; n++) {
+		s = (b->seg_seq - n) & SEG_HIST_MASK;
+		for (i = 0; i < NUMAXES; i++)
+			b->inflight[i] += (s64)b->seg_hist[s].ticks *
+				b->seg_hist[s].vel[i];
+	}
+}
+
+/* a >STC reply into the >STA layout: each half is followed by its
+   difference to the last one, which is within 16 bits as long as the
+   32 bit values would have been within 32 */
+static void expand_reply(board_t *b)
+{
+	u32 c[FBC_WORDS], h;
+	s16 d;
+	int i;
+
+	for (i = 0; i < FBC_WORDS; i++)
+		c[i] = b->rxBuf[i];
+
+	for (i = 0; i < NUMAXES; i++) {
+		h = FBC_HALF(c[FBC_POS(i)], i);
+		d = h - (b->fbc_pos[i] >> FBC_POS_SHIFT);
+		b->fbc_pos[i] += (u32)(s32)d << FBC_POS_SHIFT;
+		b->rxBuf[FB_POS(i)] = b->fbc_pos[i];
+
+		/* the latch against the position it came with */
+		d = FBC_HALF(c[FBC_PROBE_POS(i)], i) - h;
+		b->rxBuf[FB_PROBE_POS(i)] = b->fbc_pos[i] +
+			((u32)(s32)d << FBC_POS_SHIFT);
+	}
+
+	b->rxBuf[FB_INPUTS] = c[FBC_INPUTS];
+	b->rxBuf[FB_ADC(0)] = c[FBC_ADC(0)];
+	b->rxBuf[FB_ADC(1)] = c[FBC_ADC(1)];
+	b->rxBuf[FB_QUEUE] = c[FBC_QUEUE];
+	b->rxBuf[FB_HEALTH] = c[FBC_HEALTH];
+
+	for (i = 0; i < PICNC_ENCODERS; i++) {
+		d = FBC_HALF(c[FBC_ENC(i)], i) - (b->fbc_enc[i] & 0xFFFF);
+		b->fbc_enc[i] += d;
+		b->rxBuf[FB_ENC(i)] = b->fbc_enc[i];
+	}
+
+	b->rxBuf[FB_PROBE] = c[FBC_PROBE];
+	b->rxBuf[FB_PROBE_TIME] = c[FBC_PROBE_TIME];
+}
+
+/* the command update_cmd sends, which the reply acknowledges */
+static inline u32 command_word(void)
+{
+	if (posmode)
+		return posmode == 2 ? PICNC_PVT : PICNC_POS;
+	return batch ? PICNC_BAT : PICNC_CMD;
+}
+
+/* the reply of one board, once the transfer is done */
+static void read_board(board_t *b, unsigned long timeout)
+{
+	data_t *dat = b->data;
+	s32 accum_diff;
+	int i;
 
 	*(dat->test) = timeout;
 
-	/* clear request, active low */
-	BCM2835_GPSET0 = (1l << 23);
+	/* a reply that fails its CRC was corrupted on the wire, and there
+	   is none if the boards did not raise RDY in time: keep the last
+	   feedback and only give up after a run of them */
+	if (!timeout || !picnc_crc_check((const void *)b->rxBuf,
+	    compact ? FBC_WORDS : FB_WORDS)) {
+		if (timeout)
+			(*(dat->crc_errors))++;
+		if (++b->crc_run >= CRC_MAX_RUN) {
+			*(dat->ready) = 0;
+			*(dat->fault) = 1;
+		}
+		return;
+	}
+	if (b->crc_run)
+		resync_board(b);
+	b->crc_run = 0;
+
+	/* the board took the last >LIM if it sent a good reply since,
+	   see update_health() for the ones it drops */
+	if (b->lim_sent) {
+		b->lim_sent = 0;
+		b->lim_pending = 0;
+	}
 
-	if (timeout) transfer_data();
+	if (compact)
+		expand_reply(b);
 
 	/* sanity check */
-	if (rxBuf[0] == (0x444D433E ^ ~0)) {
+	if (b->rxBuf[0] == (command_word() ^ ~0)) {
 		*(dat->ready) = 1;
 	} else {
 		*(dat->ready) = 0;
-		if (!startup)
-			startup = 1;
+		if (!b->startup)
+			b->startup = 1;
 		else
 			*(dat->fault) = 1;
 	}
 
+	/* update outputs */
+	for (i = 0; i < NUMAXES; i++) {
+		/* the DDS uses 32 bit counter, this code converts
+		   that counter into 64 bits */
+		accum_diff = get_position(b, i) - b->old_count[i];
+		b->old_count[i] = get_position(b, i);
+		b->accum[i] += accum_diff;
+
+		*(dat->position_fb[i]) = (float)(b->accum[i]) * b->scale_inv[i];
+	}
+
+	if (queue)
+		update_queue(b);
+
+	if (*(dat->ready))
+		update_health(b);
+
+	/* update input status */
+	update_inputs(b);
+	if (*(dat->ready)) {
+		update_encoders(b);
+		update_probe(b);
+	}
+}
+
+/* all boards are polled at once, they share the handshake */
+static void read_spi(void *arg, long period)
+{
+	driver_t *d = (driver_t *)arg;
+	picnc_frame f[PICNC_BOARDS_MAX];
+	board_t *b;
+	data_t *dat;
+	int i;
+	unsigned long timeout;
+	long long start, t0, t1;
+
+	start = t0 = rtapi_get_time();
+	timing_check_reset(d);
+
+	/* the >CMD from the last write_spi */
+	transfer_wait();
+	t1 = rtapi_get_time();
+	xfer_ns += t1 - t0;
+
+	/* write_spi raised the request, unless it has not run yet */
+	if (!req_pending)
+		xport->request();
+	req_pending = 0;
+
+	/* the boards sample the feedback */
+	timeout = xport->ready();
+	t0 = rtapi_get_time();
+	timing_add(d, TIMING_HANDSHAKE, t0 - t1);
+
+	/* status poll, only clocks in the feedback words */
+	if (timeout) {
+		for (b = board; b < board + boards; b++) {
+			b->txBuf[0] = compact ? PICNC_STC : PICNC_STA;
+			board_frame(b, &f[b->n]);
+		}
+		xport->start(f, boards);
+	}
+	t1 = rtapi_get_time();
+	xfer_ns += t1 - t0;
+
 	/* check for change in period */
 	if (period != old_dtns) {
 		old_dtns = period;
 		dt = period * 0.000000001;
 		recip_dt = 1.0 / dt;
+		set_max_vel();
 	}
 
 	/* check for scale change */
-	for (i = 0; i < NUMAXES; i++) {
-		if (dat->scale[i] != old_scale[i]) {
-			old_scale[i] = dat->scale[i];
+	for (b = board; b < board + boards; b++) {
+		dat = b->data;
+		for (i = 0; i < NUMAXES; i++) {
+			if (dat->scale[i] == b->old_scale[i])
+				continue;
+			b->old_scale[i] = dat->scale[i];
 			/* scale must not be 0 */
 			if ((dat->scale[i] < 1e-20) && (dat->scale[i] > -1e-20))
 				dat->scale[i] = 1.0;
-			scale_inv[i] = (1.0 / STEP_MASK) / dat->scale[i];
+			b->scale_inv[i] = (1.0 / STEP_MASK) / dat->scale[i];
 		}
 	}
 
-	/* update outputs */
-	for (i = 0; i < NUMAXES; i++) {
-		/* the DDS uses 32 bit counter, this code converts
-		   that counter into 64 bits */
-		accum_diff = get_position(i) - old_count[i];
-		old_count[i] = get_position(i);
-		accum[i] += accum_diff;
+	t0 = rtapi_get_time();
+	transfer_wait();
+	t1 = rtapi_get_time();
+	xfer_ns += t1 - t0;
+	timing_add(d, TIMING_TRANSFER, xfer_ns);
+	xfer_ns = 0;
 
-		*(dat->position_fb[i]) = (float)(accum[i]) * scale_inv[i];
-	}
+	for (b = board; b < board + boards; b++)
+		read_board(b, timeout);
 
-	/* update input status */
-	update_inputs(dat);
+	timing_add(d, TIMING_READ, rtapi_get_time() - start);
 }
 
+/* the frames of all boards go out in one batch */
 static void write_spi(void *arg, long period)
 {
-	transfer_data();
+	driver_t *d = (driver_t *)arg;
+	picnc_frame f[3 * PICNC_BOARDS_MAX];
+	board_t *b;
+	long long start;
+	int n = 0;
+
+	start = rtapi_get_time();
+
+	for (b = board; b < board + boards; b++) {
+		/* new limits and outputs go out ahead of the command */
+		if (b->lim_pending) {
+			picnc_crc_seal(b->limBuf, LIM_WORDS);
+			f[n].tx = b->limBuf;
+			f[n].rx = b->limRx;
+			f[n].len = LIM_WORDS * 4;
+			f[n++].board = b->n;
+			b->lim_sent = 1;
+			b->lim_age = 0;
+		}
+		if (b->out_pending) {
+			picnc_crc_seal(b->outBuf, OUT_WORDS);
+			f[n].tx = b->outBuf;
+			f[n].rx = b->outRx;
+			f[n].len = OUT_WORDS * 4;
+			f[n++].board = b->n;
+			b->out_pending = 0;
+			b->out_age = 0;
+		}
+
+		/* read_spi collects the reply */
+		board_frame(b, &f[n++]);
+	}
+	xport->start(f, n);
+
+	xfer_ns += rtapi_get_time() - start;
+
+	/* the boards have a whole period to answer the next read_spi */
+	xport->request();
+	req_pending = 1;
+
+	timing_add(d, TIMING_WRITE, rtapi_get_time() - start);
 }
 
-static inline void update_outputs(data_t *dat)
+static inline void update_outputs(board_t *b)
 {
+	data_t *dat = b->data;
 	float duty;
 	int n;
 	u32 x[3];
@@ -363,7 +1438,10 @@ static inline void update_outputs(data_t *dat)
 	for (n = 0, y = 0; n < 12; n++)
 		y |= (*(dat->out[n]) ? 1l : 0) << n;
 
-	txBuf[1 + NUMAXES] = y;
+	if (y != b->outBuf[OUT_OUTPUTS]) {
+		b->outBuf[OUT_OUTPUTS] = y;
+		b->out_pending = 1;
+	}
 
 	/* update pwm */
 	for (n = 0; n < 3; n++) {
@@ -373,296 +1451,387 @@ static inline void update_outputs(data_t *dat)
 
 		x[n] = (duty * (1.0 + pwm_period));
 	}
-	txBuf[2+NUMAXES] = x[0] << 16 | x[1];
-	txBuf[3+NUMAXES] = x[2] << 16;
+	y = x[0] << 16 | x[1];
+	if (y != b->outBuf[OUT_PWM(0)]) {
+		b->outBuf[OUT_PWM(0)] = y;
+		b->out_pending = 1;
+	}
+	y = x[2] << 16;
+	if (y != b->outBuf[OUT_PWM(1)]) {
+		b->outBuf[OUT_PWM(1)] = y;
+		b->out_pending = 1;
+	}
+
+	/* a dropped >OUT, or a board reset, is put right in time */
+	if (++b->out_age >= OUT_REFRESH)
+		b->out_pending = 1;
+
+	b->outBuf[0] = PICNC_OUT;
 }
 
-static void update(void *arg, long period)
+/* segment length in ticks, trimmed to hold the board queue level at
+   one servo period below its depth; this also takes up the drift
+   between the Pi and PIC clocks. A batch is cut into n segments. */
+static inline u32 segment_ticks(board_t *b, long period, int n)
 {
-	int i;
-	data_t *dat = (data_t *)arg;
-	double max_accl, vel_cmd, dv, new_vel,
-	       dp, pos_cmd, curr_pos, match_accl, match_time, avg_v,
-	       est_out, est_cmd, est_err;
+	double nominal, adj;
+
+	nominal = period * (picnc_basefreq * 0.000000001);
+	adj = ((queue - 1) * n - b->seg_level) * nominal / (32.0 * n);
+
+	if (adj > nominal / 8.0)
+		adj = nominal / 8.0;
+	else if (adj < -nominal / 8.0)
+		adj = -nominal / 8.0;
+
+	nominal += adj + 0.5;
+	if (nominal < n)
+		return n;
+	if (nominal > 65535.0)
+		return 65535;
+	return (u32)nominal;
+}
 
-	for (i = 0; i < NUMAXES; i++) {
-		/* set internal accel limit to its absolute max, which is
-		   zero to full speed in one thread period */
-		max_accl = max_vel * recip_dt;
-
-		/* check for user specified accel limit parameter */
-		if (dat->maxaccel[i] <= 0.0) {
-			/* set to zero if negative */
-			dat->maxaccel[i] = 0.0;
+/* accel limit in counts/sec^2 */
+static inline double accel_limit(board_t *b, int i)
+{
+	data_t *dat = b->data;
+	double max_accl;
+
+	/* set internal accel limit to its absolute max, which is
+	   zero to full speed in one thread period */
+	max_accl = b->max_vel[i] * recip_dt;
+
+	/* check for user specified accel limit parameter */
+	if (dat->maxaccel[i] <= 0.0) {
+		/* set to zero if negative */
+		dat->maxaccel[i] = 0.0;
+	} else {
+		/* parameter is non-zero, compare to max_accl */
+		if ((dat->maxaccel[i] * fabs(dat->scale[i])) > max_accl) {
+			/* parameter is too high, lower it */
+			dat->maxaccel[i] = max_accl / fabs(dat->scale[i]);
 		} else {
-			/* parameter is non-zero, compare to max_accl */
-			if ((dat->maxaccel[i] * fabs(dat->scale[i])) > max_accl) {
-				/* parameter is too high, lower it */
-				dat->maxaccel[i] = max_accl / fabs(dat->scale[i]);
-			} else {
-				/* lower limit to match parameter */
-				max_accl = dat->maxaccel[i] * fabs(dat->scale[i]);
-			}
+			/* lower limit to match parameter */
+			max_accl = dat->maxaccel[i] * fabs(dat->scale[i]);
 		}
+	}
 
-		/* calculate position command in counts */
-		pos_cmd = *(dat->position_cmd[i]) * dat->scale[i];
-		/* calculate velocity command in counts/sec */
-		vel_cmd = (pos_cmd - old_pos[i]) * recip_dt;
-		old_pos[i] = pos_cmd;
+	return max_accl;
+}
 
-		/* apply frequency limit */
-		if (vel_cmd > max_vel) {
-			vel_cmd = max_vel;
-		} else if (vel_cmd < -max_vel) {
-			vel_cmd = -max_vel;
-		}
+/* position mode: the board ramps to the targets itself, only the
+   limits are worked out here */
+static inline void update_targets(board_t *b, long period)
+{
+	data_t *dat = b->data;
+	double pos_cmd;
+	s32 x;
+	int i;
 
-		/* determine which way we need to ramp to match velocity */
-		if (vel_cmd > old_vel[i])
-			match_accl = max_accl;
-		else
-			match_accl = -max_accl;
-
-		/* determine how long the match would take */
-		match_time = (vel_cmd - old_vel[i]) / match_accl;
-		/* calc output position at the end of the match */
-		avg_v = (vel_cmd + old_vel[i]) * 0.5;
-		curr_pos = (double)(accum[i]) * (1.0 / STEP_MASK);
-		est_out = curr_pos + avg_v * match_time;
-		/* calculate the expected command position at that time */
-		est_cmd = pos_cmd + vel_cmd * (match_time - 1.5 * dt);
-		/* calculate error at that time */
-		est_err = est_out - est_cmd;
-
-		if (match_time < dt) {
-			/* we can match velocity in one period */
-			if (fabs(est_err) < 0.0001) {
-				/* after match the position error will be acceptable */
-				/* so we just do the velocity match */
-				new_vel = vel_cmd;
-			} else {
-				/* try to correct position error */
-				new_vel = vel_cmd - 0.5 * est_err * recip_dt;
-				/* apply accel limits */
-				if (new_vel > (old_vel[i] + max_accl * dt)) {
-					new_vel = old_vel[i] + max_accl * dt;
-				} else if (new_vel < (old_vel[i] - max_accl * dt)) {
-					new_vel = old_vel[i] - max_accl * dt;
-				}
-			}
-		} else {
-			/* calculate change in final position if we ramp in the
-			opposite direction for one period */
-			dv = -2.0 * match_accl * dt;
-			dp = dv * match_time;
-			/* decide which way to ramp */
-			if (fabs(est_err + dp * 2.0) < fabs(est_err)) {
-				match_accl = -match_accl;
-			}
-			/* and do it */
-			new_vel = old_vel[i] + match_accl * dt;
-		}
+	x = period * (picnc_basefreq * 0.000000001) + 0.5;
+	if (x != b->limBuf[LIM_PERIOD]) {
+		b->limBuf[LIM_PERIOD] = x;
+		b->lim_pending = 1;
+	}
 
-		/* apply frequency limit */
-		if (new_vel > max_vel) {
-			new_vel = max_vel;
-		} else if (new_vel < -max_vel) {
-			new_vel = -max_vel;
+	for (i = 0; i < NUMAXES; i++) {
+		x = accel_limit(b, i) * ACCELSCALE * PICNC_RAMP_TICKS + 0.5;
+		if (x < 1)
+			x = 1;
+		if (x != b->limBuf[LIM_ACCEL(i)]) {
+			b->limBuf[LIM_ACCEL(i)] = x;
+			b->lim_pending = 1;
 		}
 
-		old_vel[i] = new_vel;
-		/* calculate new velocity cmd */
-		update_velocity(i, (new_vel * VELSCALE));
+		/* calculate position command in counts, only the low
+		   32 bits of the DDS position are sent */
+		pos_cmd = *(dat->position_cmd[i]) * dat->scale[i];
+		update_target(b, i, (s64)(pos_cmd * STEP_MASK));
 	}
 
-	update_outputs(dat);
+	/* the board drops its limits when it resets */
+	if (++b->lim_age >= LIM_REFRESH)
+		b->lim_pending = 1;
 
-	/* this is a command (>CMD) */
-	txBuf[0] = 0x444D433E;
+	b->limBuf[0] = PICNC_LIM;
 }
 
-void transfer_data()
+/* cubic mode: each target goes out with the command velocity at it,
+   taken from the last three position commands */
+static inline void update_curve(board_t *b, long period)
 {
-	char *buf;
+	data_t *dat = b->data;
+	double pos_cmd, vel_cmd;
+	s32 x;
 	int i;
 
-	/* activate transfer */
-	BCM2835_SPICS = SPI_CS_TA;
-
-	/* send txBuf */
-	buf = (char *)txBuf;
-	for (i=0; i<SPIBUFSIZE; i++) {
-		BCM2835_SPIFIFO = *buf++;
-	}
+	x = period * (picnc_basefreq * 0.000000001) + 0.5;
+	if (x < 2)
+		x = 2;
+	else if (x > 0xFFFF)
+		x = 0xFFFF;
 
-	/* wait until transfer is finished */
-	while (!(BCM2835_SPICS & SPI_CS_DONE));
+	for (i = 0; i < NUMAXES; i++) {
+		/* calculate position command in counts */
+		pos_cmd = *(dat->position_cmd[i]) * dat->scale[i];
+		/* second order backward difference, in counts/sec */
+		vel_cmd = (1.5 * pos_cmd - 2.0 * b->old_pos[i] +
+			0.5 * b->old_pos2[i]) * recip_dt;
+		b->old_pos2[i] = b->old_pos[i];
+		b->old_pos[i] = pos_cmd;
 
-	/* clear DONE bit */
-	BCM2835_SPICS = SPI_CS_DONE;
+		/* apply frequency limit */
+		if (vel_cmd > b->max_vel[i]) {
+			vel_cmd = b->max_vel[i];
+		} else if (vel_cmd < -b->max_vel[i]) {
+			vel_cmd = -b->max_vel[i];
+		}
 
-	/* read buffer */
-	buf = (char *)rxBuf;
-	for (i=0; i<SPIBUFSIZE; i++) {
-		*buf++ = BCM2835_SPIFIFO;
+		update_target(b, i, (s64)(pos_cmd * STEP_MASK));
+		update_target_vel(b, i, vel_cmd * VELSCALE);
 	}
+
+	b->txBuf[CMD_SEGMENT] = SEGMENT(0, x);
 }
 
-int map_gpio()
+/* velocity for the next h seconds, that matches the command velocity
+   and takes up the position error within the accel limit */
+static inline double match_velocity(board_t *b, int i, double max_accl,
+	double pos_cmd, double vel_cmd, double curr_pos, double h)
 {
-	int fd;
+	double dv, new_vel, dp, match_accl, match_time, avg_v,
+	       est_out, est_cmd, est_err;
 
-	fd = open("/dev/mem", O_RDWR | O_SYNC);
-	if (fd < 0) {
-		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't open /dev/mem \n",modname);
-		return -1;
+	/* determine which way we need to ramp to match velocity */
+	if (vel_cmd > b->old_vel[i])
+		match_accl = max_accl;
+	else
+		match_accl = -max_accl;
+
+	/* determine how long the match would take */
+	match_time = (vel_cmd - b->old_vel[i]) / match_accl;
+	/* calc output position at the end of the match */
+	avg_v = (vel_cmd + b->old_vel[i]) * 0.5;
+	est_out = curr_pos + avg_v * match_time;
+	/* calculate the expected command position at that time */
+	est_cmd = pos_cmd + vel_cmd * (match_time - 1.5 * h);
+	/* calculate error at that time */
+	est_err = est_out - est_cmd;
+
+	if (match_time < h) {
+		/* we can match velocity in one period */
+		if (fabs(est_err) < 0.0001) {
+			/* after match the position error will be acceptable */
+			/* so we just do the velocity match */
+			new_vel = vel_cmd;
+		} else {
+			/* try to correct position error */
+			new_vel = vel_cmd - 0.5 * est_err / h;
+			/* apply accel limits */
+			if (new_vel > (b->old_vel[i] + max_accl * h)) {
+				new_vel = b->old_vel[i] + max_accl * h;
+			} else if (new_vel < (b->old_vel[i] - max_accl * h)) {
+				new_vel = b->old_vel[i] - max_accl * h;
+			}
+		}
+	} else {
+		/* calculate change in final position if we ramp in the
+		opposite direction for one period */
+		dv = -2.0 * match_accl * h;
+		dp = dv * match_time;
+		/* decide which way to ramp */
+		if (fabs(est_err + dp * 2.0) < fabs(est_err)) {
+			match_accl = -match_accl;
+		}
+		/* and do it */
+		new_vel = b->old_vel[i] + match_accl * h;
 	}
 
-	/* mmap GPIO */
-	gpio = mmap(
-		   NULL,
-		   BLOCK_SIZE,
-		   PROT_READ|PROT_WRITE,
-		   MAP_SHARED,
-		   fd,
-		   BCM2835_GPIO_BASE);
-
-	if (gpio == MAP_FAILED) {
-		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map gpio\n",modname);
-		close(fd);
-		return -1;
+	/* apply frequency limit */
+	if (new_vel > b->max_vel[i]) {
+		new_vel = b->max_vel[i];
+	} else if (new_vel < -b->max_vel[i]) {
+		new_vel = -b->max_vel[i];
 	}
 
-	/* mmap SPI */
-	spi = mmap(
-		  NULL,
-		  BLOCK_SIZE,
-		  PROT_READ|PROT_WRITE,
-		  MAP_SHARED,
-		  fd,
-		  BCM2835_SPI_BASE);
+	b->old_vel[i] = new_vel;
+	return new_vel;
+}
 
-	close(fd);
+/* sample k of axis i, the samples after it start where it ends */
+static inline void put_sample(board_t *b, int i, int k, s32 vel, int n,
+	u32 ticks, s64 *travel)
+{
+	if (batch) {
+		b->txBuf[BAT_VEL(k, i)] = vel;
+		*travel += (s64)vel * picnc_batch_ticks(ticks, n, k);
+	} else {
+		update_velocity(b, i, vel);
+	}
+}
 
-	if (spi == MAP_FAILED) {
-		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map spi\n",modname);
-		return -1;
+static inline void update_axis(board_t *b, int i, int n, u32 ticks)
+{
+	data_t *dat = b->data;
+	int k;
+	s64 travel;
+	double max_accl, vel_cmd, pos_cmd, pos_start, curr_pos;
+
+	max_accl = accel_limit(b, i);
+
+	/* calculate position command in counts */
+	pos_cmd = *(dat->position_cmd[i]) * dat->scale[i];
+	/* calculate velocity command in counts/sec */
+	vel_cmd = (pos_cmd - b->old_pos[i]) * recip_dt;
+	pos_start = b->old_pos[i];
+	b->old_pos[i] = pos_cmd;
+
+	/* apply frequency limit */
+	if (vel_cmd > b->max_vel[i]) {
+		vel_cmd = b->max_vel[i];
+	} else if (vel_cmd < -b->max_vel[i]) {
+		vel_cmd = -b->max_vel[i];
 	}
 
-	return 0;
+	/* a batch follows the command across the period, moved on
+	   linearly, one sample at a time; with the queue, each sample
+	   only starts once the ones before it have been played */
+	travel = 0;
+	for (k = 0; k < n; k++) {
+		curr_pos = (double)(b->accum[i] + b->inflight[i] + travel) *
+			(1.0 / STEP_MASK);
+		put_sample(b, i, k, match_velocity(b, i, max_accl, pos_start +
+			(pos_cmd - pos_start) * (k + 1) / n, vel_cmd,
+			curr_pos, dt / n) * VELSCALE, n, ticks, &travel);
+	}
 }
 
-/*    GPIO USAGE
- *
- *	GPIO	Dir	Signal		Note
- *
- *	25	IN	DATA READY	active low
- *	9	IN	MISO		SPI
- *	23	OUT	DATA REQUEST	active low
- *	10	OUT	MOSI		SPI
- *	11	OUT	SCLK		SPI
- *	7	OUT	RESET		active low
- *
- */
+/* the same in DDS units with the fixed point planner */
+static inline void update_axis_fixed(board_t *b, int i, int n, u32 ticks,
+	long period)
+{
+	data_t *dat = b->data;
+	planner_axis *p = &b->plan[i];
+	s64 pos_cmd, pos_start, vel_cmd, travel;
+	int k;
+
+	if ((dat->scale[i] != b->plan_scale[i]) ||
+	    (dat->maxaccel[i] != b->plan_accel[i]) ||
+	    (period != b->plan_dtns[i])) {
+		planner_setup(p, b->max_vel[i], accel_limit(b, i), dt, n);
+		b->plan_scale[i] = dat->scale[i];
+		b->plan_accel[i] = dat->maxaccel[i];
+		b->plan_pos_scale[i] = dat->scale[i] * STEP_MASK *
+			(double)(1 << PLAN_POS_FRAC);
+		b->plan_dtns[i] = period;
+	}
+
+	pos_start = p->old_pos;
+	pos_cmd = *(dat->position_cmd[i]) * b->plan_pos_scale[i];
+	vel_cmd = planner_command(p, pos_cmd);
+
+	travel = 0;
+	for (k = 0; k < n; k++)
+		put_sample(b, i, k, planner_sample(p, pos_start +
+			(pos_cmd - pos_start) * (k + 1) / n, vel_cmd,
+			(b->accum[i] + b->inflight[i] + travel) *
+			(1 << PLAN_POS_FRAC)) / (1 << PLAN_VEL_FRAC),
+			n, ticks, &travel);
+}
 
-void setup_gpio()
+static inline void update_cmd(board_t *b, long period)
 {
-	u32 x;
+	int i, k, n = batch ? batch : 1;
+	u32 ticks = 0, s;
 
-	/* data ready GPIO 25, input */
-	x = BCM2835_GPFSEL2;
-	x &= ~(0b111 << (5*3));
-	BCM2835_GPFSEL2 = x;
+	if (posmode == 2) {
+		update_curve(b, period);
+		update_outputs(b);
 
-	/* data request GPIO 23, output */
-	x = BCM2835_GPFSEL2;
-	x &= ~(0b111 << (3*3));
-	x |= (0b001 << (3*3));
-	BCM2835_GPFSEL2 = x;
+		/* this is a cubic segment (>PVT) */
+		b->txBuf[0] = PICNC_PVT;
+		return;
+	}
 
-	/* reset GPIO 7, output */
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (7*3));
-	x |= (0b001 << (7*3));
-	BCM2835_GPFSEL0 = x;
+	if (posmode) {
+		update_targets(b, period);
+		update_outputs(b);
+		b->txBuf[CMD_SEGMENT] = 0;
 
-	/* change SPI pins */
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (9*3));
-	x |=   (0b100 << (9*3));
-	BCM2835_GPFSEL0 = x;
+		/* this is a position command (>POS) */
+		b->txBuf[0] = PICNC_POS;
+		return;
+	}
 
-	x = BCM2835_GPFSEL1;
-	x &= ~(0b111 << (0*3) | 0b111 << (1*3));
-	x |= (0b100 << (0*3) | 0b100 << (1*3));
-	BCM2835_GPFSEL1 = x;
+	if (queue)
+		ticks = segment_ticks(b, period, n);
 
-	/* set up SPI */
-	BCM2835_SPICLK = SPICLKDIV;
+	for (i = 0; i < NUMAXES; i++) {
+		if (fixed)
+			update_axis_fixed(b, i, n, ticks, period);
+		else
+			update_axis(b, i, n, ticks);
+	}
 
-	BCM2835_SPICS = 0;
+	update_outputs(b);
 
-	/* clear FIFOs */
-	BCM2835_SPICS |= SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX;
+	if (queue) {
+		for (k = 0; k < n; k++) {
+			s = (b->seg_seq + k) & SEG_HIST_MASK;
+			for (i = 0; i < NUMAXES; i++)
+				b->seg_hist[s].vel[i] = b->txBuf[BAT_VEL(k, i)];
+			b->seg_hist[s].ticks = batch ?
+				picnc_batch_ticks(ticks, n, k) : ticks;
+		}
+		if (batch)
+			b->txBuf[CMD_SEGMENT] = BATCH(n, b->seg_seq, ticks);
+		else
+			b->txBuf[CMD_SEGMENT] = SEGMENT(b->seg_seq, ticks);
+		b->seg_seq = (b->seg_seq + n) & 0xFF;
+	} else {
+		b->txBuf[CMD_SEGMENT] = 0;
+	}
 
-	/* clear done bit */
-	BCM2835_SPICS |= SPI_CS_DONE;
+	/* this is a command (>CMD), or a batch of them (>BAT) */
+	b->txBuf[0] = batch ? PICNC_BAT : PICNC_CMD;
 }
 
-void restore_gpio()
+static void update(void *arg, long period)
 {
-	u32 x;
-
-	/* change all used pins back to inputs */
-
-	/* GPIO 7 */
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (7*3));
-	BCM2835_GPFSEL0 = x;
-
-	/* GPIO 23 */
-	x = BCM2835_GPFSEL2;
-	x &= ~(0b111 << (3*3));
-	BCM2835_GPFSEL2 = x;
-
-	/* GPIO 25 */
-	x = BCM2835_GPFSEL2;
-	x &= ~(0b111 << (5*3));
-	BCM2835_GPFSEL2 = x;
-
-	/* change SPI pins to inputs*/
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (9*3));
-	BCM2835_GPFSEL0 = x;
-
-	x = BCM2835_GPFSEL1;
-	x &= ~(0b111 << (0*3) | 0b111 << (1*3));
-	BCM2835_GPFSEL1 = x;
+	driver_t *d = (driver_t *)arg;
+	board_t *b;
+	long long start;
+
+	start = rtapi_get_time();
+	for (b = board; b < board + boards; b++)
+		update_cmd(b, period);
+	timing_add(d, TIMING_UPDATE, rtapi_get_time() - start);
 }
 
-void reset_board()
+static void transfer_data(board_t *b)
 {
-	u32 x,i;
+	picnc_frame f;
 
-	/* GPIO 7 is configured as a tri-state output pin */
-
-	/* set as output GPIO 7 */
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (7*3));
-	x |= (0b001 << (7*3));
-	BCM2835_GPFSEL0 = x;
+	board_frame(b, &f);
+	xport->start(&f, 1);
+	transfer_wait();
+}
 
-	/* board reset is active low */
-	for (i=0; i<0x10000; i++)
-		BCM2835_GPCLR0 = (1l << 7);
+/* the frame length follows from the command in txBuf[0]; the
+   transfer may only be started, see transfer_wait() */
+static void board_frame(board_t *b, picnc_frame *f)
+{
+	int n = picnc_frame_words(b->txBuf[0]);
 
-	/* wait until the board is ready */
-	for (i=0; i<0x300000; i++)
-		BCM2835_GPSET0 = (1l << 7);
+	picnc_crc_seal((void *)b->txBuf, n);
+	f->tx = (const void *)b->txBuf;
+	f->rx = (void *)b->rxBuf;
+	f->len = n * 4;
+	f->board = b->n;
+}
 
-	/* reset GPIO 7 back to input */
-	x = BCM2835_GPFSEL0;
-	x &= ~(0b111 << (7*3));
-	BCM2835_GPFSEL0 = x;
+static void transfer_wait()
+{
+	xport->wait();
 }
@@ -18,52 +18,89 @@
 #ifndef PICNC_H
 #define PICNC_H
 
-#define SPICLKDIV		16		/* ~15 Mhz */
-#define NUMAXES			4		/* X Y Z A */
+#include "picnc_proto.h"	/* NUMAXES, frame layout */
+
+#define MODNAME			"picnc"
+
+#define PICNC_BOARDS_MAX	2		/* on CE0 and CE1 */
+
+#define SPICLKDIV		16		/* ~15 Mhz, until calibrated */
+#define SPI_SPEED_HZ		(BCM2835_CORE_CLK/SPICLKDIV)	/* for spidev */
+
+/* between frames sent back to back, the board restarts its SPI DMA */
+#define PICNC_FRAME_GAP_US	10
 
 #define REQ_TIMEOUT		10000ul
+#define CRC_MAX_RUN		3		/* bad replies in a row, fault */
+#define OUT_REFRESH		64		/* most cycles between >OUT */
+#define LIM_REFRESH		64		/* most cycles between >LIM */
 
-#define SPIBUFSIZE		32		/* SPI buffer size */
-#define BUFSIZE			(SPIBUFSIZE/4)
+/* SPI clock calibration at load, see calibrate_spiclk() */
+#define SPICLK_EXCHANGES	32		/* >TST echoes per divisor */
+#define SPICLK_MARGIN		1		/* steps back from the fastest */
+#define SPICLK_BATCH		8		/* >TST frames per transfer */
 
-#define STEPBIT			23		/* bit location in DDS accum */
 #define STEP_MASK		(1<<STEPBIT)
 
-#define BASEFREQ		160000ul	/* Base freq of the PIC stepgen in Hz */
+#define BASEFREQ		160000ul	/* default stepgen base freq, Hz */
 #define SYS_FREQ		(80000000ul)    /* 80 MHz */
+#define CORE_TIMER_FREQ		(SYS_FREQ/2)
+#define CORE_TIMER_NS		(2000000000ul/SYS_FREQ)	/* per count */
 
-#define PERIODFP 		((double)1.0 / (double)(BASEFREQ))
+/* the base frequency the board acknowledged, in Hz, see picnc.c */
+extern double picnc_basefreq;
+
+#define PERIODFP 		((double)1.0 / picnc_basefreq)
 #define VELSCALE		((double)STEP_MASK * PERIODFP)
 #define ACCELSCALE		(VELSCALE * PERIODFP)
 
-#define get_position(a)		(rxBuf[1 + (a)])
-#define get_inputs()		(rxBuf[1 + NUMAXES])
-#define set_outputs		(txBuf[1 + NUMAXES])
-#define get_adc(a)		(rxBuf[2 + NUMAXES + a])
-#define update_velocity(a, b)	(txBuf[1 + (a)] = (b))
+/* the frames of board b, see picnc.c */
+#define get_position(b, a)	((b)->rxBuf[FB_POS(a)])
+#define get_inputs(b)		((b)->rxBuf[FB_INPUTS])
+#define get_adc(b, a)		((b)->rxBuf[FB_ADC(a)])
+#define update_velocity(b, a, v)	((b)->txBuf[CMD_VEL(a)] = (v))
+#define update_target(b, a, v)	((b)->txBuf[CMD_POS(a)] = (s32)(v))
+#define update_target_vel(b, a, v)	((b)->txBuf[PVT_VEL(a)] = (s32)(v))
+
+/* the command frame board n last sent, for the host tools */
+const volatile int32_t *picnc_command(int n);
 
 /* Broadcom defines */
 
+#define BCM2835_CORE_CLK	250000000ul
 #define BCM2835_PERI_BASE	0x20000000
 #define BCM2835_GPIO_BASE	(BCM2835_PERI_BASE + 0x200000) /* GPIO controller */
 #define BCM2835_SPI_BASE	(BCM2835_PERI_BASE + 0x204000) /* SPI controller */
+#define BCM2835_DMA_BASE	(BCM2835_PERI_BASE + 0x007000) /* DMA controller */
+
+/* the host build goes through the register mock, see sim/bcm2835_mock.h */
+#if defined(PICNC_MOCK)
+#include "bcm2835_mock.h"
+#define BCM2835_REG(base, n)	(*bcm2835_mock_reg((base) + (n)))
+#else
+#define BCM2835_REG(base, n)	(*((base) + (n)))
+#endif
 
-#define BCM2835_GPFSEL0		*(gpio)
-#define BCM2835_GPFSEL1		*(gpio + 1)
-#define BCM2835_GPFSEL2		*(gpio + 2)
-#define BCM2835_GPFSEL3		*(gpio + 3)
-#define BCM2835_GPFSEL4		*(gpio + 4)
-#define BCM2835_GPFSEL5		*(gpio + 5)
-#define BCM2835_GPSET0		*(gpio + 7)
-#define BCM2835_GPSET1		*(gpio + 8)
-#define BCM2835_GPCLR0		*(gpio + 10)
-#define BCM2835_GPCLR1		*(gpio + 11)
-#define BCM2835_GPLEV0		*(gpio + 13)
-#define BCM2835_GPLEV1		*(gpio + 14)
-
-#define BCM2835_SPICS 		*(spi + 0)
-#define BCM2835_SPIFIFO     	*(spi + 1)
-#define BCM2835_SPICLK 		*(spi + 2)
+#define BCM2835_GPFSEL0		BCM2835_REG(gpio, 0)
+#define BCM2835_GPFSEL1		BCM2835_REG(gpio, 1)
+#define BCM2835_GPFSEL2		BCM2835_REG(gpio, 2)
+#define BCM2835_GPFSEL3		BCM2835_REG(gpio, 3)
+#define BCM2835_GPFSEL4		BCM2835_REG(gpio, 4)
+#define BCM2835_GPFSEL5		BCM2835_REG(gpio, 5)
+#define BCM2835_GPFSEL(pin)	BCM2835_REG(gpio, (pin) / 10)
+#define BCM2835_GPSET0		BCM2835_REG(gpio, 7)
+#define BCM2835_GPSET1		BCM2835_REG(gpio, 8)
+#define BCM2835_GPCLR0		BCM2835_REG(gpio, 10)
+#define BCM2835_GPCLR1		BCM2835_REG(gpio, 11)
+#define BCM2835_GPLEV0		BCM2835_REG(gpio, 13)
+#define BCM2835_GPLEV1		BCM2835_REG(gpio, 14)
+
+#define BCM2835_SPICS 		BCM2835_REG(spi, 0)
+#define BCM2835_SPIFIFO     	BCM2835_REG(spi, 1)
+#define BCM2835_SPICLK 		BCM2835_REG(spi, 2)
+#define BCM2835_SPIDLEN		BCM2835_REG(spi, 3)
+
+#define SPI_FIFO_SIZE		64		/* bytes, TX and RX each */
 
 #define SPI_CS_LEN_LONG		0x02000000
 #define SPI_CS_DMA_LEN		0x01000000
@@ -89,6 +126,49 @@
 #define SPI_CS_CPHA		0x00000004
 #define SPI_CS_CS_10		0x00000002
 #define SPI_CS_CS_01		0x00000001
+#define SPI_CS_CS(n)		((n) & (SPI_CS_CS_10 | SPI_CS_CS_01))
+
+/* DMA channels 0-14, 0x100 bytes apart */
+#define BCM2835_DMACS(c)	BCM2835_REG(dmac, (c)*0x40 + 0)
+#define BCM2835_DMACONBLK(c)	BCM2835_REG(dmac, (c)*0x40 + 1)
+#define BCM2835_DMADEBUG(c)	BCM2835_REG(dmac, (c)*0x40 + 8)
+#define BCM2835_DMAENABLE	BCM2835_REG(dmac, 0xFF0/4)
+
+#define DMA_CS_RESET		0x80000000
+#define DMA_CS_ABORT		0x40000000
+#define DMA_CS_WAIT_WRITES	0x10000000
+#define DMA_CS_ERROR		0x00000100
+#define DMA_CS_END		0x00000002
+#define DMA_CS_ACTIVE		0x00000001
+
+#define DMA_TI_PERMAP(x)	((x) << 16)
+#define DMA_TI_SRC_IGNORE	0x00000800
+#define DMA_TI_SRC_DREQ		0x00000400
+#define DMA_TI_SRC_INC		0x00000100
+#define DMA_TI_DEST_IGNORE	0x00000080
+#define DMA_TI_DEST_DREQ	0x00000040
+#define DMA_TI_DEST_INC		0x00000010
+#define DMA_TI_WAIT_RESP	0x00000008
+
+#define DMA_DREQ_SPI_TX		6
+#define DMA_DREQ_SPI_RX		7
+
+/* control block, 32 byte aligned */
+typedef struct {
+	u32 ti;
+	u32 source_ad;
+	u32 dest_ad;
+	u32 txfr_len;
+	u32 stride;
+	u32 nextconbk;
+	u32 pad[2];
+} bcm2835_dma_cb;
+
+/* the DMA engine sees the peripherals at 0x7E000000 and SDRAM through
+   the L2 cache alias at 0x40000000 */
+#define BCM2835_BUS_PERI(x)	((x) - BCM2835_PERI_BASE + 0x7E000000)
+#define BCM2835_BUS_SDRAM(x)	((x) | 0x40000000)
+#define BCM2835_SPIFIFO_BUS	BCM2835_BUS_PERI(BCM2835_SPI_BASE + 4)
 
 #define PAGE_SIZE		(4*1024)
 #define BLOCK_SIZE		(4*1024)
@@ -0,0 +1,169 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "rtapi.h"
+
+#include <math.h>
+
+#include "picnc.h"
+#include "planner.h"
+
+#define POS_ONE			(1LL << PLAN_POS_FRAC)
+#define VEL_ONE			(1LL << PLAN_VEL_FRAC)
+
+/* results that would not fit are held here, far beyond anything the
+   limits let through */
+#define PLAN_SAT		(1LL << 62)
+
+/* x as mult * 2^-shift, x > 0 */
+static plan_recip recip(double x)
+{
+	plan_recip r;
+	double m;
+	int e;
+
+	m = frexp(x, &e);
+	r.shift = 32 - e;
+	if (r.shift < 0) {
+		r.mult = 0xFFFFFFFF;
+		r.shift = 0;
+	} else if (r.shift > 95) {
+		r.mult = 0;
+		r.shift = 0;
+	} else {
+		m = m * 4294967296.0 + 0.5;
+		r.mult = m >= 4294967295.0 ? 0xFFFFFFFF : (u32)m;
+	}
+
+	return r;
+}
+
+/* x * r, rounded towards zero, through a 96 bit product */
+static inline s64 mul(s64 x, plan_recip r)
+{
+	u64 a = x < 0 ? -(u64)x : (u64)x, hi, lo, res;
+
+	hi = (a >> 32) * r.mult;
+	lo = (a & 0xFFFFFFFF) * r.mult;
+
+	if (r.shift >= 64) {
+		res = hi >> (r.shift - 32);
+	} else if (r.shift >= 32) {
+		res = (hi >> (r.shift - 32)) + (lo >> r.shift);
+	} else {
+		if (hi >> (30 + r.shift))
+			return x < 0 ? -PLAN_SAT : PLAN_SAT;
+		res = (hi << (32 - r.shift)) + (lo >> r.shift);
+	}
+
+	if (res > PLAN_SAT)
+		res = PLAN_SAT;
+	return x < 0 ? -(s64)res : (s64)res;
+}
+
+static inline s64 labs64(s64 x)
+{
+	return x < 0 ? -x : x;
+}
+
+void planner_setup(planner_axis *p, double max_vel, double max_accl,
+	double dt, int n)
+{
+	double ticks = dt * picnc_basefreq, h = ticks / n,
+	       accl = max_accl * ACCELSCALE;	/* DDS units/tick^2 */
+
+	p->vmax = max_vel * VELSCALE * VEL_ONE;
+	p->dvh = accl * h * VEL_ONE;
+	if (p->dvh < 1)
+		p->dvh = 1;
+	p->thr = ceil(0.0001 * STEP_MASK * POS_ONE);
+
+	p->vel = recip((double)VEL_ONE / POS_ONE / ticks);
+	p->lead = recip(1.5 * h * POS_ONE / VEL_ONE);
+	p->flip = recip(4.0 * h * POS_ONE / VEL_ONE);
+	/* the velocity change is squared with half its fraction bits,
+	   which keeps it within 64 bits */
+	p->brake = recip(POS_ONE / (2.0 * accl * (1LL << PLAN_VEL_FRAC)));
+	p->corr = recip((double)VEL_ONE / POS_ONE / (2.0 * h));
+}
+
+s64 planner_command(planner_axis *p, s64 pos_cmd)
+{
+	s64 vel_cmd;
+
+	vel_cmd = mul(pos_cmd - p->old_pos, p->vel);
+	p->old_pos = pos_cmd;
+
+	/* apply frequency limit */
+	if (vel_cmd > p->vmax)
+		vel_cmd = p->vmax;
+	else if (vel_cmd < -p->vmax)
+		vel_cmd = -p->vmax;
+
+	return vel_cmd;
+}
+
+/*
+  With dv the change from the last velocity to the command and a the
+  accel limit, the match takes |dv| / a, and the output ends up
+  dv |dv| / 2a behind where it would be at the command velocity. The
+  error against the command 1.5 samples on is then
+
+	err = curr_pos - pos_cmd + 1.5 h vel_cmd - dv |dv| / 2a
+
+  which needs no divide. The rest follows match_velocity().
+*/
+s64 planner_sample(planner_axis *p, s64 pos_cmd, s64 vel_cmd, s64 curr_pos)
+{
+	s64 dv, dvq, err, new_vel, accl;
+
+	dv = vel_cmd - p->old_vel;
+	dvq = dv >> (PLAN_VEL_FRAC / 2);
+	err = curr_pos - pos_cmd + mul(vel_cmd, p->lead) -
+		mul(dvq * labs64(dvq), p->brake);
+
+	if (labs64(dv) < p->dvh) {
+		/* we can match velocity in one sample */
+		if (labs64(err) < p->thr) {
+			new_vel = vel_cmd;
+		} else {
+			/* try to correct position error */
+			new_vel = vel_cmd - mul(err, p->corr);
+			/* apply accel limits */
+			if (new_vel > p->old_vel + p->dvh)
+				new_vel = p->old_vel + p->dvh;
+			else if (new_vel < p->old_vel - p->dvh)
+				new_vel = p->old_vel - p->dvh;
+		}
+	} else {
+		/* ramping the other way for one sample moves the end
+		   of the match by -4 h dv; do so if that gets closer */
+		accl = dv > 0 ? p->dvh : -p->dvh;
+		if (labs64(err - mul(dv, p->flip)) < labs64(err))
+			accl = -accl;
+		new_vel = p->old_vel + accl;
+	}
+
+	/* apply frequency limit */
+	if (new_vel > p->vmax)
+		new_vel = p->vmax;
+	else if (new_vel < -p->vmax)
+		new_vel = -p->vmax;
+
+	p->old_vel = new_vel;
+	return new_vel;
+}
@@ -0,0 +1,77 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef PICNC_PLANNER_H
+#define PICNC_PLANNER_H
+
+#include "rtapi.h"
+
+/*
+  Fixed point velocity planner, for loadrt picnc planner=fixed.
+
+  The velocity match of match_velocity() in picnc.c, worked out in
+  DDS units with integer arithmetic only. It is not bit for bit the
+  same planner: the velocity is held to PLAN_VEL_FRAC bits where the
+  double one is not rounded at all, so the words sent drift a few DDS
+  units apart, most of all where the error sits at the threshold.
+
+	position	DDS units with PLAN_POS_FRAC fraction bits
+	velocity	DDS units per tick with PLAN_VEL_FRAC fraction bits
+
+  The divides of the double planner become multiplies by reciprocals,
+  each held as a 32 bit multiplier and a shift. They only change with
+  the scale, maxaccel or servo period, and planner_setup() works them
+  out again then.
+*/
+
+#define PLAN_POS_FRAC		8
+#define PLAN_VEL_FRAC		16
+
+typedef struct {
+	u32 mult;
+	int shift;
+} plan_recip;
+
+typedef struct {
+	/* from planner_setup() */
+	s64 vmax;			/* velocity limit */
+	s64 dvh;			/* velocity change in one sample */
+	s64 thr;			/* position error taken as none */
+	plan_recip vel,			/* position change to velocity */
+		   lead,		/* velocity to 1.5 samples of travel */
+		   flip,		/* velocity to 4 samples of travel */
+		   brake,		/* velocity^2 to distance to match */
+		   corr;		/* position error to velocity */
+
+	/* state */
+	s64 old_pos;			/* last position command */
+	s64 old_vel;			/* last velocity sent */
+} planner_axis;
+
+/* max_vel in counts/s, max_accl in counts/s^2, dt in s, n samples per
+   servo period */
+void planner_setup(planner_axis *p, double max_vel, double max_accl,
+	double dt, int n);
+
+/* takes the new position command, returns the velocity command */
+s64 planner_command(planner_axis *p, s64 pos_cmd);
+
+/* velocity for the next sample, given the position the command has
+   there and the position the output will have at its start */
+s64 planner_sample(planner_axis *p, s64 pos_cmd, s64 vel_cmd, s64 curr_pos);
+
+#endif
@@ -0,0 +1,500 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rtapi.h"
+#include "picnc.h"
+
+#define MOCK_FIFO_TAG		0xA5000000
+
+/* register offsets in words */
+#define GPFSEL(n)		(n)
+#define GPSET0			7
+#define GPCLR0			10
+#define GPLEV0			13
+
+#define SPICS			0
+#define SPIFIFO			1
+#define SPICLK			2
+#define SPIDLEN			3
+
+#define DMA_CHANNELS		15
+#define DMACS			0
+#define DMACONBLK		1
+#define DMAENABLE		(0xFF0/4)
+
+#define PIN_RESET		7
+#define PIN_RESET2		22		/* with two boards */
+#define PIN_REQ			23
+#define PIN_RDY			25
+#define PIN_RDY2		24		/* of the board on CE1 */
+
+#define SPI_CS_CTRL		(SPI_CS_LEN_LONG | SPI_CS_DMA_LEN |		\
+				 SPI_CS_CSPOL2 | SPI_CS_CSPOL1 |		\
+				 SPI_CS_CSPOL0 | SPI_CS_LEN | SPI_CS_REN |	\
+				 SPI_CS_ADCS | SPI_CS_INTR | SPI_CS_INTD |	\
+				 SPI_CS_DMAEN | SPI_CS_TA | SPI_CS_CSPOL |	\
+				 SPI_CS_CPOL | SPI_CS_CPHA | SPI_CS_CS_10 |	\
+				 SPI_CS_CS_01)
+
+#define MOCK_PAGE_BUS		BCM2835_BUS_SDRAM(0x00123000)
+
+extern volatile unsigned *gpio, *spi, *dmac;
+
+bcm2835_mock_state bcm2835_mock = { .dma_latency = 2 };
+
+static struct {
+	volatile unsigned *reg;
+	unsigned preload;
+	int pending;
+} acc;
+static volatile unsigned slot;
+
+static struct {
+	u32 fsel[6];
+	u32 out;
+	int reset;
+} gp;
+
+static struct {
+	u32 cs;
+	u32 clk;
+	u32 dlen;
+	unsigned char rx[SPI_FIFO_SIZE];
+	int rx_head, rx_count;
+} sp;
+
+typedef struct {
+	int active, end;
+	int moved;			/* data went, END after the polls */
+	int polls;
+	u32 conblk;
+	bcm2835_dma_cb cb;
+} mock_chan;
+
+static mock_chan ch[DMA_CHANNELS];
+static u32 dma_enable;
+static unsigned char *dma_page;
+
+static void error(const char *msg)
+{
+	bcm2835_mock.errors++;
+	fprintf(stderr, "bcm2835 mock: %s\n", msg);
+}
+
+static int is_output(int pin)
+{
+	return ((gp.fsel[pin / 10] >> ((pin % 10) * 3)) & 7) == 1;
+}
+
+static int pin_low(int pin)
+{
+	return is_output(pin) && !(gp.out & (1 << pin));
+}
+
+static int req_active(void)
+{
+	return pin_low(PIN_REQ);
+}
+
+static void update_reset(void)
+{
+	int n, reset = pin_low(PIN_RESET) || pin_low(PIN_RESET2);
+
+	if (reset != gp.reset) {
+		gp.reset = reset;
+		sp.rx_count = 0;
+		for (n = 0; n < BCM2835_MOCK_PEERS; n++)
+			if (bcm2835_mock.peer[n])
+				bcm2835_mock.peer[n]->reset(reset);
+	}
+}
+
+/* the board the chip select picks; a cable too long for the clock:
+   a bit goes wrong every so often */
+static unsigned char exchange(unsigned char mosi)
+{
+	static unsigned garble = 0;
+	const bcm2835_mock_peer *peer = NULL;
+	unsigned char miso;
+
+	if ((sp.cs & 3) < BCM2835_MOCK_PEERS)
+		peer = bcm2835_mock.peer[sp.cs & 3];
+	if (!peer)
+		return 0xFF;
+	miso = peer->xfer(mosi);
+
+	if (sp.clk && (sp.clk < bcm2835_mock.clk_min) && !(++garble % 61))
+		miso ^= 0x08;
+	return miso;
+}
+
+static void *bus_to_virt(u32 bus, u32 len)
+{
+	if (dma_page && (bus >= MOCK_PAGE_BUS) &&
+	    (bus + len <= MOCK_PAGE_BUS + PAGE_SIZE))
+		return dma_page + (bus - MOCK_PAGE_BUS);
+	return NULL;
+}
+
+/* runs the frame once the SPI and both channels are armed; the data
+   moves at once, the channels report done after a few polls */
+static void dma_kick(void)
+{
+	mock_chan *tx = NULL, *rx = NULL;
+	unsigned char *src, *dst;
+	u32 permap, i;
+	int c;
+
+	if ((sp.cs & (SPI_CS_TA | SPI_CS_DMAEN)) != (SPI_CS_TA | SPI_CS_DMAEN))
+		return;
+
+	for (c = 0; c < DMA_CHANNELS; c++) {
+		if (!ch[c].active || ch[c].moved)
+			continue;
+		permap = (ch[c].cb.ti >> 16) & 0x1F;
+		if ((permap == DMA_DREQ_SPI_TX) &&
+		    (ch[c].cb.ti & DMA_TI_DEST_DREQ))
+			tx = &ch[c];
+		if ((permap == DMA_DREQ_SPI_RX) &&
+		    (ch[c].cb.ti & DMA_TI_SRC_DREQ))
+			rx = &ch[c];
+		if (!(dma_enable & (1 << c)))
+			error("DMA channel not enabled");
+	}
+	if (!tx || !rx)
+		return;
+
+	if ((tx->cb.dest_ad != BCM2835_SPIFIFO_BUS) ||
+	    (rx->cb.source_ad != BCM2835_SPIFIFO_BUS) ||
+	    (tx->cb.ti & DMA_TI_DEST_INC) || !(tx->cb.ti & DMA_TI_SRC_INC) ||
+	    (rx->cb.ti & DMA_TI_SRC_INC) || !(rx->cb.ti & DMA_TI_DEST_INC))
+		error("DMA control block does not address the SPI FIFO");
+
+	if ((tx->cb.txfr_len != sp.dlen) || (rx->cb.txfr_len != sp.dlen) ||
+	    (sp.dlen % 4))
+		error("DMA length does not match SPI DLEN");
+
+	src = bus_to_virt(tx->cb.source_ad, tx->cb.txfr_len);
+	dst = bus_to_virt(rx->cb.dest_ad, rx->cb.txfr_len);
+	if (!src || !dst) {
+		error("DMA address outside the DMA page");
+		return;
+	}
+
+	for (i = 0; i < sp.dlen && i < rx->cb.txfr_len; i++)
+		dst[i] = exchange(src[i]);
+
+	tx->moved = rx->moved = 1;
+	tx->polls = rx->polls = bcm2835_mock.dma_latency;
+	bcm2835_mock.dma_frames++;
+}
+
+static u32 dma_cs(mock_chan *c)
+{
+	if (c->moved && !c->polls) {
+		c->moved = 0;
+		c->active = 0;
+		c->end = 1;
+	}
+	return (c->active ? DMA_CS_ACTIVE : 0) | (c->end ? DMA_CS_END : 0);
+}
+
+static void dma_cs_write(mock_chan *c, u32 val)
+{
+	u32 *cb;
+
+	if (val & (DMA_CS_RESET | DMA_CS_ABORT)) {
+		memset(c, 0, sizeof(*c));
+		return;
+	}
+
+	if (val & DMA_CS_END)
+		c->end = 0;
+
+	if ((val & DMA_CS_ACTIVE) && !c->active) {
+		cb = bus_to_virt(c->conblk, sizeof(bcm2835_dma_cb));
+		if (!cb || (c->conblk & 31)) {
+			error("bad DMA control block address");
+			return;
+		}
+		memcpy(&c->cb, cb, sizeof(c->cb));
+		c->active = 1;
+		c->moved = 0;
+		dma_kick();
+	}
+}
+
+/* current value, without side effects */
+static u32 reg_peek(volatile unsigned *reg)
+{
+	int n;
+
+	if (gpio && (reg >= gpio) && (reg < gpio + BLOCK_SIZE/4)) {
+		n = reg - gpio;
+		if (n < 6)
+			return gp.fsel[n];
+		if (n == GPLEV0) {
+			u32 lev = gp.out | (1 << PIN_RDY) | (1 << PIN_RDY2);
+
+			/* the boards answer a request with RDY low */
+			if (req_active() && bcm2835_mock.peer[0])
+				lev &= ~(1 << PIN_RDY);
+			if (req_active() && bcm2835_mock.peer[1])
+				lev &= ~(1 << PIN_RDY2);
+			return lev;
+		}
+		return 0;
+	}
+
+	if (spi && (reg >= spi) && (reg < spi + BLOCK_SIZE/4)) {
+		switch (reg - spi) {
+		case SPICS:
+			return sp.cs | (sp.rx_count ? SPI_CS_RXD : 0) |
+				SPI_CS_TXD | ((sp.cs & SPI_CS_TA) ? SPI_CS_DONE : 0);
+		case SPIFIFO:
+			return MOCK_FIFO_TAG | (sp.rx_count ? sp.rx[sp.rx_head] : 0);
+		case SPICLK:
+			return sp.clk;
+		case SPIDLEN:
+			return sp.dlen;
+		}
+		return 0;
+	}
+
+	if (dmac && (reg >= dmac) && (reg < dmac + BLOCK_SIZE/4)) {
+		n = reg - dmac;
+		if (n == DMAENABLE)
+			return dma_enable;
+		if (n / 0x40 >= DMA_CHANNELS)
+			return 0;
+		switch (n % 0x40) {
+		case DMACS:
+			return dma_cs(&ch[n / 0x40]);
+		case DMACONBLK:
+			return ch[n / 0x40].conblk;
+		}
+		return 0;
+	}
+
+	error("access outside the mapped blocks");
+	return 0;
+}
+
+static void reg_read_done(volatile unsigned *reg)
+{
+	int n, c;
+
+	if (gpio && (reg >= gpio) && (reg < gpio + BLOCK_SIZE/4)) {
+		if ((reg - gpio != GPLEV0) || !req_active())
+			return;
+		for (n = 0; n < BCM2835_MOCK_PEERS; n++)
+			if (bcm2835_mock.peer[n])
+				bcm2835_mock.peer[n]->request();
+		return;
+	}
+
+	if (spi && (reg - spi == SPIFIFO)) {
+		if (!sp.rx_count) {
+			error("SPI FIFO read while empty");
+			return;
+		}
+		sp.rx_head = (sp.rx_head + 1) % SPI_FIFO_SIZE;
+		sp.rx_count--;
+		return;
+	}
+
+	if (dmac && (reg >= dmac) && (reg < dmac + BLOCK_SIZE/4)) {
+		n = reg - dmac;
+		if ((n / 0x40 < DMA_CHANNELS) && (n % 0x40 == DMACS)) {
+			/* both channels of a frame finish together */
+			bcm2835_mock.dma_polls++;
+			for (c = 0; c < DMA_CHANNELS; c++)
+				if (ch[c].moved && ch[c].polls)
+					ch[c].polls--;
+		}
+	}
+}
+
+static void reg_write(volatile unsigned *reg, u32 val)
+{
+	u32 old;
+	int n;
+
+	if (gpio && (reg >= gpio) && (reg < gpio + BLOCK_SIZE/4)) {
+		n = reg - gpio;
+		if (n < 6)
+			gp.fsel[n] = val;
+		else if (n == GPSET0)
+			gp.out |= val;
+		else if (n == GPCLR0)
+			gp.out &= ~val;
+		update_reset();
+		return;
+	}
+
+	if (spi && (reg >= spi) && (reg < spi + BLOCK_SIZE/4)) {
+		switch (reg - spi) {
+		case SPICS:
+			old = sp.cs;
+			if (val & SPI_CS_CLEAR_RX)
+				sp.rx_count = 0;
+			sp.cs = val & SPI_CS_CTRL;
+			if (!(old & SPI_CS_TA) && (sp.cs & SPI_CS_TA)) {
+				bcm2835_mock.frames++;
+				dma_kick();
+			}
+			break;
+		case SPIFIFO:
+			if (!(sp.cs & SPI_CS_TA)) {
+				error("SPI FIFO write without TA");
+				break;
+			}
+			if (sp.rx_count == SPI_FIFO_SIZE) {
+				error("SPI RX FIFO overrun");
+				break;
+			}
+			sp.rx[(sp.rx_head + sp.rx_count++) % SPI_FIFO_SIZE] =
+				exchange(val);
+			break;
+		case SPICLK:
+			sp.clk = val;
+			break;
+		case SPIDLEN:
+			sp.dlen = val & 0xFFFF;
+			break;
+		}
+		return;
+	}
+
+	if (dmac && (reg >= dmac) && (reg < dmac + BLOCK_SIZE/4)) {
+		n = reg - dmac;
+		if (n == DMAENABLE) {
+			dma_enable = val;
+			return;
+		}
+		if (n / 0x40 >= DMA_CHANNELS)
+			return;
+		switch (n % 0x40) {
+		case DMACS:
+			dma_cs_write(&ch[n / 0x40], val);
+			break;
+		case DMACONBLK:
+			ch[n / 0x40].conblk = val;
+			break;
+		}
+		return;
+	}
+
+	error("access outside the mapped blocks");
+}
+
+void bcm2835_mock_flush(void)
+{
+	if (!acc.pending)
+		return;
+	acc.pending = 0;
+
+	if (slot != acc.preload)
+		reg_write(acc.reg, slot);
+	else
+		reg_read_done(acc.reg);
+}
+
+volatile unsigned *bcm2835_mock_reg(volatile unsigned *reg)
+{
+	bcm2835_mock_flush();
+
+	bcm2835_mock.accesses++;
+	if (spi && (reg - spi == SPIFIFO))
+		bcm2835_mock.fifo++;
+
+	acc.reg = reg;
+	acc.preload = reg_peek(reg);
+	acc.pending = 1;
+	slot = acc.preload;
+
+	return &slot;
+}
+
+void bcm2835_mock_clear_stats(void)
+{
+	bcm2835_mock_flush();
+
+	bcm2835_mock.accesses = 0;
+	bcm2835_mock.fifo = 0;
+	bcm2835_mock.dma_polls = 0;
+	bcm2835_mock.frames = 0;
+	bcm2835_mock.dma_frames = 0;
+}
+
+/* stand-ins for the /dev/mem mappings in transport_devmem.c */
+
+static volatile unsigned *map_block(void)
+{
+	void *p = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int map_gpio()
+{
+	gpio = map_block();
+	spi = map_block();
+
+	memset(&gp, 0, sizeof(gp));
+	memset(&sp, 0, sizeof(sp));
+
+	return (gpio && spi) ? 0 : -1;
+}
+
+int map_gpiomem()
+{
+	gpio = map_block();
+	memset(&gp, 0, sizeof(gp));
+
+	return gpio ? 0 : -1;
+}
+
+int map_dma(void **mem, u32 *bus)
+{
+	dmac = map_block();
+	dma_page = (unsigned char *)map_block();
+	if (!dmac || !dma_page)
+		return -1;
+
+	memset(ch, 0, sizeof(ch));
+	dma_enable = 0;
+
+	*mem = dma_page;
+	*bus = MOCK_PAGE_BUS;
+	return 0;
+}
+
+void unmap_dma(void *mem)
+{
+	bcm2835_mock_flush();
+
+	munmap(mem, PAGE_SIZE);
+	munmap((void *)dmac, BLOCK_SIZE);
+	dma_page = NULL;
+	dmac = NULL;
+}
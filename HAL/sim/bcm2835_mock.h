@@ -0,0 +1,65 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef BCM2835_MOCK_H
+#define BCM2835_MOCK_H
+
+/*
+  Register level mock of the BCM2835 GPIO, SPI0 and DMA blocks used by
+  the driver.
+
+  Built with PICNC_MOCK, every register access of the driver goes
+  through bcm2835_mock_reg(), which hands out a one-entry slot loaded
+  with the current register value. The slot is committed on the next
+  access: if the driver changed it, that was a write, otherwise a
+  read. FIFO reads come back tagged with MOCK_FIFO_TAG in the upper
+  bits, so that a byte write is never mistaken for a read.
+
+  The board is a peer behind the SPI bus and the REQ/RDY/RESET lines.
+  A second one sits on CE1, with its RDY on GPIO24; both share REQ and
+  RESET, which is on GPIO7 for one board and GPIO22 for two.
+*/
+
+#define BCM2835_MOCK_PEERS	2
+
+typedef struct {
+	void (*reset)(int active);	/* RESET line */
+	void (*request)(void);		/* polled while REQ is low */
+	unsigned char (*xfer)(unsigned char mosi);
+} bcm2835_mock_peer;
+
+typedef struct {
+	const bcm2835_mock_peer *peer[BCM2835_MOCK_PEERS];	/* by CE */
+	int dma_latency;		/* DMA CS polls before done */
+	unsigned clk_min;		/* faster SPI clock divisors garble
+					   MISO, 0 for none */
+
+	unsigned long accesses;		/* register accesses */
+	unsigned long fifo;		/* of those, SPI FIFO */
+	unsigned long dma_polls;	/* DMA CS reads */
+	unsigned long frames;		/* SPI transfers */
+	unsigned long dma_frames;	/* of those, by DMA */
+	unsigned long errors;
+} bcm2835_mock_state;
+
+extern bcm2835_mock_state bcm2835_mock;
+
+volatile unsigned *bcm2835_mock_reg(volatile unsigned *reg);
+void bcm2835_mock_flush(void);
+void bcm2835_mock_clear_stats(void);
+
+#endif
@@ -0,0 +1,592 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Runs the HAL driver against the register mock and the firmware, once
+  with the SPI FIFO driven by the CPU (dma=0) and once by DMA, each in
+  its own process. Both must put the same bytes on the bus and end
+  with the same feedback; the register accesses the driver makes per
+  servo cycle are reported for each. A third run reads the compact
+  feedback (compact=1), which must agree with the full one to within
+  its 16 bit resolution. The encoder inputs turn at a
+  steady rate each, which the encoder pins must show. Half way through
+  INPUT 12 rises in the middle of a servo period, the probe pins must
+  hold the positions the board had at that tick. The ADC inputs are
+  steady but for one count of noise on every other sample, which the
+  averaged readings must show as half a count. The mock garbles MISO
+  with SPI clock divisors below 20, the driver has to calibrate to one
+  step slower. A last DMA run drives a second copy of the firmware on
+  CE1 (boards=2) with the same commands, both boards must end where
+  the one board did. Another DMA run stalls the DMA of one status
+  poll, the driver has to stop both channels, count a bad reply and
+  carry on. In the same run the board once leaves RDY high, the driver
+  must not clock the status poll into it.
+
+  usage: dmatest [-d channel] [-n cycles] [-p period_ns] [-l polls] [-v]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rtapi.h"
+#include "rtapi_app.h"
+#include "hal.h"
+#include "picnc.h"
+
+#include "halsim.h"
+#include "bcm2835_mock.h"
+#include "fwpeer.h"
+
+typedef struct {
+	int ok;
+	uint32_t hash;
+	unsigned long frames, accesses, fifo, dma_polls, dma_frames, errors;
+	unsigned long bytes;
+	unsigned long overruns, late;	/* see fwpeer.h */
+	double fb[NUMAXES];
+	double enc_pos[PICNC_ENCODERS], enc_vel[PICNC_ENCODERS];
+	double probe[NUMAXES], probe_exp[NUMAXES];
+	double adc[3];
+	int fault, ready, tripped;
+	unsigned spi_clock;
+	int stalled;			/* DMA still running after a stall */
+	unsigned long unready;		/* frames clocked without RDY */
+	unsigned test;			/* the test pin then */
+	unsigned long crc_errors;
+} result_t;
+
+static long cycles = 1000, period = 1000000;
+
+/* encoder i turns at enc_rate(i) counts/s, with a scale of 4 */
+#define enc_rate(i)		(((i) & 1 ? -1 : 1) * 20000.0 * ((i) + 1))
+#define ENC_SCALE		4.0
+
+#define PROBE_INPUT		12
+
+/* ADC inputs, 10 bit, and what the readings scale them to */
+static const uint16_t adc_in[3] = { 100, 500, 1000 };
+#define ADC_READING(x)		(((x) + 0.5) * 64)
+
+/* the fastest clean divisor, and the one it should settle on */
+#define MOCK_CLK_MIN		20
+#define SPI_CLOCK		(BCM2835_CORE_CLK / 24)
+
+/* the status poll that the DMA never finishes, and the request that
+   the board does not answer, in servo cycles */
+#define STALL_CYCLE		(cycles / 4 + 10)
+#define UNREADY_CYCLE		(cycles / 4)
+
+/* the firmware behind CE0, and a copy of it behind CE1 */
+static const struct {
+	fwpeer_state *state;
+	void (*init)(void);
+	void (*run)(int ticks);
+	void (*input)(int n, int level);
+	bcm2835_mock_peer peer;
+} fw[PICNC_BOARDS_MAX] = {
+	{ &fwpeer, fwpeer_init, fwpeer_run, fwpeer_input,
+	  { fwpeer_reset, fwpeer_request, fwpeer_xfer } },
+	{ &b1_fwpeer, b1_fwpeer_init, b1_fwpeer_run, b1_fwpeer_input,
+	  { b1_fwpeer_reset, b1_fwpeer_request, b1_fwpeer_xfer } },
+};
+
+static const struct {
+	const char *name;
+	int dma, compact, boards, faults;
+} mode[] = {
+	{ "PIO", 0, 0, 1, 0 },
+	{ "DMA", 1, 0, 1, 0 },
+	{ "DMA compact", 1, 1, 1, 0 },
+	{ "DMA 2 boards", 1, 0, 2, 0 },
+	{ "DMA faults", 1, 0, 1, 1 },
+};
+
+#define MODES			(sizeof(mode) / sizeof(mode[0]))
+
+/* a position in the >STC feedback, with the axis scale at 1.0 */
+#define FBC_RESOLUTION		((double)(1 << FBC_POS_SHIFT) / STEP_MASK)
+
+static int boards = 1, faults = 0;
+
+/* pin of board b, fmt takes an index; with two boards the pins are
+   picnc.0.* and picnc.1.* */
+static void *pin(int b, const char *fmt, int i)
+{
+	char name[HAL_NAME_LEN + 1];
+	int n;
+
+	if (boards > 1)
+		n = snprintf(name, sizeof(name), "picnc.%d.", b);
+	else
+		n = snprintf(name, sizeof(name), "picnc.");
+	snprintf(name + n, sizeof(name) - n, fmt, i);
+	return halsim_pin(name);
+}
+
+extern volatile unsigned *dmac;
+
+/* the DMA of one status poll never finishes, the driver has to give
+   up on it and stop both channels */
+static void read_stalled(int chan, long period, result_t *r)
+{
+	int latency = bcm2835_mock.dma_latency;
+
+	bcm2835_mock.dma_latency = 2 * REQ_TIMEOUT;
+	halsim_call("picnc.read", period);
+	bcm2835_mock.dma_latency = latency;
+
+	r->stalled = ((BCM2835_DMACS(chan) | BCM2835_DMACS(chan + 1)) &
+		DMA_CS_ACTIVE) != 0;
+}
+
+/* the board is gone while the driver waits for RDY, the read times
+   out without clocking anything */
+static void read_unready(long period, result_t *r)
+{
+	unsigned long frames = bcm2835_mock.frames;
+	const bcm2835_mock_peer *peer = bcm2835_mock.peer[0];
+
+	bcm2835_mock.peer[0] = NULL;
+	halsim_call("picnc.read", period);
+	bcm2835_mock_flush();
+	bcm2835_mock.peer[0] = peer;
+
+	r->unready = bcm2835_mock.frames - frames;
+	r->test = *(hal_u32_t *)pin(0, "test", 0);
+}
+
+/* r holds a result for each board, every board is given the same
+   commands and inputs */
+static int run(int chan, int compact, result_t *r)
+{
+	hal_float_t *cmd[PICNC_BOARDS_MAX][NUMAXES],
+		    *fb[PICNC_BOARDS_MAX][NUMAXES],
+		    *scale[PICNC_BOARDS_MAX][NUMAXES],
+		    *probe[PICNC_BOARDS_MAX][NUMAXES], *maxaccel;
+	hal_float_t *enc_pos[PICNC_BOARDS_MAX][PICNC_ENCODERS],
+		    *enc_vel[PICNC_BOARDS_MAX][PICNC_ENCODERS], *sc;
+	char val[16];
+	long n;
+	int b, i, ticks;
+
+	snprintf(val, sizeof(val), "%d", chan);
+	if (halsim_set_param("dma", val) < 0)
+		return -1;
+	snprintf(val, sizeof(val), "%d", compact);
+	if (halsim_set_param("compact", val) < 0)
+		return -1;
+	snprintf(val, sizeof(val), "%d", 1 << PROBE_INPUT);
+	if (halsim_set_param("probe_rise", val) < 0)
+		return -1;
+	snprintf(val, sizeof(val), "%d", boards);
+	if (halsim_set_param("boards", val) < 0)
+		return -1;
+
+	for (b = 0; b < boards; b++) {
+		fw[b].init();
+		bcm2835_mock.peer[b] = &fw[b].peer;
+	}
+	bcm2835_mock.clk_min = MOCK_CLK_MIN;
+	if (rtapi_app_main() < 0)
+		return -1;
+
+	for (b = 0; b < boards; b++) {
+		for (i = 0; i < NUMAXES; i++) {
+			cmd[b][i] = pin(b, "axis.%d.position-cmd", i);
+			fb[b][i] = pin(b, "axis.%d.position-fb", i);
+			maxaccel = pin(b, "axis.%d.maxaccel", i);
+			scale[b][i] = pin(b, "axis.%d.scale", i);
+			probe[b][i] = pin(b, "probe.%d.position", i);
+			if (!cmd[b][i] || !fb[b][i] || !maxaccel ||
+			    !scale[b][i] || !probe[b][i])
+				return -1;
+			*maxaccel = 1e6;
+		}
+		*(hal_bit_t *)pin(b, "probe.enable", 0) = 1;
+
+		for (i = 0; i < 3; i++)
+			fw[b].state->adc_in[i] = adc_in[i];
+		fw[b].state->adc_noise = 1;
+
+		for (i = 0; i < PICNC_ENCODERS; i++) {
+			enc_pos[b][i] = pin(b, "encoder.%d.position", i);
+			enc_vel[b][i] = pin(b, "encoder.%d.velocity", i);
+			sc = pin(b, "encoder.%d.scale", i);
+			if (!enc_pos[b][i] || !enc_vel[b][i] || !sc)
+				return -1;
+			*sc = ENC_SCALE;
+			fw[b].state->enc_rate[i] = enc_rate(i);
+		}
+	}
+
+	bcm2835_mock_clear_stats();
+	for (b = 0; b < boards; b++)
+		fw[b].state->bytes = 0;
+
+	for (n = 0; n < cycles; n++) {
+		/* a different constant velocity per axis */
+		for (b = 0; b < boards; b++)
+			for (i = 0; i < NUMAXES; i++)
+				*cmd[b][i] = (i + 1) * 5000.0 * n * period *
+					1e-9;
+
+		if (faults && (n == STALL_CYCLE))
+			read_stalled(chan, period, r);
+		else if (faults && (n == UNREADY_CYCLE))
+			read_unready(period, r);
+		else
+			halsim_call("picnc.read", period);
+		halsim_call("picnc.update", period);
+		halsim_call("picnc.write", period);
+
+		/* the last store starts the DMA before the boards run on */
+		bcm2835_mock_flush();
+		ticks = picnc_basefreq * period * 1e-9 + 0.5;
+		for (b = 0; b < boards; b++) {
+			if (n == cycles / 2) {
+				fw[b].run(ticks / 2);
+				fw[b].input(PROBE_INPUT, 1);
+				fw[b].run(ticks - ticks / 2);
+			} else {
+				fw[b].run(ticks);
+			}
+		}
+	}
+
+	bcm2835_mock_flush();
+
+	for (b = 0; b < boards; b++, r++) {
+		r->hash = fw[b].state->hash;
+		r->frames = bcm2835_mock.frames;
+		r->accesses = bcm2835_mock.accesses;
+		r->fifo = bcm2835_mock.fifo;
+		r->dma_polls = bcm2835_mock.dma_polls;
+		r->dma_frames = bcm2835_mock.dma_frames;
+		r->errors = bcm2835_mock.errors;
+		r->bytes = fw[b].state->bytes;
+		r->overruns = fw[b].state->overruns;
+		r->late = fw[b].state->late;
+		for (i = 0; i < NUMAXES; i++)
+			r->fb[i] = *fb[b][i];
+		for (i = 0; i < PICNC_ENCODERS; i++) {
+			r->enc_pos[i] = *enc_pos[b][i];
+			r->enc_vel[i] = *enc_vel[b][i];
+		}
+		for (i = 0; i < NUMAXES; i++) {
+			r->probe[i] = *probe[b][i];
+			r->probe_exp[i] = (double)fw[b].state->input_dds[i] /
+				STEP_MASK / *scale[b][i];
+		}
+		r->tripped = *(hal_bit_t *)pin(b, "probe.tripped", 0);
+		for (i = 0; i < 3; i++)
+			r->adc[i] = *(hal_float_t *)pin(b, "adc.%d.val", i);
+		r->fault = *(hal_bit_t *)pin(b, "fault", 0);
+		r->ready = *(hal_bit_t *)pin(b, "ready", 0);
+		r->crc_errors = *(hal_u32_t *)pin(b, "crc-errors", 0);
+		r->spi_clock = *(hal_u32_t *)halsim_pin("picnc.spi-clock");
+		r->ok = 1;
+	}
+
+	rtapi_app_exit();
+
+	return 0;
+}
+
+/* the driver keeps its state in statics, so each mode gets a process */
+static int run_child(int chan, int compact, result_t *r)
+{
+	int fd[2], status;
+	size_t len = PICNC_BOARDS_MAX * sizeof(*r);
+	pid_t pid;
+
+	memset(r, 0, len);
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		close(fd[0]);
+		run(chan, compact, r);
+		if (write(fd[1], r, len) != (ssize_t)len)
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd[1]);
+	if (read(fd[0], r, len) != (ssize_t)len)
+		r->ok = 0;
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+
+	return r->ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	result_t res[MODES][PICNC_BOARDS_MAX], *r, *pio = res[0], *dma = res[1],
+		 *fbc = res[2], *two = res[3], *flt = res[4];
+	unsigned long bytes;
+	int chan = 5, opt, i, j, fail = 0, c;
+
+	while ((opt = getopt(argc, argv, "d:n:p:l:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			chan = atoi(optarg);
+			break;
+		case 'n':
+			cycles = atol(optarg);
+			break;
+		case 'p':
+			period = atol(optarg);
+			break;
+		case 'l':
+			bcm2835_mock.dma_latency = atoi(optarg);
+			break;
+		case 'v':
+			halsim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: dmatest [-d channel] "
+				"[-n cycles] [-p period_ns] [-l polls] [-v]\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < (int)MODES; i++) {
+		c = mode[i].dma ? chan : 0;
+		boards = mode[i].boards;
+		faults = mode[i].faults;
+		if (run_child(c, mode[i].compact, res[i]) < 0) {
+			fprintf(stderr, "dmatest: driver failed to load "
+				"with dma=%d compact=%d\n", c,
+				mode[i].compact);
+			return 1;
+		}
+	}
+
+	printf("%ld servo cycles of %ld ns, %d axes\n\n", cycles, period,
+		NUMAXES);
+	printf("%-12s %8s %8s %10s %10s %10s %8s\n", "", "frames",
+		"bytes", "accesses", "FIFO", "DMA polls", "errors");
+	for (i = 0; i < (int)MODES; i++) {
+		r = res[i];
+		for (j = 1, bytes = r->bytes; j < mode[i].boards; j++)
+			bytes += r[j].bytes;
+		printf("%-12s %8lu %8.1f %10.1f %10.1f %10.1f %8lu\n",
+			mode[i].name, r->frames, (double)bytes / cycles,
+			(double)r->accesses / cycles,
+			(double)r->fifo / cycles,
+			(double)r->dma_polls / cycles, r->errors);
+		for (j = 0; j < mode[i].boards; j++) {
+			if (r->errors || r[j].fault || !r[j].ready)
+				fail = 1;
+			if (r[j].overruns || r[j].late) {
+				printf("board %d lost %lu bytes, sent %lu "
+					"reply bytes late\n", j,
+					r[j].overruns, r[j].late);
+				fail = 1;
+			}
+		}
+		if (r->spi_clock != SPI_CLOCK) {
+			printf("SPI clock calibrated to %u Hz, expected %lu\n",
+				r->spi_clock, SPI_CLOCK);
+			fail = 1;
+		}
+		if (mode[i].dma && (r->dma_frames != r->frames)) {
+			printf("only %lu of %lu frames went by DMA\n",
+				r->dma_frames, r->frames);
+			fail = 1;
+		}
+	}
+	printf("(bytes on the bus and register accesses per servo cycle)"
+		"\n\n");
+
+	if (pio->hash != dma->hash) {
+		printf("bus traffic differs\n");
+		fail = 1;
+	}
+
+	for (j = 0; j < NUMAXES; j++) {
+		if (pio->fb[j] != dma->fb[j]) {
+			printf("axis %d feedback differs: %f vs %f\n", j,
+				pio->fb[j], dma->fb[j]);
+			fail = 1;
+		}
+	}
+
+	/* the last read got the counts the board sampled at the write
+	   before, cycles - 2 servo periods in */
+	for (j = 0; j < PICNC_ENCODERS; j++) {
+		double pos = enc_rate(j) * (cycles - 2) * period * 1e-9 /
+			ENC_SCALE, vel = enc_rate(j) / ENC_SCALE;
+
+		if ((pio->enc_pos[j] != dma->enc_pos[j]) ||
+		    (fabs(pio->enc_pos[j] - pos) > 1.0 / ENC_SCALE) ||
+		    (fabs(pio->enc_vel[j] - vel) > 0.01 * fabs(vel))) {
+			printf("encoder %d at %f, %f/s, expected %f, %f/s\n",
+				j, pio->enc_pos[j], pio->enc_vel[j], pos,
+				vel);
+			fail = 1;
+		}
+	}
+
+	if (!pio->tripped || !dma->tripped) {
+		printf("probe did not trip\n");
+		fail = 1;
+	}
+	for (j = 0; j < NUMAXES; j++) {
+		if ((pio->probe[j] != dma->probe[j]) ||
+		    (fabs(pio->probe[j] - pio->probe_exp[j]) > 1e-6)) {
+			printf("axis %d probed at %f, expected %f\n", j,
+				pio->probe[j], pio->probe_exp[j]);
+			fail = 1;
+		}
+	}
+
+	for (j = 0; j < 3; j++) {
+		if ((pio->adc[j] != dma->adc[j]) ||
+		    (pio->adc[j] != ADC_READING(adc_in[j]))) {
+			printf("adc %d reads %f, expected %f\n", j,
+				pio->adc[j], ADC_READING(adc_in[j]));
+			fail = 1;
+		}
+	}
+
+	/* compact feedback, the encoder and ADC words are exact */
+	for (j = 0; j < NUMAXES; j++) {
+		if ((fabs(fbc->fb[j] - dma->fb[j]) > FBC_RESOLUTION) ||
+		    (fabs(fbc->probe[j] - fbc->probe_exp[j]) >
+		     FBC_RESOLUTION)) {
+			printf("axis %d compact feedback %f, probed at %f\n",
+				j, fbc->fb[j], fbc->probe[j]);
+			fail = 1;
+		}
+	}
+	for (j = 0; j < PICNC_ENCODERS; j++) {
+		if (fbc->enc_pos[j] != dma->enc_pos[j]) {
+			printf("encoder %d compact at %f\n", j,
+				fbc->enc_pos[j]);
+			fail = 1;
+		}
+	}
+	for (j = 0; j < 3; j++) {
+		if (fbc->adc[j] != dma->adc[j]) {
+			printf("adc %d compact reads %f\n", j, fbc->adc[j]);
+			fail = 1;
+		}
+	}
+	if (!fbc->tripped) {
+		printf("probe did not trip with compact feedback\n");
+		fail = 1;
+	}
+
+	/* two boards behind one driver each end where the one board
+	   did; board 1 is not sent the >TST that fails on board 0, so
+	   only the bus traffic of board 0 is the same */
+	if (two[0].hash != dma->hash) {
+		printf("bus traffic of board 0 differs with 2 boards\n");
+		fail = 1;
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < NUMAXES; j++) {
+			if ((two[i].fb[j] != dma->fb[j]) ||
+			    (two[i].probe[j] != dma->probe[j])) {
+				printf("board %d axis %d at %f, probed at %f\n",
+					i, j, two[i].fb[j], two[i].probe[j]);
+				fail = 1;
+			}
+		}
+		for (j = 0; j < PICNC_ENCODERS; j++) {
+			if (two[i].enc_pos[j] != dma->enc_pos[j]) {
+				printf("board %d encoder %d at %f\n", i, j,
+					two[i].enc_pos[j]);
+				fail = 1;
+			}
+		}
+		for (j = 0; j < 3; j++) {
+			if (two[i].adc[j] != dma->adc[j]) {
+				printf("board %d adc %d reads %f\n", i, j,
+					two[i].adc[j]);
+				fail = 1;
+			}
+		}
+		if (!two[i].tripped) {
+			printf("probe of board %d did not trip\n", i);
+			fail = 1;
+		}
+	}
+
+	if (flt->unready || flt->test) {
+		printf("%lu frames clocked without RDY, test pin %u\n",
+			flt->unready, flt->test);
+		fail = 1;
+	}
+
+	/* the stalled poll is a bad reply, and nothing more */
+	if (flt->stalled) {
+		printf("DMA channels left running after a stall\n");
+		fail = 1;
+	}
+	if (flt->crc_errors != 1) {
+		printf("%lu bad replies with a stalled DMA, expected 1\n",
+			flt->crc_errors);
+		fail = 1;
+	}
+	for (j = 0; j < NUMAXES; j++) {
+		if (flt->fb[j] != dma->fb[j]) {
+			printf("axis %d at %f after a DMA stall\n", j,
+				flt->fb[j]);
+			fail = 1;
+		}
+	}
+
+	if (fail) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("bus traffic and feedback identical, position-fb:");
+	for (j = 0; j < NUMAXES; j++)
+		printf(" %.1f", pio->fb[j]);
+	printf("\n");
+	printf("spi clock: %u Hz\n", pio->spi_clock);
+	printf("adc: %.0f %.0f %.0f\n", pio->adc[0], pio->adc[1],
+		pio->adc[2]);
+	printf("probe position:");
+	for (j = 0; j < NUMAXES; j++)
+		printf(" %.4f", pio->probe[j]);
+	printf("\n");
+	if (PICNC_ENCODERS) {
+		printf("encoder position:");
+		for (j = 0; j < PICNC_ENCODERS; j++)
+			printf(" %.1f", pio->enc_pos[j]);
+		printf("\n");
+	}
+
+	return 0;
+}
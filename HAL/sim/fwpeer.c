@@ -0,0 +1,277 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include <plib.h>
+
+#include "sim.h"
+#include "hardware.h"
+#include "stepgen.h"
+#include "command.h"
+#include "encoder.h"
+#include "probe.h"
+
+#include "fwpeer.h"
+
+fwpeer_state fwpeer;
+
+static uint32_t rxbuf[BUFSIZE], txbuf[2][BUFSIZE];
+static int tx_cur;				/* the one on the bus */
+static int pos;
+static int held;				/* in reset */
+static uint16_t crc;				/* the DMA CRC engine */
+static int32_t dds_old[NUMAXES];
+static int input_edge;				/* input_dds due */
+static uint32_t adc_counts;			/* to the next conversion */
+static unsigned long adc_n;			/* conversions since reset */
+
+/* the SPI DMA in time, see fwpeer.h */
+static long long sim_ns;			/* bytes clocked, ticks run */
+static long long rx_arm, body_arm;		/* DMA 0 armed again */
+static long long tx_arm, seal_arm;		/* DMA 1 and 2 */
+static long long isr_done;			/* SpiDmaHandler() returns */
+static long long fifo[FWPEER_FIFO];		/* when each byte leaves */
+static unsigned fifo_n;
+
+static const struct {
+	int port;
+	uint32_t step, dir;
+} pins[] = { STEPGEN_PIN_TABLE };
+
+static const int port_reg[] = {
+	[STEPGEN_PORT_E] = SIM_PORTE,
+	[STEPGEN_PORT_F] = SIM_PORTF,
+	[STEPGEN_PORT_D] = SIM_PORTD,
+};
+
+static void hash(unsigned char c)
+{
+	fwpeer.hash = (fwpeer.hash ^ c) * 16777619u;
+}
+
+/* count the rising step edges, as stepsim does */
+static void edge(int reg, uint32_t oldval, uint32_t newval)
+{
+	uint32_t step;
+	int i, port;
+
+	for (i = 0; i < NUMAXES; i++) {
+		/* output compare pins are on port D */
+		port = i < STEPGEN_OC ? STEPGEN_PORT_D : pins[i].port;
+		step = i < STEPGEN_OC ? STEPGEN_OC_STEP(i) : pins[i].step;
+		if ((port_reg[port] != reg) || !(~oldval & newval & step))
+			continue;
+		fwpeer.pulses[i]++;
+		fwpeer.steps[i] += (sim.reg[port_reg[pins[i].port]] &
+			pins[i].dir) ? -1 : 1;
+	}
+}
+
+void fwpeer_reset(int active)
+{
+	held = active;
+	if (active)
+		return;
+
+	/* start up as after power on */
+	sim_reset();
+	memset(rxbuf, 0, sizeof(rxbuf));
+	memset(txbuf, 0, sizeof(txbuf));
+	tx_cur = 0;
+	pos = 0;
+	crc = PICNC_CRC_INIT;
+	reset_board();
+	memset(fwpeer.dds, 0, sizeof(fwpeer.dds));
+	memset(dds_old, 0, sizeof(dds_old));
+	adc_counts = 0;
+	adc_n = 0;
+	rx_arm = body_arm = tx_arm = seal_arm = isr_done = 0;
+	memset(fifo, 0, sizeof(fifo));
+}
+
+/* as in main.c, the reply is prepared in the idle buffer and only
+   swapped in between frames */
+void fwpeer_request(void)
+{
+	int idle = tx_cur ^ 1;
+
+	if (held)
+		return;
+
+	txbuf[idle][0] = txbuf[tx_cur][0];
+	command_prepare_reply(txbuf[idle]);
+	if (!pos)
+		tx_cur = idle;
+}
+
+/* the wall clock, for the gaps the host leaves between frames, plus
+   the time the bytes and ticks took on the board */
+static long long board_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec + sim_ns;
+}
+
+static inline long long later(long long a, long long b)
+{
+	return a > b ? a : b;
+}
+
+unsigned char fwpeer_xfer(unsigned char mosi)
+{
+	unsigned char miso;
+	long long t0, t, arm;
+
+	if (held || (pos >= SPIBUFSIZE))
+		return 0xFF;
+
+	/* the reply byte has to be queued when the byte starts, the
+	   byte is in when it has been clocked */
+	t0 = board_ns();
+	sim_ns += fwpeer.byte_ns;
+	t = t0 + fwpeer.byte_ns;
+
+	/* it leaves the FIFO once DMA 0 is armed for its part of the
+	   frame; the rest is armed once the command word is in and the
+	   last frame's interrupt is done */
+	if (fifo[fifo_n % FWPEER_FIFO] > t) {
+		fwpeer.overruns++;
+		return 0xFF;
+	}
+	arm = pos < 4 ? rx_arm : body_arm;
+	fifo[fifo_n++ % FWPEER_FIFO] = later(t, arm);
+	if (pos == 3)
+		body_arm = later(later(t, rx_arm), isr_done) +
+			FWPEER_REARM_NS;
+
+	if (t0 < (pos < 4 ? tx_arm : seal_arm)) {
+		miso = 0xFF;
+		fwpeer.late++;
+	} else {
+		miso = ((unsigned char *)txbuf[tx_cur])[pos];
+	}
+	((unsigned char *)rxbuf)[pos++] = mosi;
+	crc = picnc_crc16_byte(crc, mosi);
+	fwpeer.bytes++;
+	hash(mosi);
+	hash(miso);
+
+	/* the frame length SpiDmaHandler() in main.c sets up the DMA for */
+	if ((pos >= 4) && (pos >= picnc_frame_words(rxbuf[0]) * 4)) {
+		if (command_frame_done(rxbuf, txbuf[tx_cur], crc))
+			command_process(rxbuf);
+		fwpeer.frames++;
+		pos = 0;
+		crc = PICNC_CRC_INIT;
+		rx_arm = tx_arm = t + FWPEER_REARM_NS;
+		seal_arm = tx_arm + FWPEER_SEAL_NS;
+		isr_done = rx_arm + FWPEER_ISR_NS;
+	}
+
+	return miso;
+}
+
+void fwpeer_init(void)
+{
+	memset(&fwpeer, 0, sizeof(fwpeer));
+	fwpeer.hash = 2166136261u;
+	fwpeer.oc = (1 << STEPGEN_OC) - 1;
+	fwpeer.byte_ns = 800;			/* 8 bits at 10 MHz */
+	sim.edge = edge;
+}
+
+/* move the encoder inputs on by one tick, AB 00, 10, 11, 01 */
+static void drive_encoders(void)
+{
+	static const uint32_t ab[4] = { 0, 1, 3, 2 };
+	uint32_t in = sim.reg[SIM_PORTB];
+	int i;
+
+	for (i = 0; i < PICNC_ENCODERS; i++) {
+		fwpeer.enc_pos[i] += (int64_t)(fwpeer.enc_rate[i] *
+			4294967296.0 * tick_rate / CORE_TIMER_FREQ);
+		in &= ~(3 << ENCODER_SHIFT(i));
+		in |= ab[(fwpeer.enc_pos[i] >> 32) & 3] << ENCODER_SHIFT(i);
+	}
+	sim.reg[SIM_PORTB] = in;
+}
+
+/* the ADC converts every ADC_CONV_COUNTS core timer counts, the scan
+   runs ADC 0, 1, 2 */
+static void drive_adc(void)
+{
+	uint16_t val;
+
+	for (adc_counts += tick_rate; adc_counts >= ADC_CONV_COUNTS;
+	     adc_counts -= ADC_CONV_COUNTS, adc_n++) {
+		val = fwpeer.adc_in[adc_n % 3];
+		if ((adc_n / 3) & 1)
+			val += fwpeer.adc_noise;
+		sim_adc(val);
+	}
+}
+
+/* follow the DDS positions past their 32 bit wrap */
+static void track_dds(void)
+{
+	int32_t pos[MAXGEN];
+	uint32_t q;
+	int i;
+
+	stepgen_get_position(pos, &q);
+	for (i = 0; i < NUMAXES; i++) {
+		fwpeer.dds[i] += (int32_t)((uint32_t)pos[i] - dds_old[i]);
+		dds_old[i] = pos[i];
+	}
+
+	if (input_edge) {
+		memcpy(fwpeer.input_dds, fwpeer.dds, sizeof(fwpeer.dds));
+		input_edge = 0;
+	}
+}
+
+/* run the stepgen ISR */
+void fwpeer_run(int ticks)
+{
+	while (!held && ticks--) {
+		drive_encoders();
+		stepgen();
+		encoder();
+		probe();
+		sim_tick();
+		drive_adc();
+		track_dds();
+		sim_ns += tick_rate * 1000000000ll / CORE_TIMER_FREQ;
+	}
+}
+
+/* the next tick sees the new level, and latches the positions at its
+   end if the edge is selected */
+void fwpeer_input(int n, int level)
+{
+	uint32_t bit = 1 << (3 + n);
+
+	if (level)
+		sim.reg[SIM_PORTB] |= bit;
+	else
+		sim.reg[SIM_PORTB] &= ~bit;
+	input_edge = 1;
+}
@@ -0,0 +1,85 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef FWPEER_H
+#define FWPEER_H
+
+#include <stdint.h>
+
+#include "picnc_config.h"
+
+/*
+  The firmware command handling and stepgen (firmware/sim) as an SPI
+  peer: bytes are exchanged with the firmware rx/tx buffers the way
+  its SPI DMA does, and a frame is processed as soon as it is
+  complete. The register mock and the loopback transport both drive
+  the board through this.
+
+  The SPI DMA of main.c is modelled in time, the wall clock plus
+  byte_ns for every byte clocked and the ticks run: after a frame
+  DMA 0 and word 0 of the reply are armed again FWPEER_REARM_NS
+  later, the rest of the reply FWPEER_SEAL_NS after that, and
+  SpiDmaHandler() is busy until FWPEER_ISR_NS after the rearm. A byte
+  that comes in while DMA 0 is not armed waits in the 16 byte receive
+  FIFO, or is lost if it is full; a reply byte clocked before its
+  channel is armed is garbage.
+*/
+
+#define FWPEER_FIFO		16	/* SPI receive FIFO, bytes */
+#define FWPEER_REARM_NS		2000	/* frame end to DMA armed */
+#define FWPEER_SEAL_NS		8000	/* reply written and sealed */
+#define FWPEER_ISR_NS		12000	/* reply sealed, command run */
+
+typedef struct {
+	uint32_t hash;			/* FNV-1a of all bytes on the bus */
+	unsigned long frames;
+	unsigned long bytes;		/* clocked either way */
+	unsigned long pulses[NUMAXES];	/* on the step pins */
+	long steps[NUMAXES];		/* the same, signed by dir */
+	uint32_t oc;			/* axes stepped by output compare */
+	double enc_rate[PICNC_ENCODERS];	/* quadrature in, counts/s */
+	int64_t enc_pos[PICNC_ENCODERS];	/* counts, 32.32 */
+	int64_t dds[NUMAXES];		/* DDS positions, not wrapped */
+	int64_t input_dds[NUMAXES];	/* the same, at an input edge */
+	uint16_t adc_in[3];		/* ADC 0-2, 10 bit */
+	uint16_t adc_noise;		/* added to every other sample */
+	unsigned byte_ns;		/* on the bus */
+	unsigned long overruns;		/* bytes lost, receive FIFO full */
+	unsigned long late;		/* reply bytes before DMA armed */
+} fwpeer_state;
+
+extern fwpeer_state fwpeer;
+
+void fwpeer_init(void);
+void fwpeer_reset(int active);		/* RESET line */
+void fwpeer_request(void);		/* REQ low */
+unsigned char fwpeer_xfer(unsigned char mosi);
+void fwpeer_run(int ticks);
+void fwpeer_input(int n, int level);	/* INPUT n, seen next tick */
+
+/* a second board for dmatest, the same code with all its symbols
+   prefixed b1_ (see Makefile) */
+extern fwpeer_state b1_fwpeer;
+
+void b1_fwpeer_init(void);
+void b1_fwpeer_reset(int active);
+void b1_fwpeer_request(void);
+unsigned char b1_fwpeer_xfer(unsigned char mosi);
+void b1_fwpeer_run(int ticks);
+void b1_fwpeer_input(int n, int level);
+
+#endif
@@ -0,0 +1,71 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Host stand-in for the LinuxCNC hal.h, see halsim.c.
+*/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include "rtapi.h"
+
+#define HAL_NAME_LEN		47
+
+typedef volatile unsigned char hal_bit_t;
+typedef volatile u32 hal_u32_t;
+typedef volatile s32 hal_s32_t;
+typedef volatile double hal_float_t;
+
+typedef enum {
+	HAL_IN = 16,
+	HAL_OUT = 32,
+	HAL_IO = (HAL_IN | HAL_OUT)
+} hal_pin_dir_t;
+
+typedef enum {
+	HAL_RO = 64,
+	HAL_RW = 192
+} hal_param_dir_t;
+
+int hal_init(const char *name);
+int hal_exit(int comp_id);
+int hal_ready(int comp_id);
+void *hal_malloc(long size);
+
+int hal_pin_bit_newf(hal_pin_dir_t dir, hal_bit_t **data_ptr_addr,
+	int comp_id, const char *fmt, ...);
+int hal_pin_u32_newf(hal_pin_dir_t dir, hal_u32_t **data_ptr_addr,
+	int comp_id, const char *fmt, ...);
+int hal_pin_s32_newf(hal_pin_dir_t dir, hal_s32_t **data_ptr_addr,
+	int comp_id, const char *fmt, ...);
+int hal_pin_float_newf(hal_pin_dir_t dir, hal_float_t **data_ptr_addr,
+	int comp_id, const char *fmt, ...);
+
+int hal_param_bit_newf(hal_param_dir_t dir, hal_bit_t *data_addr,
+	int comp_id, const char *fmt, ...);
+int hal_param_u32_newf(hal_param_dir_t dir, hal_u32_t *data_addr,
+	int comp_id, const char *fmt, ...);
+int hal_param_s32_newf(hal_param_dir_t dir, hal_s32_t *data_addr,
+	int comp_id, const char *fmt, ...);
+int hal_param_float_newf(hal_param_dir_t dir, hal_float_t *data_addr,
+	int comp_id, const char *fmt, ...);
+
+int hal_export_funct(const char *name, void (*funct)(void *, long),
+	void *arg, int uses_fp, int reentrant, int comp_id);
+
+#endif
@@ -0,0 +1,233 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtapi.h"
+#include "hal.h"
+#include "halsim.h"
+
+#define HALSIM_MAX_PINS		512
+#define HALSIM_MAX_PARAMS	16
+#define HALSIM_MAX_FUNCTS	8
+
+int halsim_verbose = 0;
+
+static struct {
+	char name[HAL_NAME_LEN + 1];
+	void *data;
+} pins[HALSIM_MAX_PINS];
+static int npins;
+
+static struct {
+	const char *name;
+	int type;
+	void *var;
+} params[HALSIM_MAX_PARAMS];
+static int nparams;
+
+static struct {
+	char name[HAL_NAME_LEN + 1];
+	void (*funct)(void *, long);
+	void *arg;
+} functs[HALSIM_MAX_FUNCTS];
+static int nfuncts;
+
+void rtapi_print_msg(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > (halsim_verbose ? RTAPI_MSG_INFO : RTAPI_MSG_WARN))
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+long long int rtapi_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+void rtapi_delay(long int nsec)
+{
+	long long int end = rtapi_get_time() + nsec;
+
+	while (rtapi_get_time() < end);
+}
+
+void halsim_register_param(const char *name, int type, void *var)
+{
+	if (nparams < HALSIM_MAX_PARAMS) {
+		params[nparams].name = name;
+		params[nparams].type = type;
+		params[nparams].var = var;
+		nparams++;
+	}
+}
+
+int halsim_set_param(const char *name, const char *value)
+{
+	int i;
+
+	for (i = 0; i < nparams; i++) {
+		if (strcmp(params[i].name, name))
+			continue;
+
+		switch (params[i].type) {
+		case HALSIM_MP_INT:
+			*(int *)params[i].var = strtol(value, NULL, 0);
+			break;
+		case HALSIM_MP_LONG:
+			*(long *)params[i].var = strtol(value, NULL, 0);
+			break;
+		case HALSIM_MP_STRING:
+			*(const char **)params[i].var = value;
+			break;
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "halsim: no parameter %s\n", name);
+	return -1;
+}
+
+/* pins and parameters both end up in the same table */
+static int add_pin(void *data, const char *fmt, va_list ap)
+{
+	if (npins >= HALSIM_MAX_PINS)
+		return -1;
+
+	vsnprintf(pins[npins].name, sizeof(pins[npins].name), fmt, ap);
+	pins[npins].data = data;
+	npins++;
+
+	return 0;
+}
+
+static int new_pin(void **data_ptr_addr, size_t size, const char *fmt,
+	va_list ap)
+{
+	void *data = calloc(1, size);
+
+	if (!data)
+		return -1;
+	*data_ptr_addr = data;
+
+	return add_pin(data, fmt, ap);
+}
+
+#define HALSIM_PIN(type)						\
+int hal_pin_##type##_newf(hal_pin_dir_t dir, hal_##type##_t **data_ptr_addr,\
+	int comp_id, const char *fmt, ...)				\
+{									\
+	va_list ap;							\
+	int retval;							\
+									\
+	va_start(ap, fmt);						\
+	retval = new_pin((void **)data_ptr_addr, sizeof(hal_##type##_t),\
+		fmt, ap);						\
+	va_end(ap);							\
+	return retval;							\
+}									\
+									\
+int hal_param_##type##_newf(hal_param_dir_t dir, hal_##type##_t *data_addr,\
+	int comp_id, const char *fmt, ...)				\
+{									\
+	va_list ap;							\
+	int retval;							\
+									\
+	va_start(ap, fmt);						\
+	retval = add_pin((void *)data_addr, fmt, ap);			\
+	va_end(ap);							\
+	return retval;							\
+}
+
+HALSIM_PIN(bit)
+HALSIM_PIN(u32)
+HALSIM_PIN(s32)
+HALSIM_PIN(float)
+
+void *halsim_pin(const char *name)
+{
+	int i;
+
+	for (i = 0; i < npins; i++)
+		if (!strcmp(pins[i].name, name))
+			return pins[i].data;
+
+	fprintf(stderr, "halsim: no pin %s\n", name);
+	return NULL;
+}
+
+int hal_export_funct(const char *name, void (*funct)(void *, long),
+	void *arg, int uses_fp, int reentrant, int comp_id)
+{
+	if (nfuncts >= HALSIM_MAX_FUNCTS)
+		return -1;
+
+	snprintf(functs[nfuncts].name, sizeof(functs[nfuncts].name), "%s",
+		name);
+	functs[nfuncts].funct = funct;
+	functs[nfuncts].arg = arg;
+	nfuncts++;
+
+	return 0;
+}
+
+int halsim_call(const char *name, long period)
+{
+	int i;
+
+	for (i = 0; i < nfuncts; i++) {
+		if (!strcmp(functs[i].name, name)) {
+			functs[i].funct(functs[i].arg, period);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "halsim: no function %s\n", name);
+	return -1;
+}
+
+int hal_init(const char *name)
+{
+	return 1;
+}
+
+int hal_ready(int comp_id)
+{
+	return 0;
+}
+
+int hal_exit(int comp_id)
+{
+	return 0;
+}
+
+void *hal_malloc(long size)
+{
+	return calloc(1, size);
+}
@@ -0,0 +1,33 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef HALSIM_H
+#define HALSIM_H
+
+/*
+  Host HAL shim: pins, parameters and functions exported by the driver
+  are kept in tables which the host tools look up by name. Only one
+  driver instance per process; tools that load it more than once fork.
+*/
+
+extern int halsim_verbose;		/* print RTAPI_MSG_INFO and up */
+
+int halsim_set_param(const char *name, const char *value);
+void *halsim_pin(const char *name);
+int halsim_call(const char *name, long period);
+
+#endif
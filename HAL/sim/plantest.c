@@ -0,0 +1,290 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Runs the HAL driver against the register mock and the firmware, once
+  with planner=double and once with planner=fixed, each in its own
+  process, on the same position commands: a constant feed, a sine, a
+  jump the accel limit has to ramp to, and a stop and go, with the
+  maxaccel of every axis changed half way. Each axis gets a different
+  scale and accel limit.
+
+  The fixed planner is not an exact copy of the double one, the two
+  round differently. The words that differ are counted, and the
+  largest difference between the two step outputs is taken from the
+  feedback at each servo cycle; it must stay below a step. Only where
+  every word is the same is the step output identical to the bit.
+
+  usage: plantest [-n cycles] [-p period_ns] [-q queue] [-b batch] [-v]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rtapi.h"
+#include "rtapi_app.h"
+#include "hal.h"
+#include "picnc.h"
+
+#include "halsim.h"
+#include "bcm2835_mock.h"
+#include "fwpeer.h"
+
+/* per servo cycle, shared with the children */
+typedef struct {
+	int32_t vel[PICNC_BATCH][NUMAXES];
+	double fb[NUMAXES];
+} cycle_t;
+
+typedef struct {
+	int ok, fault, ready;
+	uint32_t hash;
+	cycle_t *cycle;
+} result_t;
+
+static long cycles = 4000, period = 1000000;
+static char *queue = "0", *batch = "0";
+
+static const bcm2835_mock_peer peer = {
+	fwpeer_reset,
+	fwpeer_request,
+	fwpeer_xfer,
+};
+
+static double scale(int i)
+{
+	return (i & 1 ? -1 : 1) * 200.0 * (i + 1);
+}
+
+static double maxaccel(int i, long n)
+{
+	return (n < cycles / 2 ? 20.0 : 50.0) / (i + 1);
+}
+
+/* position command of axis i at cycle n, in machine units */
+static double command(int i, long n)
+{
+	double t = n * period * 1e-9;
+
+	switch (i % 4) {
+	case 0:
+		return 0.5 * t;
+	case 1:
+		return 2.0 * sin(2.0 * M_PI * 0.8 * t);
+	case 2:
+		return n < cycles / 8 ? 0.0 : 1.5;
+	default:
+		return fmod(t, 1.0) < 0.5 ? 0.6 * t : 0.3;
+	}
+}
+
+static int run(const char *plan, result_t *r)
+{
+	hal_float_t *cmd[NUMAXES], *fb[NUMAXES], *sc[NUMAXES], *acc[NUMAXES];
+	char name[HAL_NAME_LEN + 1];
+	const volatile int32_t *tx = picnc_command(0);
+	int i, k, n_vel = atoi(batch) ? atoi(batch) : 1;
+	long n;
+
+	if ((halsim_set_param("planner", plan) < 0) ||
+	    (halsim_set_param("queue", queue) < 0) ||
+	    (halsim_set_param("batch", batch) < 0))
+		return -1;
+
+	fwpeer_init();
+	bcm2835_mock.peer[0] = &peer;
+	if (rtapi_app_main() < 0)
+		return -1;
+
+	for (i = 0; i < NUMAXES; i++) {
+		snprintf(name, sizeof(name), "picnc.axis.%d.position-cmd", i);
+		cmd[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.position-fb", i);
+		fb[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.scale", i);
+		sc[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.maxaccel", i);
+		acc[i] = halsim_pin(name);
+		if (!cmd[i] || !fb[i] || !sc[i] || !acc[i])
+			return -1;
+		*sc[i] = scale(i);
+	}
+
+	for (n = 0; n < cycles; n++) {
+		for (i = 0; i < NUMAXES; i++) {
+			*cmd[i] = command(i, n);
+			*acc[i] = maxaccel(i, n);
+		}
+
+		halsim_call("picnc.read", period);
+		halsim_call("picnc.update", period);
+		for (k = 0; k < n_vel; k++)
+			for (i = 0; i < NUMAXES; i++)
+				r->cycle[n].vel[k][i] = tx[BAT_VEL(k, i)];
+		halsim_call("picnc.write", period);
+
+		bcm2835_mock_flush();
+		fwpeer_run(picnc_basefreq * period * 1e-9 + 0.5);
+
+		for (i = 0; i < NUMAXES; i++)
+			r->cycle[n].fb[i] = *fb[i];
+	}
+
+	bcm2835_mock_flush();
+
+	r->hash = fwpeer.hash;
+	r->fault = *(hal_bit_t *)halsim_pin("picnc.fault");
+	r->ready = *(hal_bit_t *)halsim_pin("picnc.ready");
+
+	rtapi_app_exit();
+	r->ok = 1;
+
+	return 0;
+}
+
+/* the driver keeps its state in statics, so each planner gets a
+   process; the results are left in shared memory */
+static int run_child(const char *plan, result_t *r)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		run(plan, r);
+		_exit(0);
+	}
+
+	waitpid(pid, &status, 0);
+
+	return r->ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *plan[2] = { "double", "fixed" };
+	result_t *res;
+	long words[NUMAXES] = { 0 }, n;
+	int32_t worst[NUMAXES] = { 0 };
+	double diff[NUMAXES] = { 0 }, d;
+	int opt, i, j, k, n_vel, fail = 0;
+
+	while ((opt = getopt(argc, argv, "n:p:q:b:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			cycles = atol(optarg);
+			break;
+		case 'p':
+			period = atol(optarg);
+			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'v':
+			halsim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: plantest [-n cycles] "
+				"[-p period_ns] [-q queue] [-b batch] [-v]\n");
+			return 1;
+		}
+	}
+
+	if (cycles < 8) {
+		fprintf(stderr, "plantest: need at least 8 cycles\n");
+		return 1;
+	}
+	n_vel = atoi(batch) ? atoi(batch) : 1;
+
+	res = mmap(0, 2 * (sizeof(result_t) + cycles * sizeof(cycle_t)),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	res[0].cycle = (cycle_t *)&res[2];
+	res[1].cycle = res[0].cycle + cycles;
+
+	for (i = 0; i < 2; i++) {
+		if (run_child(plan[i], &res[i]) < 0) {
+			fprintf(stderr, "plantest: driver failed to load "
+				"with planner=%s\n", plan[i]);
+			return 1;
+		}
+		if (res[i].fault || !res[i].ready) {
+			printf("planner=%s lost the board\n", plan[i]);
+			fail = 1;
+		}
+	}
+
+	for (n = 0; n < cycles; n++) {
+		for (j = 0; j < NUMAXES; j++) {
+			for (k = 0; k < n_vel; k++) {
+				int32_t a = res[0].cycle[n].vel[k][j],
+					b = res[1].cycle[n].vel[k][j];
+
+				if (a == b)
+					continue;
+				words[j]++;
+				if (abs(a - b) > worst[j])
+					worst[j] = abs(a - b);
+			}
+
+			/* position-fb is in machine units */
+			d = fabs(res[0].cycle[n].fb[j] -
+				res[1].cycle[n].fb[j]) * fabs(scale(j));
+			if (d > diff[j])
+				diff[j] = d;
+		}
+	}
+
+	printf("%ld servo cycles of %ld ns, %d axes, queue %s, batch %s\n\n",
+		cycles, period, NUMAXES, queue, batch);
+	printf("axis  words differ  max (DDS/tick)  max fb diff (steps)\n");
+	for (j = 0; j < NUMAXES; j++) {
+		printf("%4d %13ld %15d %20.4f\n", j, words[j], worst[j],
+			diff[j]);
+		if (diff[j] >= 1.0)
+			fail = 1;
+	}
+	printf("(of %ld velocity words per axis)\n\n", cycles * n_vel);
+
+	if (fail) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	if (res[0].hash == res[1].hash)
+		printf("bus traffic identical, step output identical\n");
+	else
+		printf("step output within a step throughout\n");
+
+	return 0;
+}
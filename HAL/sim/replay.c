@@ -0,0 +1,434 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Replays position-cmd streams through the HAL driver and the firmware,
+  on the register mock, one servo cycle at a time. The stepgen that
+  runs is the firmware's own, so the DDS is the real one: STEPBIT 23,
+  wrapping at 32 bits.
+
+  A stream is either a file, one servo cycle per line with a
+  position-cmd per axis in machine units (halsampler output will do;
+  lines starting with # are skipped, missing axes stay at 0), or one
+  of the built-in shapes:
+
+	line	a constant 20 units/s on every axis
+	sine	axis i at (i + 1) * 0.5 Hz, amplitude 1 / (i + 1)
+	jump	a 2 unit step the accel limit has to ramp to
+	circle	axes 0 and 1 on a circle of radius 2, the others a line
+	stopgo	20 units/s for a quarter second, then a stop, and again
+
+  The shapes run for -n cycles, 2 s by default, a file to its end.
+  With neither -f nor -s all shapes are replayed, as a suite to compare
+  planners and parameters on. Per axis it reports:
+
+	ferr	the largest and the RMS following error, position-fb
+		against the command the board has had time to reach,
+		which is the command from 1 + queue cycles earlier
+	pulses	step pulses on the pins, and the net count signed by dir;
+		the DDS pulses twice per position count
+	lost	pulses the DDS accumulator has and the pins did not
+	clamps	servo cycles with a velocity word at the step rate limit
+
+  and the update function's time per cycle from picnc.timing.update.
+
+  usage: replay [-f file | -s shape]... [-n cycles] [-p period_ns]
+		[-S scale] [-a maxaccel] [-P planner] [-q queue] [-b batch]
+		[-m posmode] [-w stepwidth] [-F basefreq] [-v]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "rtapi.h"
+#include "rtapi_app.h"
+#include "hal.h"
+#include "picnc.h"
+
+#include "halsim.h"
+#include "bcm2835_mock.h"
+#include "fwpeer.h"
+
+#define MAX_STREAMS		16
+
+typedef struct {
+	int ok, fault, ready;
+	double max_err[NUMAXES], sum_sq[NUMAXES];
+	unsigned long pulses[NUMAXES], clamps[NUMAXES];
+	long steps[NUMAXES], lost[NUMAXES];
+	unsigned long update_mean, update_max;
+	long cycles;
+} result_t;
+
+static const char *shapes[] = { "line", "sine", "jump", "circle", "stopgo" };
+#define NSHAPES			(sizeof(shapes)/sizeof(shapes[0]))
+
+static long cycles = 0, period = 1000000;
+static double scale = 200.0, maxaccel = 50.0;
+static char *planner = "double", *queue = "0", *batch = "0",
+	    *posmode = "0", *stepwidth = "1", *basefreq = "160000";
+
+/* a recorded stream, read in full */
+static double (*rec)[NUMAXES];
+static long rec_len;
+
+static const bcm2835_mock_peer peer = {
+	fwpeer_reset,
+	fwpeer_request,
+	fwpeer_xfer,
+};
+
+static int load(const char *file)
+{
+	char line[1024], *p, *q;
+	long size = 0;
+	FILE *f;
+	int i;
+
+	f = fopen(file, "r");
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+
+	free(rec);
+	rec = 0;
+	rec_len = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		if (rec_len == size) {
+			size = size ? 2 * size : 1024;
+			rec = realloc(rec, size * sizeof(*rec));
+			if (!rec) {
+				fclose(f);
+				return -1;
+			}
+		}
+		p = line;
+		for (i = 0; i < NUMAXES; i++) {
+			rec[rec_len][i] = strtod(p, &q);
+			p = q;
+		}
+		rec_len++;
+	}
+	fclose(f);
+
+	return rec_len ? 0 : -1;
+}
+
+/* position command of axis i at cycle n of the stream, machine units */
+static double command(const char *shape, int i, long n)
+{
+	double t = n * period * 1e-9;
+
+	if (!shape) {
+		if (n >= rec_len)
+			n = rec_len - 1;
+		return rec[n][i];
+	}
+
+	if (!strcmp(shape, "line"))
+		return 20.0 * t;
+	if (!strcmp(shape, "sine"))
+		return sin(2.0 * M_PI * (i + 1) * 0.5 * t) / (i + 1);
+	if (!strcmp(shape, "jump"))
+		return t < 0.1 ? 0.0 : 2.0;
+	if (!strcmp(shape, "circle")) {
+		if (i < 2)
+			return 2.0 * (i ? sin(M_PI * t) : cos(M_PI * t) - 1.0);
+		return 20.0 * t;
+	}
+	/* stopgo */
+	return 20.0 * (floor(t / 0.5) * 0.25 + fmin(fmod(t, 0.5), 0.25));
+}
+
+static int run(const char *shape, result_t *r)
+{
+	hal_float_t *cmd[NUMAXES], *fb[NUMAXES], *sc[NUMAXES], *acc[NUMAXES];
+	char name[HAL_NAME_LEN + 1];
+	const volatile int32_t *tx = picnc_command(0);
+	int i, k, lag, samples, mode;
+	s32 vlim[NUMAXES], v;
+	long n;
+	double err;
+
+	if ((halsim_set_param("planner", planner) < 0) ||
+	    (halsim_set_param("queue", queue) < 0) ||
+	    (halsim_set_param("batch", batch) < 0) ||
+	    (halsim_set_param("posmode", posmode) < 0) ||
+	    (halsim_set_param("stepwidth", stepwidth) < 0) ||
+	    (halsim_set_param("basefreq", basefreq) < 0))
+		return -1;
+
+	fwpeer_init();
+	bcm2835_mock.peer[0] = &peer;
+	if (rtapi_app_main() < 0)
+		return -1;
+
+	for (i = 0; i < NUMAXES; i++) {
+		snprintf(name, sizeof(name), "picnc.axis.%d.position-cmd", i);
+		cmd[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.position-fb", i);
+		fb[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.scale", i);
+		sc[i] = halsim_pin(name);
+		snprintf(name, sizeof(name), "picnc.axis.%d.maxaccel", i);
+		acc[i] = halsim_pin(name);
+		if (!cmd[i] || !fb[i] || !sc[i] || !acc[i])
+			return -1;
+		*sc[i] = scale;
+		*acc[i] = maxaccel;
+	}
+
+	lag = 1 + atoi(queue);
+	mode = atoi(posmode);
+	/* velocity words sent per axis, >POS has none */
+	samples = mode ? (mode == 2) : (atoi(batch) ? atoi(batch) : 1);
+	for (i = 0; i < NUMAXES; i++) {
+		if (fwpeer.oc & (1 << i))
+			vlim[i] = fmin(PICNC_OC_MAX_VEL, (1L << 30) / STEP_MASK /
+				(period * 1e-9)) * VELSCALE;
+		else
+			vlim[i] = picnc_basefreq / (4.0 * atoi(stepwidth)) *
+				VELSCALE;
+	}
+
+	r->cycles = shape ? cycles : rec_len;
+	for (n = 0; n < r->cycles; n++) {
+		for (i = 0; i < NUMAXES; i++)
+			*cmd[i] = command(shape, i, n);
+
+		halsim_call("picnc.read", period);
+
+		/* position-fb now holds where the board got to */
+		for (i = 0; n > lag && i < NUMAXES; i++) {
+			err = fabs(*fb[i] - command(shape, i, n - lag));
+			if (err > r->max_err[i])
+				r->max_err[i] = err;
+			r->sum_sq[i] += err * err;
+		}
+
+		halsim_call("picnc.update", period);
+
+		/* a cycle counts once, however many of its samples hit */
+		for (i = 0; i < NUMAXES; i++) {
+			for (k = 0; k < samples; k++) {
+				v = tx[mode ? PVT_VEL(i) : BAT_VEL(k, i)];
+				if ((v >= vlim[i]) || (v <= -vlim[i])) {
+					r->clamps[i]++;
+					break;
+				}
+			}
+		}
+
+		halsim_call("picnc.write", period);
+
+		bcm2835_mock_flush();
+		fwpeer_run(picnc_basefreq * period * 1e-9 + 0.5);
+	}
+
+	/* the feedback of the last cycle */
+	halsim_call("picnc.read", period);
+	bcm2835_mock_flush();
+
+	for (i = 0; i < NUMAXES; i++) {
+		r->pulses[i] = fwpeer.pulses[i];
+		r->steps[i] = fwpeer.steps[i];
+		/* a pulse in flight at the end is not lost */
+		r->lost[i] = labs(lround(*fb[i] * scale * 2.0) - r->steps[i]);
+		if (r->lost[i])
+			r->lost[i]--;
+	}
+	r->update_mean = *(hal_u32_t *)halsim_pin("picnc.timing.update.mean");
+	r->update_max = *(hal_u32_t *)halsim_pin("picnc.timing.update.max");
+	r->fault = *(hal_bit_t *)halsim_pin("picnc.fault");
+	r->ready = *(hal_bit_t *)halsim_pin("picnc.ready");
+
+	rtapi_app_exit();
+	r->ok = 1;
+
+	return 0;
+}
+
+/* the driver keeps its state in statics, so each stream gets a process */
+static int run_child(const char *shape, result_t *r)
+{
+	int fd[2], status;
+	pid_t pid;
+
+	memset(r, 0, sizeof(*r));
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		close(fd[0]);
+		run(shape, r);
+		if (write(fd[1], r, sizeof(*r)) != sizeof(*r))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd[1]);
+	if (read(fd[0], r, sizeof(*r)) != sizeof(*r))
+		r->ok = 0;
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+
+	return r->ok ? 0 : -1;
+}
+
+static void report(const char *name, const result_t *r)
+{
+	int i, lag = 1 + atoi(queue);
+
+	printf("%s, %ld cycles%s\n", name, r->cycles,
+		(r->fault || !r->ready) ? ", driver lost the board" : "");
+	for (i = 0; i < NUMAXES; i++)
+		printf("%4d %12.6f %12.6f %10lu %10ld %6ld %8lu\n", i,
+			r->max_err[i],
+			r->cycles > lag ?
+				sqrt(r->sum_sq[i] / (r->cycles - lag)) : 0.0,
+			r->pulses[i], r->steps[i], r->lost[i],
+			r->clamps[i]);
+	printf("update %lu ns mean, %lu ns max\n\n", r->update_mean,
+		r->update_max);
+}
+
+int main(int argc, char **argv)
+{
+	const char *file[MAX_STREAMS], *shape[MAX_STREAMS];
+	int nstreams = 0, opt, i, fail = 0;
+	unsigned j;
+	result_t r;
+
+	while ((opt = getopt(argc, argv, "f:s:n:p:S:a:P:q:b:m:w:F:v")) != -1) {
+		switch (opt) {
+		case 'f':
+		case 's':
+			if (nstreams == MAX_STREAMS) {
+				fprintf(stderr, "replay: too many streams\n");
+				return 1;
+			}
+			file[nstreams] = opt == 'f' ? optarg : 0;
+			shape[nstreams++] = opt == 's' ? optarg : 0;
+			break;
+		case 'n':
+			cycles = atol(optarg);
+			break;
+		case 'p':
+			period = atol(optarg);
+			break;
+		case 'S':
+			scale = strtod(optarg, NULL);
+			break;
+		case 'a':
+			maxaccel = strtod(optarg, NULL);
+			break;
+		case 'P':
+			planner = optarg;
+			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'm':
+			posmode = optarg;
+			break;
+		case 'w':
+			stepwidth = optarg;
+			break;
+		case 'F':
+			basefreq = optarg;
+			break;
+		case 'v':
+			halsim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: replay [-f file | -s shape]... "
+				"[-n cycles] [-p period_ns]\n\t\t[-S scale] "
+				"[-a maxaccel] [-P planner] [-q queue] "
+				"[-b batch]\n\t\t[-m posmode] [-w stepwidth] "
+				"[-F basefreq] [-v]\n");
+			return 1;
+		}
+	}
+
+	if (!cycles)
+		cycles = 2000000000L / period;
+
+	for (i = 0; i < nstreams; i++) {
+		if (shape[i]) {
+			for (j = 0; j < NSHAPES; j++)
+				if (!strcmp(shape[i], shapes[j]))
+					break;
+			if (j == NSHAPES) {
+				fprintf(stderr, "replay: unknown shape %s\n",
+					shape[i]);
+				return 1;
+			}
+		}
+	}
+
+	/* the whole suite by default */
+	if (!nstreams) {
+		for (j = 0; j < NSHAPES; j++) {
+			file[j] = 0;
+			shape[j] = shapes[j];
+		}
+		nstreams = NSHAPES;
+	}
+
+	printf("servo period %ld ns, scale %g, maxaccel %g, planner %s, "
+		"queue %s, batch %s,\nposmode %s, stepwidth %s, basefreq %s\n\n",
+		period, scale, maxaccel, planner, queue, batch, posmode,
+		stepwidth, basefreq);
+	printf("axis     max ferr     rms ferr     pulses        net   lost"
+		"   clamps\n");
+	printf("(following error in machine units, clamps in servo "
+		"cycles)\n\n");
+
+	for (i = 0; i < nstreams; i++) {
+		if (file[i] && (load(file[i]) < 0)) {
+			fprintf(stderr, "replay: no commands in %s\n", file[i]);
+			return 1;
+		}
+		if (run_child(shape[i], &r) < 0) {
+			fprintf(stderr, "replay: driver failed to load\n");
+			return 1;
+		}
+		report(file[i] ? file[i] : shape[i], &r);
+		if (r.fault || !r.ready)
+			fail = 1;
+	}
+
+	return fail;
+}
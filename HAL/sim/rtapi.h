@@ -0,0 +1,71 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Host stand-in for the LinuxCNC rtapi.h, just enough to build the
+  driver off-target. Module parameters register themselves with the
+  HAL shim so that tools can set them like loadrt does, see halsim.h.
+*/
+
+#ifndef RTAPI_H
+#define RTAPI_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define RTAPI_MSG_NONE		0
+#define RTAPI_MSG_ERR		1
+#define RTAPI_MSG_WARN		2
+#define RTAPI_MSG_INFO		3
+#define RTAPI_MSG_DBG		4
+
+void rtapi_print_msg(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define rtapi_snprintf		snprintf
+
+long long int rtapi_get_time(void);	/* ns, CLOCK_MONOTONIC */
+void rtapi_delay(long int nsec);	/* busy waits */
+
+enum {
+	HALSIM_MP_INT,
+	HALSIM_MP_LONG,
+	HALSIM_MP_STRING
+};
+
+void halsim_register_param(const char *name, int type, void *var);
+
+#define HALSIM_MP(var, type)						\
+	static void __attribute__((constructor)) halsim_mp_##var(void)	\
+	{								\
+		halsim_register_param(#var, type, &var);		\
+	}
+
+#define RTAPI_MP_INT(var, desc)		HALSIM_MP(var, HALSIM_MP_INT)
+#define RTAPI_MP_LONG(var, desc)	HALSIM_MP(var, HALSIM_MP_LONG)
+#define RTAPI_MP_STRING(var, desc)	HALSIM_MP(var, HALSIM_MP_STRING)
+
+#endif
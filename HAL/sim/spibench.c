@@ -0,0 +1,502 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Measures each SPI transport against the board, or against the
+  firmware in-process for loopback:
+
+	round trip	REQ/RDY handshake and one >STA frame
+	read		the same with REQ raised well ahead, as read_spi
+			sees it after write_spi
+	frames/s	>STA frames back to back, one per start(), and
+			two per start() the way write_spi batches >LIM
+	servo cycle	the driver's read, update and write, paced at the
+			servo period; the run also checks that the driver
+			stays ready and the axes end up where commanded,
+			and reports its picnc.timing pins; the firmware
+			must have seen every frame
+	CRC errors	replies to the bench and to the driver that failed
+			their CRC, and frames the firmware dropped for one
+
+  Each transport runs in its own process. Only loopback runs by
+  default, devmem and spidev poke the hardware and must be asked for
+  with -t on the Pi.
+
+  -q, -b and -m are passed on to the driver as its queue, batch and
+  posmode parameters.
+
+  usage: spibench [-t transport]... [-D spidev] [-d dma] [-n frames]
+		  [-c cycles] [-p period_ns] [-q queue] [-b batch]
+		  [-m posmode] [-v]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rtapi.h"
+#include "rtapi_app.h"
+#include "hal.h"
+#include "picnc.h"
+#include "transport.h"
+
+#include "halsim.h"
+
+#define MAX_TRANSPORTS		4
+#define STAGES			5
+
+/* the driver's picnc.timing.* stages */
+static const char *stages[STAGES] = {
+	"read", "update", "write", "handshake", "transfer"
+};
+
+typedef struct {
+	int ok;
+	char error[80];
+	double rt_min, rt_med, rt_p99, rt_max;	/* round trip in us */
+	double rd_med, rd_max;			/* pipelined read in us */
+	double fps_single, fps_batch;
+	double cyc_med, cyc_max;		/* servo cycle in us */
+	double fb_err;				/* worst axis, in steps */
+	u32 stage_mean[STAGES], stage_max[STAGES];	/* ns */
+	u32 fw_frames, fw_unknown, fw_crc;	/* picnc.fw.* */
+	u32 crc_bench, crc_driver;		/* bad replies */
+	int ready, fault;
+} result_t;
+
+static long frames = 10000, cycles = 1000, period = 1000000;
+static char *device = "/dev/spidev0.0";
+static int dma = 0;
+static char *queue = "0", *batch = "0",	/* driver parameters */
+	    *posmode = "0";
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void sleep_until(struct timespec *ts, long ns)
+{
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL);
+}
+
+/* handshake and >STA frame, timed from REQ or, with ahead set, from
+   RDY after REQ went low ahead of time */
+static double round_trip(const picnc_transport *xp, picnc_frame *f,
+	int ahead)
+{
+	struct timespec ts;
+	double t;
+
+	if (ahead) {
+		xp->request();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		sleep_until(&ts, 100000);
+	}
+
+	t = now_us();
+	if (!ahead)
+		xp->request();
+	if (!xp->ready())
+		return -1;
+	xp->start(f, 1);
+	xp->wait();
+
+	return now_us() - t;
+}
+
+static int bench_transport(const picnc_transport *xp, result_t *r)
+{
+	picnc_transport_opts opts = { dma, device, 1 };
+	int32_t tx[2][BUFSIZE], rx[2][BUFSIZE];
+	picnc_frame f[2];
+	double *rt, t;
+	long n;
+
+	if (xp->open(&opts) < 0) {
+		snprintf(r->error, sizeof(r->error), "cannot open");
+		return -1;
+	}
+	xp->reset();
+
+	memset(tx, 0, sizeof(tx));
+	f[0].tx = tx[0];
+	f[0].rx = rx[0];
+	f[1].tx = tx[1];
+	f[1].rx = rx[1];
+	f[0].board = f[1].board = 0;
+
+	/* >VER twice, then one >STA so that every reply that follows
+	   starts with ~>STA */
+	tx[0][0] = tx[1][0] = PICNC_VER;
+	picnc_crc_seal(tx[0], VER_WORDS);
+	picnc_crc_seal(tx[1], VER_WORDS);
+	f[0].len = f[1].len = VER_WORDS * 4;
+	xp->start(f, 2);
+	xp->wait();
+	if ((rx[1][0] != (PICNC_VER ^ ~0)) ||
+	    (rx[1][VER_VERSION] != PICNC_PROTO_VERSION)) {
+		snprintf(r->error, sizeof(r->error), "no board, or "
+			"protocol version mismatch");
+		xp->close();
+		return -1;
+	}
+
+	tx[0][0] = tx[1][0] = PICNC_STA;
+	picnc_crc_seal(tx[0], FB_WORDS);
+	picnc_crc_seal(tx[1], FB_WORDS);
+	f[0].len = f[1].len = FB_WORDS * 4;
+	xp->start(f, 1);
+	xp->wait();
+
+	rt = malloc(frames * sizeof(*rt));
+	if (!rt) {
+		xp->close();
+		return -1;
+	}
+
+	/* the pipelined reads sleep in between, a tenth of them do */
+	for (n = 0; n < frames + frames / 10; n++) {
+		rt[n % frames] = round_trip(xp, f, n >= frames);
+
+		if (rt[n % frames] < 0) {
+			snprintf(r->error, sizeof(r->error),
+				"no answer to REQ");
+			free(rt);
+			xp->close();
+			return -1;
+		}
+
+		if (!picnc_crc_check(rx[0], FB_WORDS)) {
+			r->crc_bench++;
+		} else if (rx[0][0] != (PICNC_STA ^ ~0)) {
+			snprintf(r->error, sizeof(r->error),
+				"bad reply after %ld frames", n);
+			free(rt);
+			xp->close();
+			return -1;
+		}
+
+		if (n == frames - 1) {
+			qsort(rt, frames, sizeof(*rt), cmp_double);
+			r->rt_min = rt[0];
+			r->rt_med = rt[frames / 2];
+			r->rt_p99 = rt[frames * 99 / 100];
+			r->rt_max = rt[frames - 1];
+		}
+	}
+
+	qsort(rt, frames / 10, sizeof(*rt), cmp_double);
+	r->rd_med = rt[frames / 20];
+	r->rd_max = rt[frames / 10 - 1];
+	free(rt);
+
+	t = now_us();
+	for (n = 0; n < frames; n++) {
+		xp->start(f, 1);
+		xp->wait();
+	}
+	r->fps_single = frames * 1e6 / (now_us() - t);
+
+	t = now_us();
+	for (n = 0; n < frames; n += 2) {
+		xp->start(f, 2);
+		xp->wait();
+	}
+	r->fps_batch = n * 1e6 / (now_us() - t);
+
+	xp->close();
+	return 0;
+}
+
+/* the whole driver, moving every axis and then holding still */
+static int bench_driver(const char *name, result_t *r)
+{
+	hal_float_t *cmd[NUMAXES], *fb[NUMAXES], *maxaccel;
+	char pin[HAL_NAME_LEN + 1], val[16];
+	struct timespec next;
+	double *cyc, t, err;
+	long n, hold = cycles / 5;
+	int i;
+
+	snprintf(val, sizeof(val), "%d", dma);
+	if ((halsim_set_param("transport", name) < 0) ||
+	    (halsim_set_param("spidev", device) < 0) ||
+	    (halsim_set_param("dma", val) < 0) ||
+	    (halsim_set_param("queue", queue) < 0) ||
+	    (halsim_set_param("batch", batch) < 0) ||
+	    (halsim_set_param("posmode", posmode) < 0))
+		return -1;
+
+	if (rtapi_app_main() < 0) {
+		snprintf(r->error, sizeof(r->error), "driver failed to load");
+		return -1;
+	}
+
+	for (i = 0; i < NUMAXES; i++) {
+		snprintf(pin, sizeof(pin), "picnc.axis.%d.position-cmd", i);
+		cmd[i] = halsim_pin(pin);
+		snprintf(pin, sizeof(pin), "picnc.axis.%d.position-fb", i);
+		fb[i] = halsim_pin(pin);
+		snprintf(pin, sizeof(pin), "picnc.axis.%d.maxaccel", i);
+		maxaccel = halsim_pin(pin);
+		if (!cmd[i] || !fb[i] || !maxaccel)
+			return -1;
+		*maxaccel = 1e6;
+	}
+
+	cyc = malloc(cycles * sizeof(*cyc));
+	if (!cyc)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (n = 0; n < cycles; n++) {
+		for (i = 0; i < NUMAXES; i++) {
+			if (n < cycles - hold)
+				*cmd[i] = (i + 1) * 1000.0 * n * period * 1e-9;
+		}
+
+		t = now_us();
+		halsim_call("picnc.read", period);
+		halsim_call("picnc.update", period);
+		halsim_call("picnc.write", period);
+		cyc[n] = now_us() - t;
+
+		sleep_until(&next, period);
+	}
+
+	qsort(cyc, cycles, sizeof(*cyc), cmp_double);
+	r->cyc_med = cyc[cycles / 2];
+	r->cyc_max = cyc[cycles - 1];
+	free(cyc);
+
+	r->fb_err = 0;
+	for (i = 0; i < NUMAXES; i++) {
+		err = *fb[i] - *cmd[i];
+		if (err < 0)
+			err = -err;
+		if (err > r->fb_err)
+			r->fb_err = err;
+	}
+	for (i = 0; i < STAGES; i++) {
+		snprintf(pin, sizeof(pin), "picnc.timing.%s.mean", stages[i]);
+		r->stage_mean[i] = *(hal_u32_t *)halsim_pin(pin);
+		snprintf(pin, sizeof(pin), "picnc.timing.%s.max", stages[i]);
+		r->stage_max[i] = *(hal_u32_t *)halsim_pin(pin);
+	}
+	r->fw_frames = *(hal_u32_t *)halsim_pin("picnc.fw.frames");
+	r->fw_unknown = *(hal_u32_t *)halsim_pin("picnc.fw.unknown-cmds");
+	r->fw_crc = *(hal_u32_t *)halsim_pin("picnc.fw.crc-errors");
+	r->crc_driver = *(hal_u32_t *)halsim_pin("picnc.crc-errors");
+	r->ready = *(hal_bit_t *)halsim_pin("picnc.ready");
+	r->fault = *(hal_bit_t *)halsim_pin("picnc.fault");
+
+	rtapi_app_exit();
+	return 0;
+}
+
+/* the driver keeps its state in statics, so each transport gets a
+   process */
+static int run_child(const char *name, result_t *r)
+{
+	const picnc_transport *xp;
+	int fd[2], status;
+	pid_t pid;
+
+	memset(r, 0, sizeof(*r));
+	if (pipe(fd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+
+	if (!pid) {
+		close(fd[0]);
+		xp = picnc_transport_find(name);
+		if (!xp)
+			snprintf(r->error, sizeof(r->error), "not built in");
+		else if ((bench_transport(xp, r) == 0) &&
+		    (bench_driver(name, r) == 0))
+			r->ok = 1;
+		if (write(fd[1], r, sizeof(*r)) != sizeof(*r))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd[1]);
+	if (read(fd[0], r, sizeof(*r)) != sizeof(*r))
+		snprintf(r->error, sizeof(r->error), "crashed");
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+
+	return r->ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *names[MAX_TRANSPORTS];
+	result_t res[MAX_TRANSPORTS];
+	int count = 0, opt, i, j, fail = 0;
+
+	while ((opt = getopt(argc, argv, "t:D:d:n:c:p:q:b:m:v")) != -1) {
+		switch (opt) {
+		case 't':
+			if (count < MAX_TRANSPORTS)
+				names[count++] = optarg;
+			break;
+		case 'D':
+			device = optarg;
+			break;
+		case 'd':
+			dma = atoi(optarg);
+			break;
+		case 'n':
+			frames = atol(optarg);
+			break;
+		case 'c':
+			cycles = atol(optarg);
+			break;
+		case 'p':
+			period = atol(optarg);
+			break;
+		case 'q':
+			queue = optarg;
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'm':
+			posmode = optarg;
+			break;
+		case 'v':
+			halsim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: spibench [-t transport]... "
+				"[-D spidev] [-d dma] [-n frames] [-c cycles] "
+				"[-p period_ns]\n\t\t[-q queue] [-b batch] "
+				"[-m posmode] [-v]\n");
+			return 1;
+		}
+	}
+
+	if ((frames < 10) || (cycles < 5)) {
+		fprintf(stderr, "spibench: need at least 10 frames and "
+			"5 cycles\n");
+		return 1;
+	}
+
+	if (!count)
+		names[count++] = "loopback";
+
+	for (i = 0; i < count; i++)
+		run_child(names[i], &res[i]);
+
+	printf("%ld frames, %ld servo cycles of %ld ns, %d axes\n\n",
+		frames, cycles, period, NUMAXES);
+	printf("%-10s %28s %14s %18s %14s\n", "",
+		"round trip min/med/p99/max", "read med/max",
+		"frames/s 1 / 2", "cycle med/max");
+	for (i = 0; i < count; i++) {
+		if (!res[i].ok) {
+			printf("%-10s %s\n", names[i], res[i].error);
+			fail = 1;
+			continue;
+		}
+		printf("%-10s %6.1f %6.1f %6.1f %7.1f %6.1f %7.1f "
+			"%8.0f %9.0f %6.1f %7.1f\n", names[i], res[i].rt_min,
+			res[i].rt_med, res[i].rt_p99, res[i].rt_max,
+			res[i].rd_med, res[i].rd_max,
+			res[i].fps_single, res[i].fps_batch,
+			res[i].cyc_med, res[i].cyc_max);
+	}
+	printf("(times in us)\n\n");
+
+	printf("%-10s", "");
+	for (j = 0; j < STAGES; j++)
+		printf(" %15s", stages[j]);
+	printf("\n");
+	for (i = 0; i < count; i++) {
+		if (!res[i].ok)
+			continue;
+		printf("%-10s", names[i]);
+		for (j = 0; j < STAGES; j++)
+			printf(" %7.1f/%7.1f", res[i].stage_mean[j] * 1e-3,
+				res[i].stage_max[j] * 1e-3);
+		printf("\n");
+	}
+	printf("(driver picnc.timing mean/max in us)\n\n");
+
+	printf("%-10s %8s %8s %8s\n", "CRC errors", "bench", "driver",
+		"firmware");
+	for (i = 0; i < count; i++) {
+		if (!res[i].ok)
+			continue;
+		printf("%-10s %8u %8u %8u\n", names[i], res[i].crc_bench,
+			res[i].crc_driver, res[i].fw_crc);
+	}
+	printf("\n");
+
+	for (i = 0; i < count; i++) {
+		if (!res[i].ok)
+			continue;
+		if (!res[i].ready || res[i].fault) {
+			printf("%s: driver lost the board\n", names[i]);
+			fail = 1;
+		} else if (res[i].fw_unknown ||
+		    (res[i].fw_frames < 2 * (cycles - HEALTH_ITEMS))) {
+			printf("%s: firmware saw %u frames, %u unknown\n",
+				names[i], res[i].fw_frames, res[i].fw_unknown);
+			fail = 1;
+		} else if (res[i].fb_err > 1.0) {
+			printf("%s: position-fb off by %.2f steps\n",
+				names[i], res[i].fb_err);
+			fail = 1;
+		}
+	}
+
+	if (fail) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("all transports kept the board in step\n");
+	return 0;
+}
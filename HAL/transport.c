@@ -0,0 +1,58 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "rtapi.h"
+
+#include <string.h>
+
+#include "picnc.h"
+#include "transport.h"
+
+static const picnc_transport *transports[] = {
+	&picnc_devmem,
+	&picnc_spidev,
+#if defined(PICNC_LOOPBACK)
+	&picnc_loopback,
+#endif
+};
+
+const picnc_transport *picnc_transport_find(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(transports)/sizeof(transports[0]); i++)
+		if (!strcmp(name, transports[i]->name))
+			return transports[i];
+
+	return 0;
+}
+
+static long long frame_end;
+
+void picnc_frame_gap(void)
+{
+	long long ns = frame_end + PICNC_FRAME_GAP_US * 1000ll -
+		rtapi_get_time();
+
+	if (ns > 0)
+		rtapi_delay(ns);
+}
+
+void picnc_frame_done(void)
+{
+	frame_end = rtapi_get_time();
+}
@@ -0,0 +1,92 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef PICNC_TRANSPORT_H
+#define PICNC_TRANSPORT_H
+
+/*
+  How the driver gets frames to the board.
+
+	devmem		SPI0, GPIO and DMA registers mapped through /dev/mem,
+			the FIFO fed by the CPU or by two DMA channels
+	spidev		the kernel SPI driver through /dev/spidevX.Y, the
+			REQ/RDY/RESET lines through /dev/gpiomem
+	loopback	the firmware command handling and stepgen run in
+			the driver process, built with PICNC_LOOPBACK
+
+  start() clocks n frames back to back, PICNC_FRAME_GAP_US apart for
+  the board to take each one in; the first one keeps the same gap to
+  the last frame of the call before. It may return while the last
+  one is still running; wait() returns once it is done and its reply
+  is in place.
+
+  The feedback handshake is split in two: request() drops REQ and
+  returns at once, the board then keeps its reply up to date and holds
+  RDY low for as long as REQ stays low. ready() releases REQ, so the
+  reply is as fresh as it would be had REQ only just been raised, and
+  only waits if RDY is not low yet.
+
+  With two boards, each frame goes to the chip select of its board.
+  They share REQ and RESET, and ready() waits for RDY from both.
+
+  clock() sets the SPI clock to the core clock over div, an even
+  divisor; it is 0 where there is no SPI clock to set.
+*/
+
+typedef struct {
+	const void *tx;
+	void *rx;
+	int len;			/* bytes */
+	int board;			/* chip select, CE0 or CE1 */
+} picnc_frame;
+
+typedef struct {
+	int dma;			/* devmem: DMA channel, 0 for PIO */
+	const char *device;		/* spidev: device node */
+	int boards;			/* on CE0, and CE1 if 2 */
+} picnc_transport_opts;
+
+typedef struct {
+	const char *name;
+	int (*open)(const picnc_transport_opts *opts);
+	void (*close)(void);
+	void (*reset)(void);		/* pulse RESET, the board restarts */
+	void (*request)(void);		/* REQ low */
+	unsigned long (*ready)(void);	/* RDY, returns the timeout left */
+	void (*start)(const picnc_frame *f, int n);
+	void (*wait)(void);
+	void (*clock)(unsigned div);
+} picnc_transport;
+
+extern const picnc_transport picnc_devmem, picnc_spidev, picnc_loopback;
+
+const picnc_transport *picnc_transport_find(const char *name);
+
+/* the gap between frames: picnc_frame_gap() waits until it has passed
+   since the last picnc_frame_done() */
+void picnc_frame_gap(void);
+void picnc_frame_done(void);
+
+/* the control lines on the GPIO block, shared by devmem and spidev;
+   with spi set the SPI pins are handed to SPI0 as well */
+int picnc_gpio_open(int spi, int boards);
+void picnc_gpio_close(void);
+void picnc_gpio_reset(void);
+void picnc_gpio_request(void);
+unsigned long picnc_gpio_ready(void);
+
+#endif
@@ -0,0 +1,620 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "rtapi.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "picnc.h"
+#include "transport.h"
+
+static const char *modname = MODNAME;
+
+volatile unsigned *gpio, *spi, *dmac;
+
+static int gpio_spi = 0;			/* SPI pins set up too */
+static int gpio_boards = 1;
+
+/* with two boards GPIO 7 is CE1, and RESET moves, see the table */
+#define RESET_PIN		(gpio_boards > 1 ? 22 : 7)
+#define RDY_MASK		(gpio_boards > 1 ? (1l << 25 | 1l << 24) : \
+				 (1l << 25))
+
+/* DMA control blocks and buffers, in one locked page which the ARM
+   sees uncached */
+typedef struct {
+	bcm2835_dma_cb cb[2];
+	int32_t tx[BUFSIZE];
+	int32_t rx[BUFSIZE];
+} dma_mem_t;
+
+static int dma = 0;
+static dma_mem_t *dmamem;
+static u32 dmamem_bus;				/* its address for the DMA */
+static int xfer_busy = 0;			/* length of the running DMA frame */
+static void *xfer_rx;				/* where its reply goes */
+
+int map_gpio();
+int map_gpiomem();
+int map_dma(void **mem, u32 *bus);
+void unmap_dma(void *mem);
+static void setup_gpio();
+static void restore_gpio();
+
+/* hand the frame to the DMA, the SPI FIFO is fed and drained without
+   the CPU; RX is paced by the SPI and finishes last */
+static void dma_start(const picnc_frame *f)
+{
+	bcm2835_dma_cb *cb = dmamem->cb;
+
+	memcpy(dmamem->tx, f->tx, f->len);
+
+	cb[0].ti = DMA_TI_PERMAP(DMA_DREQ_SPI_RX) | DMA_TI_SRC_DREQ |
+		DMA_TI_DEST_INC | DMA_TI_WAIT_RESP;
+	cb[0].source_ad = BCM2835_SPIFIFO_BUS;
+	cb[0].dest_ad = dmamem_bus + offsetof(dma_mem_t, rx);
+	cb[0].txfr_len = f->len;
+	cb[0].stride = 0;
+	cb[0].nextconbk = 0;
+
+	cb[1].ti = DMA_TI_PERMAP(DMA_DREQ_SPI_TX) | DMA_TI_DEST_DREQ |
+		DMA_TI_SRC_INC | DMA_TI_WAIT_RESP;
+	cb[1].source_ad = dmamem_bus + offsetof(dma_mem_t, tx);
+	cb[1].dest_ad = BCM2835_SPIFIFO_BUS;
+	cb[1].txfr_len = f->len;
+	cb[1].stride = 0;
+	cb[1].nextconbk = 0;
+
+	/* control blocks must be in memory before the channels start */
+	__sync_synchronize();
+
+	BCM2835_SPICS = SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX;
+	BCM2835_SPIDLEN = f->len;
+
+	BCM2835_DMACONBLK(dma + 1) = dmamem_bus + offsetof(dma_mem_t, cb[0]);
+	BCM2835_DMACS(dma + 1) = DMA_CS_END | DMA_CS_ACTIVE;
+	BCM2835_DMACONBLK(dma) = dmamem_bus + offsetof(dma_mem_t, cb[1]);
+	BCM2835_DMACS(dma) = DMA_CS_END | DMA_CS_ACTIVE;
+
+	/* activate transfer */
+	BCM2835_SPICS = SPI_CS_DMAEN | SPI_CS_ADCS | SPI_CS_TA |
+		SPI_CS_CS(f->board);
+
+	xfer_busy = f->len;
+	xfer_rx = f->rx;
+}
+
+static void dma_wait()
+{
+	unsigned long timeout = REQ_TIMEOUT;
+
+	while ((BCM2835_DMACS(dma + 1) & DMA_CS_ACTIVE) && --timeout);
+
+	/* end transfer */
+	BCM2835_SPICS = 0;
+
+	if (BCM2835_DMACS(dma + 1) & DMA_CS_ACTIVE) {
+		/* stop both channels, read_spi sees a bad reply */
+		BCM2835_DMACS(dma) = DMA_CS_RESET;
+		BCM2835_DMACS(dma + 1) = DMA_CS_RESET;
+		*(int32_t *)xfer_rx = 0;
+		xfer_busy = 0;
+		picnc_frame_done();
+		return;
+	}
+
+	__sync_synchronize();
+
+	memcpy(xfer_rx, dmamem->rx, xfer_busy);
+
+	xfer_busy = 0;
+	picnc_frame_done();
+}
+
+/* a frame that fits the FIFO is written in one go and read back once
+   it is done; the rest of a longer one goes in a byte at a time, as
+   bytes come back and make room */
+static void pio_transfer(const picnc_frame *f)
+{
+	const char *tx = f->tx;
+	char *rx = f->rx;
+	int i, n;
+
+	n = f->len < SPI_FIFO_SIZE ? f->len : SPI_FIFO_SIZE;
+
+	/* activate transfer */
+	BCM2835_SPICS = SPI_CS_TA | SPI_CS_CS(f->board);
+
+	/* send the frame */
+	for (i=0; i<n; i++) {
+		BCM2835_SPIFIFO = *tx++;
+	}
+
+	for (; i<f->len; i++) {
+		while (!(BCM2835_SPICS & SPI_CS_RXD));
+		*rx++ = BCM2835_SPIFIFO;
+		BCM2835_SPIFIFO = *tx++;
+	}
+
+	/* wait until transfer is finished */
+	while (!(BCM2835_SPICS & SPI_CS_DONE));
+
+	/* clear DONE bit */
+	BCM2835_SPICS = SPI_CS_DONE;
+
+	/* read buffer */
+	for (i=0; i<n; i++) {
+		*rx++ = BCM2835_SPIFIFO;
+	}
+
+	picnc_frame_done();
+}
+
+static void devmem_wait()
+{
+	if (xfer_busy)
+		dma_wait();
+}
+
+/* with DMA only the last frame is left running, the ones before it
+   are waited for; each frame follows a gap in which the board
+   restarts its SPI DMA */
+static void devmem_start(const picnc_frame *f, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		devmem_wait();
+		picnc_frame_gap();
+		if (dma)
+			dma_start(&f[i]);
+		else
+			pio_transfer(&f[i]);
+	}
+}
+
+static void devmem_clock(unsigned div)
+{
+	BCM2835_SPICLK = div;
+}
+
+static int setup_dma()
+{
+	if ((dma < 1) || (dma > 13)) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: dma must be a channel from 1 to 13\n",
+			modname);
+		return -1;
+	}
+
+	if (map_dma((void **)&dmamem, &dmamem_bus) < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: cannot set up DMA, try dma=0\n", modname);
+		return -1;
+	}
+
+	BCM2835_DMAENABLE |= (1 << dma) | (1 << (dma + 1));
+
+	if ((BCM2835_DMACS(dma) | BCM2835_DMACS(dma + 1)) & DMA_CS_ACTIVE) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: DMA channel %d or %d is in use\n",
+			modname, dma, dma + 1);
+		unmap_dma(dmamem);
+		return -1;
+	}
+
+	BCM2835_DMACS(dma) = DMA_CS_RESET;
+	BCM2835_DMACS(dma + 1) = DMA_CS_RESET;
+
+	return 0;
+}
+
+static int devmem_open(const picnc_transport_opts *opts)
+{
+	if (picnc_gpio_open(1, opts->boards) < 0)
+		return -1;
+
+	dma = opts->dma;
+	if (dma && (setup_dma() < 0)) {
+		picnc_gpio_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+static void devmem_close()
+{
+	if (dma) {
+		devmem_wait();
+		BCM2835_DMACS(dma) = DMA_CS_RESET;
+		BCM2835_DMACS(dma + 1) = DMA_CS_RESET;
+		unmap_dma(dmamem);
+	}
+	picnc_gpio_close();
+}
+
+const picnc_transport picnc_devmem = {
+	"devmem",
+	devmem_open,
+	devmem_close,
+	picnc_gpio_reset,
+	picnc_gpio_request,
+	picnc_gpio_ready,
+	devmem_start,
+	devmem_wait,
+	devmem_clock,
+};
+
+int picnc_gpio_open(int spi_pins, int boards)
+{
+	int retval;
+
+	retval = spi_pins ? map_gpio() : map_gpiomem();
+	if (retval < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,
+			"%s: ERROR: cannot map GPIO memory\n", modname);
+		return retval;
+	}
+
+	gpio_spi = spi_pins;
+	gpio_boards = boards;
+	setup_gpio();
+
+	return 0;
+}
+
+void picnc_gpio_close()
+{
+	restore_gpio();
+	munmap((void *)gpio,BLOCK_SIZE);
+	if (gpio_spi)
+		munmap((void *)spi,BLOCK_SIZE);
+}
+
+void picnc_gpio_request()
+{
+	/* send request, active low */
+	BCM2835_GPCLR0 = (1l << 23);
+}
+
+/* RDY stays low until REQ is released, so it is a latch: when the
+   request went out a servo period ago this is a single read, for
+   both boards at once. The event detect registers would do the same,
+   but enabling them raises the GPIO bank interrupt, which the kernel
+   does not clear for pins it does not own. Returns the timeout left,
+   0 if a board did not answer */
+unsigned long picnc_gpio_ready()
+{
+	unsigned long timeout = REQ_TIMEOUT;
+
+	/* wait until ready, signal active low */
+	while ((BCM2835_GPLEV0 & RDY_MASK) && --timeout);
+
+	/* clear request, active low */
+	BCM2835_GPSET0 = (1l << 23);
+
+	return timeout;
+}
+
+#if !defined(PICNC_MOCK)
+int map_gpio()
+{
+	int fd;
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't open /dev/mem \n",modname);
+		return -1;
+	}
+
+	/* mmap GPIO */
+	gpio = mmap(
+		   NULL,
+		   BLOCK_SIZE,
+		   PROT_READ|PROT_WRITE,
+		   MAP_SHARED,
+		   fd,
+		   BCM2835_GPIO_BASE);
+
+	if (gpio == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map gpio\n",modname);
+		close(fd);
+		return -1;
+	}
+
+	/* mmap SPI */
+	spi = mmap(
+		  NULL,
+		  BLOCK_SIZE,
+		  PROT_READ|PROT_WRITE,
+		  MAP_SHARED,
+		  fd,
+		  BCM2835_SPI_BASE);
+
+	close(fd);
+
+	if (spi == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map spi\n",modname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* only the GPIO block, through /dev/gpiomem where the kernel has it,
+   which does not need root */
+int map_gpiomem()
+{
+	int fd;
+	off_t base = 0;
+
+	fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+	if (fd < 0) {
+		fd = open("/dev/mem", O_RDWR | O_SYNC);
+		base = BCM2835_GPIO_BASE;
+	}
+	if (fd < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't open /dev/gpiomem \n",
+			modname);
+		return -1;
+	}
+
+	gpio = mmap(NULL, BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+		base);
+	close(fd);
+
+	if (gpio == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map gpio\n",modname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *dma_page;
+
+/* map the DMA controller, and lock a page for the control blocks and
+   buffers; the DMA needs its physical address, and the ARM has to see
+   it uncached, so it is mapped a second time through /dev/mem */
+int map_dma(void **mem, u32 *bus)
+{
+	int fd, pfd;
+	u64 entry;
+	off_t phys;
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd < 0) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't open /dev/mem \n",modname);
+		return -1;
+	}
+
+	dmac = mmap(
+		   NULL,
+		   BLOCK_SIZE,
+		   PROT_READ|PROT_WRITE,
+		   MAP_SHARED,
+		   fd,
+		   BCM2835_DMA_BASE);
+
+	if (dmac == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map dma\n",modname);
+		close(fd);
+		return -1;
+	}
+
+	dma_page = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED, -1, 0);
+	if (dma_page == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't lock dma page\n",
+			modname);
+		close(fd);
+		return -1;
+	}
+	memset(dma_page, 0, PAGE_SIZE);
+
+	pfd = open("/proc/self/pagemap", O_RDONLY);
+	if ((pfd < 0) ||
+	    (lseek(pfd, (unsigned long)dma_page / PAGE_SIZE * 8, SEEK_SET) < 0) ||
+	    (read(pfd, &entry, sizeof(entry)) != sizeof(entry)) ||
+	    !(entry & (1ull << 63))) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't find dma page\n",
+			modname);
+		if (pfd >= 0)
+			close(pfd);
+		close(fd);
+		return -1;
+	}
+	close(pfd);
+
+	phys = (entry & ((1ull << 55) - 1)) * PAGE_SIZE;
+	*mem = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+		phys);
+	close(fd);
+
+	if (*mem == MAP_FAILED) {
+		rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't map dma page\n",
+			modname);
+		return -1;
+	}
+
+	*bus = BCM2835_BUS_SDRAM(phys);
+	return 0;
+}
+
+void unmap_dma(void *mem)
+{
+	munmap(mem, PAGE_SIZE);
+	munmap(dma_page, PAGE_SIZE);
+	munmap((void *)dmac, BLOCK_SIZE);
+}
+#endif
+
+/*    GPIO USAGE
+ *
+ *	GPIO	Dir	Signal		Note
+ *
+ *	25	IN	DATA READY	active low
+ *	9	IN	MISO		SPI
+ *	23	OUT	DATA REQUEST	active low
+ *	10	OUT	MOSI		SPI
+ *	11	OUT	SCLK		SPI
+ *	7	OUT	RESET		active low
+ *
+ *    With two boards, REQUEST, RESET and the SPI lines are shared:
+ *
+ *	25	IN	DATA READY	board 0
+ *	24	IN	DATA READY	board 1
+ *	8	OUT	CE0		SPI, board 0
+ *	7	OUT	CE1		SPI, board 1
+ *	22	OUT	RESET		active low
+ *
+ *    With spidev the SPI pins belong to the kernel driver.
+ */
+
+static void setup_gpio()
+{
+	u32 x;
+
+	/* data ready GPIO 25, input */
+	x = BCM2835_GPFSEL2;
+	x &= ~(0b111 << (5*3));
+	BCM2835_GPFSEL2 = x;
+
+	/* data request GPIO 23, output */
+	x = BCM2835_GPFSEL2;
+	x &= ~(0b111 << (3*3));
+	x |= (0b001 << (3*3));
+	BCM2835_GPFSEL2 = x;
+
+	/* reset GPIO 7 or 22, output */
+	x = BCM2835_GPFSEL(RESET_PIN);
+	x &= ~(0b111 << (RESET_PIN%10*3));
+	x |= (0b001 << (RESET_PIN%10*3));
+	BCM2835_GPFSEL(RESET_PIN) = x;
+
+	/* data ready of board 1 GPIO 24, input */
+	if (gpio_boards > 1) {
+		x = BCM2835_GPFSEL2;
+		x &= ~(0b111 << (4*3));
+		BCM2835_GPFSEL2 = x;
+	}
+
+	if (!gpio_spi)
+		return;
+
+	/* chip selects GPIO 7 and 8 */
+	if (gpio_boards > 1) {
+		x = BCM2835_GPFSEL0;
+		x &= ~(0b111 << (7*3) | 0b111 << (8*3));
+		x |= (0b100 << (7*3) | 0b100 << (8*3));
+		BCM2835_GPFSEL0 = x;
+	}
+
+	/* change SPI pins */
+	x = BCM2835_GPFSEL0;
+	x &= ~(0b111 << (9*3));
+	x |=   (0b100 << (9*3));
+	BCM2835_GPFSEL0 = x;
+
+	x = BCM2835_GPFSEL1;
+	x &= ~(0b111 << (0*3) | 0b111 << (1*3));
+	x |= (0b100 << (0*3) | 0b100 << (1*3));
+	BCM2835_GPFSEL1 = x;
+
+	/* set up SPI */
+	BCM2835_SPICLK = SPICLKDIV;
+
+	BCM2835_SPICS = 0;
+
+	/* clear FIFOs */
+	BCM2835_SPICS |= SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX;
+
+	/* clear done bit */
+	BCM2835_SPICS |= SPI_CS_DONE;
+}
+
+static void restore_gpio()
+{
+	u32 x;
+
+	/* change all used pins back to inputs */
+
+	/* GPIO 7 or 22 */
+	x = BCM2835_GPFSEL(RESET_PIN);
+	x &= ~(0b111 << (RESET_PIN%10*3));
+	BCM2835_GPFSEL(RESET_PIN) = x;
+
+	/* GPIO 23 */
+	x = BCM2835_GPFSEL2;
+	x &= ~(0b111 << (3*3));
+	BCM2835_GPFSEL2 = x;
+
+	/* GPIO 25 */
+	x = BCM2835_GPFSEL2;
+	x &= ~(0b111 << (5*3));
+	BCM2835_GPFSEL2 = x;
+
+	if (!gpio_spi)
+		return;
+
+	/* GPIO 7 and 8 */
+	if (gpio_boards > 1) {
+		x = BCM2835_GPFSEL0;
+		x &= ~(0b111 << (7*3) | 0b111 << (8*3));
+		BCM2835_GPFSEL0 = x;
+	}
+
+	/* change SPI pins to inputs*/
+	x = BCM2835_GPFSEL0;
+	x &= ~(0b111 << (9*3));
+	BCM2835_GPFSEL0 = x;
+
+	x = BCM2835_GPFSEL1;
+	x &= ~(0b111 << (0*3) | 0b111 << (1*3));
+	BCM2835_GPFSEL1 = x;
+}
+
+void picnc_gpio_reset()
+{
+	u32 x,i;
+
+	/* GPIO 7, or 22, is configured as a tri-state output pin */
+
+	/* set as output */
+	x = BCM2835_GPFSEL(RESET_PIN);
+	x &= ~(0b111 << (RESET_PIN%10*3));
+	x |= (0b001 << (RESET_PIN%10*3));
+	BCM2835_GPFSEL(RESET_PIN) = x;
+
+	/* board reset is active low */
+	for (i=0; i<0x10000; i++)
+		BCM2835_GPCLR0 = (1l << RESET_PIN);
+
+	/* wait until the board is ready */
+	for (i=0; i<0x300000; i++)
+		BCM2835_GPSET0 = (1l << RESET_PIN);
+
+	/* reset back to input */
+	x = BCM2835_GPFSEL(RESET_PIN);
+	x &= ~(0b111 << (RESET_PIN%10*3));
+	BCM2835_GPFSEL(RESET_PIN) = x;
+}
@@ -0,0 +1,129 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "rtapi.h"
+
+#include <time.h>
+
+#include "picnc.h"
+#include "transport.h"
+#include "fwpeer.h"
+
+/*
+  No board: the firmware command handling and stepgen from firmware/sim
+  answer in the driver process, through the same byte exchange that
+  the register mock uses (sim/fwpeer.c). The stepgen ISR is run for
+  the wall clock time passed since the last call, so the board keeps
+  time with the servo thread.
+
+  Only built with PICNC_LOOPBACK, which links the firmware in, see
+  sim/Makefile.
+*/
+
+#define LOOPBACK_MAX_TICKS	((long)(picnc_basefreq / 10))
+
+static struct timespec last;
+
+static void catch_up()
+{
+	struct timespec now;
+	long long ns;
+	long ticks;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - last.tv_sec) * 1000000000ll +
+		(now.tv_nsec - last.tv_nsec);
+	ticks = ns * picnc_basefreq * 1e-9;
+
+	/* after a stall the board does not try to catch up */
+	if (ticks > LOOPBACK_MAX_TICKS) {
+		fwpeer_run(LOOPBACK_MAX_TICKS);
+		last = now;
+		return;
+	}
+
+	fwpeer_run(ticks);
+
+	/* keep the fraction of a tick for the next call */
+	ns = ticks * 1e9 / picnc_basefreq + last.tv_nsec;
+	last.tv_sec += ns / 1000000000ll;
+	last.tv_nsec = ns % 1000000000ll;
+}
+
+static int loopback_open(const picnc_transport_opts *opts)
+{
+	fwpeer_init();
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	return 0;
+}
+
+static void loopback_close()
+{
+}
+
+static void loopback_reset()
+{
+	fwpeer_reset(1);
+	fwpeer_reset(0);
+	clock_gettime(CLOCK_MONOTONIC, &last);
+}
+
+static void loopback_request()
+{
+}
+
+/* the board answers at once, with the reply sampled now */
+static unsigned long loopback_ready()
+{
+	catch_up();
+	fwpeer_request();
+	return REQ_TIMEOUT;
+}
+
+static void loopback_start(const picnc_frame *f, int n)
+{
+	const unsigned char *tx;
+	unsigned char *rx;
+	int i;
+
+	catch_up();
+
+	for (; n > 0; f++, n--) {
+		tx = f->tx;
+		rx = f->rx;
+		picnc_frame_gap();
+		for (i = 0; i < f->len; i++)
+			rx[i] = fwpeer_xfer(tx[i]);
+		picnc_frame_done();
+	}
+}
+
+static void loopback_wait()
+{
+}
+
+const picnc_transport picnc_loopback = {
+	"loopback",
+	loopback_open,
+	loopback_close,
+	loopback_reset,
+	loopback_request,
+	loopback_ready,
+	loopback_start,
+	loopback_wait,
+	0,
+};
@@ -0,0 +1,151 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "rtapi.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/spi/spidev.h>
+
+#include "picnc.h"
+#include "transport.h"
+
+/*
+  The kernel owns SPI0, frames go through /dev/spidevX.Y. All frames
+  of a start() are handed over in one SPI_IOC_MESSAGE, with a gap after
+  each so that the board can restart its SPI DMA. The ioctl returns
+  once the last frame is done, wait() has nothing left to do.
+
+  A second board is on the next chip select, the device node with its
+  last digit one up; its frames go in an SPI_IOC_MESSAGE of their own.
+*/
+
+#define SPIDEV_MAX_FRAMES	4
+
+static const char *modname = MODNAME;
+
+static int fd[PICNC_BOARDS_MAX], nfd = 0;
+static u32 speed;
+
+static void close_fds()
+{
+	while (nfd > 0)
+		close(fd[--nfd]);
+}
+
+static int spidev_open(const picnc_transport_opts *opts)
+{
+	u8 mode = SPI_MODE_0, bits = 8;
+	char node[64];
+
+	speed = SPI_SPEED_HZ;
+
+	for (nfd = 0; nfd < opts->boards; nfd++) {
+		snprintf(node, sizeof(node), "%s", opts->device);
+		node[strlen(node) - 1] += nfd;
+
+		fd[nfd] = open(node, O_RDWR);
+		if (fd[nfd] < 0) {
+			rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't open %s\n",
+				modname, node);
+			close_fds();
+			return -1;
+		}
+
+		if ((ioctl(fd[nfd], SPI_IOC_WR_MODE, &mode) < 0) ||
+		    (ioctl(fd[nfd], SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+		    (ioctl(fd[nfd], SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)) {
+			rtapi_print_msg(RTAPI_MSG_ERR,"%s: can't set up %s\n",
+				modname, node);
+			nfd++;
+			close_fds();
+			return -1;
+		}
+	}
+
+	if (picnc_gpio_open(0, opts->boards) < 0) {
+		close_fds();
+		return -1;
+	}
+
+	return 0;
+}
+
+static void spidev_close()
+{
+	picnc_gpio_close();
+	close_fds();
+}
+
+static void spidev_start(const picnc_frame *f, int n)
+{
+	struct spi_ioc_transfer xfer[SPIDEV_MAX_FRAMES];
+	int i, m;
+
+	for (; n > 0; f += m, n -= m) {
+		for (m = 1; (m < n) && (m < SPIDEV_MAX_FRAMES) &&
+		     (f[m].board == f[0].board); m++);
+
+		memset(xfer, 0, sizeof(xfer));
+		for (i = 0; i < m; i++) {
+			xfer[i].tx_buf = (unsigned long)f[i].tx;
+			xfer[i].rx_buf = (unsigned long)f[i].rx;
+			xfer[i].len = f[i].len;
+			xfer[i].speed_hz = speed;
+			xfer[i].bits_per_word = 8;
+			if (i < m - 1)
+				xfer[i].delay_usecs = PICNC_FRAME_GAP_US;
+		}
+
+		picnc_frame_gap();
+		if (ioctl(fd[f[0].board], SPI_IOC_MESSAGE(m), xfer) < 0) {
+			/* the caller sees a bad reply */
+			for (i = 0; i < m; i++)
+				*(int32_t *)f[i].rx = 0;
+		}
+		picnc_frame_done();
+	}
+}
+
+static void spidev_wait()
+{
+}
+
+/* the kernel rounds it to a divisor of its own */
+static void spidev_clock(unsigned div)
+{
+	int i;
+
+	speed = BCM2835_CORE_CLK / div;
+	for (i = 0; i < nfd; i++)
+		ioctl(fd[i], SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+}
+
+const picnc_transport picnc_spidev = {
+	"spidev",
+	spidev_open,
+	spidev_close,
+	picnc_gpio_reset,
+	picnc_gpio_request,
+	picnc_gpio_ready,
+	spidev_start,
+	spidev_wait,
+	spidev_clock,
+};
@@ -0,0 +1,51 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Build-time parameters shared by the firmware and the HAL driver.
+  Both sides must be built with the same values, e.g. by passing
+  -DNUMAXES=6 to both builds.
+*/
+
+#ifndef PICNC_CONFIG_H
+#define PICNC_CONFIG_H
+
+#ifndef NUMAXES
+#define NUMAXES			4		/* X Y Z A */
+#endif
+
+#define MAXAXES			9		/* see hardware.h pin table */
+
+#ifndef PICNC_BATCH
+#define PICNC_BATCH		4		/* velocity samples per >BAT */
+#endif
+
+#ifndef PICNC_ENCODERS
+#define PICNC_ENCODERS		2		/* quadrature inputs */
+#endif
+
+#define STEPBIT			23		/* bit location in DDS accum */
+
+#define PICNC_STATIC_ASSERT(expr, name)					\
+	typedef char picnc_static_assert_##name[(expr) ? 1 : -1]
+
+PICNC_STATIC_ASSERT(NUMAXES >= 1 && NUMAXES <= MAXAXES, numaxes_in_range);
+PICNC_STATIC_ASSERT(PICNC_BATCH >= 2 && PICNC_BATCH <= 8, batch_in_range);
+PICNC_STATIC_ASSERT(PICNC_ENCODERS >= 0 && PICNC_ENCODERS <= 4,
+	encoders_in_range);
+
+#endif
@@ -0,0 +1,342 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  SPI frame protocol between the HAL driver and the PICnc firmware.
+
+  A frame is a sequence of 32 bit words, the first of which is the
+  command. Its length depends on the command (see picnc_frame_words()),
+  so a transfer only clocks the words it needs. While a frame is
+  clocked in, the board clocks out the reply it prepared earlier; word
+  0 of every reply is the complement of the previous command.
+
+  Before anything else the driver sends >VER twice and reads the
+  version, capabilities and axis count from the second reply.
+
+  The last word of every frame is a CRC over the words before it (see
+  picnc_crc.h), it is counted in the *_WORDS below. The board drops
+  frames with a bad CRC. Its reply is sealed the same way as an >STA
+  frame, or an >STC one with compact feedback (see >CFG), so only
+  replies read by a frame at least that long, such as the feedback
+  read by the poll, can be checked.
+*/
+
+#ifndef PICNC_PROTO_H
+#define PICNC_PROTO_H
+
+#include "picnc_config.h"
+#include "picnc_crc.h"
+
+#define PICNC_PROTO_VERSION	14
+
+/* command words, the '>' is the first byte on the wire */
+#define PICNC_CMD		0x444D433E	/* >CMD */
+#define PICNC_CFG		0x4746433E	/* >CFG */
+#define PICNC_RST		0x5453523E	/* >RST */
+#define PICNC_TST		0x5453543E	/* >TST */
+#define PICNC_VER		0x5245563E	/* >VER */
+#define PICNC_STA		0x4154533E	/* >STA */
+#define PICNC_POS		0x534F503E	/* >POS */
+#define PICNC_LIM		0x4D494C3E	/* >LIM */
+#define PICNC_BAT		0x5441423E	/* >BAT */
+#define PICNC_PVT		0x5456503E	/* >PVT */
+#define PICNC_OUT		0x54554F3E	/* >OUT */
+#define PICNC_STC		0x4354533E	/* >STC */
+
+/* capability bits returned by >VER */
+#define PICNC_CAP_QUEUE		(1 << 0)	/* segment queue */
+#define PICNC_CAP_POSITION	(1 << 1)	/* >POS and >LIM */
+#define PICNC_CAP_BATCH		(1 << 2)	/* >BAT */
+#define PICNC_CAP_PVT		(1 << 3)	/* >PVT */
+#define PICNC_CAP_PROBE		(1 << 4)	/* probe latch */
+#define PICNC_CAP_ADC		(1 << 5)	/* averaged ADC */
+
+/* velocity segment queue on the board, see stepgen.c */
+#define PICNC_QUEUE_SIZE	16		/* power of 2 */
+#define PICNC_QUEUE_MAX		(PICNC_QUEUE_SIZE - 2)	/* max depth */
+
+/* >CMD: velocities, segment
+
+   The segment word holds the sequence number in bits 23-16 and the
+   duration in ISR ticks in bits 15-0. A duration of 0 applies the
+   velocities at once and flushes the queue, otherwise they are queued
+   and played back to back. */
+#define CMD_VEL(a)		(1 + (a))
+#define CMD_SEGMENT		(1 + NUMAXES)
+#define CMD_WORDS		(3 + NUMAXES)
+
+/* >OUT: outputs, pwm
+
+   Sent by the host only when they change, and now and then in case
+   one was dropped or the board was reset. */
+#define OUT_OUTPUTS		1
+#define OUT_PWM(a)		(2 + (a))
+#define OUT_WORDS		5
+
+/* >POS: target positions, segment
+
+   Same layout as >CMD, with the velocities replaced by the target DDS
+   positions. The board works out the target velocity from successive
+   targets and ramps each axis towards its target, one axis per ISR
+   tick, so every axis is ramped once every PICNC_RAMP_TICKS ticks. */
+#define CMD_POS(a)		(1 + (a))
+
+#define PICNC_RAMP_TICKS	16		/* power of 2, >= NUMAXES */
+
+#define SEGMENT(seq, ticks)	((((seq) & 0xFF) << 16) | ((ticks) & 0xFFFF))
+#define SEGMENT_SEQ(x)		(((x) >> 16) & 0xFF)
+#define SEGMENT_TICKS(x)	((x) & 0xFFFF)
+
+/* >BAT: a >CMD with PICNC_BATCH - 1 more velocity samples per axis
+   between the segment word and the CRC
+
+   The servo period is cut into n samples, n in bits 31-24 of the
+   segment word and at most PICNC_BATCH; sample k is queued as a
+   segment of its own, with sequence number seq + k and its share of
+   the ticks (picnc_batch_ticks()). There must be at least n ticks.
+   Unused samples are ignored. */
+#define BAT_VEL(k, a)		((k) ? CMD_SEGMENT + 1 +			\
+				 ((k) - 1) * NUMAXES + (a) : CMD_VEL(a))
+#define BAT_WORDS		(CMD_WORDS + (PICNC_BATCH - 1) * NUMAXES)
+
+#define BATCH(n, seq, ticks)	(((n) << 24) | SEGMENT(seq, ticks))
+#define BATCH_SAMPLES(x)	(((x) >> 24) & 0xFF)
+
+static inline uint32_t picnc_batch_ticks(uint32_t ticks, int n, int k)
+{
+	return ticks * (k + 1) / n - ticks * k / n;
+}
+
+/* >PVT: target positions, period, target velocities between the
+   segment word and the CRC
+
+   A >POS that also carries the velocity at each target, in DDS units
+   per tick, and the servo period in ticks in bits 15-0 of the segment
+   word. From the frame on, the board follows a cubic curve that
+   reaches the target at that velocity one period later, see
+   stepgen.c. The period must be at least 2 ticks. */
+#define PVT_VEL(a)		(CMD_SEGMENT + 1 + (a))
+#define PVT_WORDS		(CMD_WORDS + NUMAXES)
+
+/* >CFG: step width, pwm period, queue depth, base frequency, probe
+   edges, ADC averaging, compact feedback
+
+   Playback of queued segments starts once the queue holds the given
+   number of segments. The base frequency is the stepgen ISR rate in
+   Hz, 0 for the default. The board sets the core timer to the nearest
+   rate it can, within PICNC_BASEFREQ_MIN and PICNC_BASEFREQ_MAX, and
+   reports it in the next >VER reply. The probe word selects the
+   inputs whose rising (bits 12-0) or falling (bits 28-16) edge
+   latches the axis positions, see FB_PROBE. The ADC word is the
+   number of samples per channel averaged into each reading, rounded
+   down to a power of 2 up to PICNC_ADC_AVERAGE_MAX, 0 for the
+   default. With the compact word set the board prepares its replies
+   in the >STC layout. */
+#define CFG_STEPWIDTH		1
+#define CFG_PWM_PERIOD		2
+#define CFG_QUEUE_DEPTH		3
+#define CFG_BASEFREQ		4
+#define CFG_PROBE		5
+#define CFG_ADC_AVERAGE		6
+#define CFG_COMPACT		7
+#define CFG_WORDS		9
+
+#define PICNC_ADC_AVERAGE_MAX	32
+
+#define PROBE_EDGES(rise, fall)	((((fall) & 0x1FFF) << 16) | ((rise) & 0x1FFF))
+#define PROBE_RISE(x)		((x) & 0x1FFF)
+#define PROBE_FALL(x)		(((x) >> 16) & 0x1FFF)
+
+#define PICNC_BASEFREQ_MIN	40000
+#define PICNC_BASEFREQ_MAX	200000
+
+/* >LIM: limits for >POS
+
+   The servo period in ISR ticks, and per axis the largest velocity
+   change in DDS units per tick allowed in one ramp step. */
+#define LIM_PERIOD		1
+#define LIM_ACCEL(a)		(2 + (a))
+#define LIM_WORDS		(3 + NUMAXES)
+
+/* >VER: reply to the previous >VER
+
+   VER_OC has a bit set for each axis whose step pulses come from an
+   output compare module rather than the ISR, see stepgen.c. These
+   axes are not held to a step pulse every other tick, and may run at
+   up to PICNC_OC_MAX_VEL counts (1 << STEPBIT of DDS travel) per
+   second.
+
+   VER_TICK is the ISR period in core timer counts (SYS_FREQ / 2), as
+   set up by the last >CFG. VER_ENCODERS is the number of encoder
+   counts in the feedback. The reply is sealed past all of these, at
+   VER_REPLY_WORDS. */
+#define VER_VERSION		1
+#define VER_CAPS		2
+#define VER_AXES		3
+#define VER_BATCH		4
+#define VER_OC			5
+#define VER_TICK		6
+#define VER_ENCODERS		7
+#define VER_WORDS		9
+#define VER_REPLY_WORDS		(VER_WORDS > FB_WORDS ? VER_WORDS : FB_WORDS)
+
+#define PICNC_OC_MAX_VEL	100000
+
+/* >STA: status poll, the reply carries the feedback
+
+   The queue word holds the remaining ticks of the segment being played
+   in bits 31-16, its sequence number in bits 15-8 and the number of
+   segments waiting behind it in bits 7-0. It is sampled together with
+   the positions.
+
+   The health word carries one firmware health item per >STA, in turn:
+   the item number in bits 31-24 and its value in bits 23-0. The
+   counters wrap at 24 bits.
+
+   The ADC words carry the averaged readings of ADC 0 and 1 in bits
+   31-16 and 15-0 of FB_ADC(0), and of ADC 2 in bits 31-16 of
+   FB_ADC(1). They are 16 bit fractions of full scale, the 10 bit
+   samples plus what averaging adds.
+
+   The encoder words are the 32 bit quadrature counts, which wrap.
+
+   The probe words describe the last latch: the latch number in bits
+   31-24 and the inputs at the latch in bits 12-0 of FB_PROBE, the
+   core timer count and the DDS position of each axis at the end of
+   the ISR tick that saw the edge. The board keeps the first edge
+   after each reply and repeats the last latch until the next one, so
+   the host takes a new latch number as a new edge. */
+#define FB_POS(a)		(1 + (a))
+#define FB_INPUTS		(1 + NUMAXES)
+#define FB_ADC(a)		(2 + NUMAXES + (a))
+#define FB_QUEUE		(4 + NUMAXES)
+#define FB_HEALTH		(5 + NUMAXES)
+#define FB_ENC(a)		(6 + NUMAXES + (a))
+#define FB_PROBE		(6 + NUMAXES + PICNC_ENCODERS)
+#define FB_PROBE_TIME		(7 + NUMAXES + PICNC_ENCODERS)
+#define FB_PROBE_POS(a)		(8 + NUMAXES + PICNC_ENCODERS + (a))
+#define FB_CRC			(8 + 2 * NUMAXES + PICNC_ENCODERS)
+#define FB_WORDS		(9 + 2 * NUMAXES + PICNC_ENCODERS)
+
+/* >STC: status poll, the reply carries the feedback in 16 bit halves
+
+   The same feedback as the >STA reply, with the positions, encoder
+   counts and latched positions cut to 16 bits and packed two to a
+   word, the even numbered one in bits 15-0. A position is bits 31-16
+   of the DDS position, so it wraps every 512 steps as the full one
+   does, and the host follows it by its differences in the same way.
+   An encoder count wraps at 16 bits. */
+#define FBC_PAIRS(n)		(((n) + 1) / 2)
+#define FBC_P			FBC_PAIRS(NUMAXES)
+#define FBC_E			FBC_PAIRS(PICNC_ENCODERS)
+
+#define FBC_POS(a)		(1 + (a) / 2)
+#define FBC_INPUTS		(1 + FBC_P)
+#define FBC_ADC(a)		(2 + FBC_P + (a))
+#define FBC_QUEUE		(4 + FBC_P)
+#define FBC_HEALTH		(5 + FBC_P)
+#define FBC_ENC(a)		(6 + FBC_P + (a) / 2)
+#define FBC_PROBE		(6 + FBC_P + FBC_E)
+#define FBC_PROBE_TIME		(7 + FBC_P + FBC_E)
+#define FBC_PROBE_POS(a)	(8 + FBC_P + FBC_E + (a) / 2)
+#define FBC_CRC			(8 + 2 * FBC_P + FBC_E)
+#define FBC_WORDS		(9 + 2 * FBC_P + FBC_E)
+
+#define FBC_POS_SHIFT		16
+#define FBC_HALF(x, a)		(((x) >> (((a) & 1) * 16)) & 0xFFFF)
+#define FBC_PACK(lo, hi)	((((hi) & 0xFFFF) << 16) | ((lo) & 0xFFFF))
+
+#define QUEUE_STATUS(rem, seq, lvl)					\
+	(((rem) << 16) | (((seq) & 0xFF) << 8) | ((lvl) & 0xFF))
+#define QUEUE_REMAINING(x)	(((x) >> 16) & 0xFFFF)
+#define QUEUE_SEQ(x)		(((x) >> 8) & 0xFF)
+#define QUEUE_LEVEL(x)		((x) & 0xFF)
+
+#define PROBE(seq, in)		((((seq) & 0xFF) << 24) | ((in) & 0x1FFF))
+#define PROBE_SEQ(x)		(((x) >> 24) & 0xFF)
+#define PROBE_INPUTS(x)		((x) & 0x1FFF)
+
+#define HEALTH(item, val)	(((item) << 24) | ((val) & 0xFFFFFF))
+#define HEALTH_ITEM(x)		(((x) >> 24) & 0xFF)
+#define HEALTH_VALUE(x)		((x) & 0xFFFFFF)
+#define HEALTH_MASK		0xFFFFFF
+
+#define HEALTH_ISR_LAST		0	/* core timer counts, 2 SYSCLK */
+#define HEALTH_ISR_MAX		1	/* since power up */
+#define HEALTH_MISSED		2	/* core timer ticks skipped */
+#define HEALTH_FRAMES		3	/* frames received */
+#define HEALTH_UNKNOWN		4	/* frames with an unknown command */
+#define HEALTH_TIMEOUTS		5	/* SPI timeouts, board reset */
+#define HEALTH_UNDERRUNS	6	/* segment queue ran dry */
+#define HEALTH_CRC		7	/* frames dropped for a bad CRC */
+#define HEALTH_ENC_ERRORS	8	/* encoder moved 2 counts in a tick */
+#define HEALTH_ITEMS		9
+
+#define RST_WORDS		2
+
+#define FRAME_MAX_WORDS		(BAT_WORDS > FB_WORDS ? BAT_WORDS : FB_WORDS)
+
+#define SPIBUFSIZE		(FRAME_MAX_WORDS*4)	/* SPI buffer size */
+#define BUFSIZE			(SPIBUFSIZE/4)
+
+/* the PIC32 DMA cell is at most 256 bytes */
+#define SPI_FRAME_MAX		256
+
+PICNC_STATIC_ASSERT(SPIBUFSIZE <= SPI_FRAME_MAX, frame_fits_dma_cell);
+PICNC_STATIC_ASSERT(CMD_WORDS <= FRAME_MAX_WORDS, cmd_fits_frame);
+PICNC_STATIC_ASSERT(BAT_WORDS <= FRAME_MAX_WORDS, bat_fits_frame);
+PICNC_STATIC_ASSERT(PVT_WORDS <= FRAME_MAX_WORDS, pvt_fits_frame);
+PICNC_STATIC_ASSERT(FB_WORDS <= FRAME_MAX_WORDS, fb_fits_frame);
+PICNC_STATIC_ASSERT(OUT_WORDS <= FRAME_MAX_WORDS, out_fits_frame);
+PICNC_STATIC_ASSERT(CFG_WORDS <= FRAME_MAX_WORDS, cfg_fits_frame);
+PICNC_STATIC_ASSERT(VER_WORDS <= FRAME_MAX_WORDS, ver_fits_frame);
+PICNC_STATIC_ASSERT(LIM_WORDS <= FRAME_MAX_WORDS, lim_fits_frame);
+PICNC_STATIC_ASSERT(NUMAXES <= PICNC_RAMP_TICKS, ramp_slots);
+PICNC_STATIC_ASSERT(PICNC_BATCH <= PICNC_QUEUE_MAX, batch_fits_queue);
+
+/* number of words in a frame starting with cmd, >TST and unknown
+   commands use the full frame */
+static inline int picnc_frame_words(uint32_t cmd)
+{
+	switch (cmd) {
+	case PICNC_CMD:
+	case PICNC_POS:
+		return CMD_WORDS;
+	case PICNC_BAT:
+		return BAT_WORDS;
+	case PICNC_PVT:
+		return PVT_WORDS;
+	case PICNC_LIM:
+		return LIM_WORDS;
+	case PICNC_STA:
+		return FB_WORDS;
+	case PICNC_STC:
+		return FBC_WORDS;
+	case PICNC_OUT:
+		return OUT_WORDS;
+	case PICNC_CFG:
+		return CFG_WORDS;
+	case PICNC_VER:
+		return VER_WORDS;
+	case PICNC_RST:
+		return RST_WORDS;
+	default:
+		return FRAME_MAX_WORDS;
+	}
+}
+
+#endif
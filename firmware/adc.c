@@ -0,0 +1,75 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <p32xxxx.h>
+#include <plib.h>
+
+#include "hardware.h"
+#include "adc.h"
+
+/*
+  Averaged ADC readings.
+
+  The ADC scans AN0, AN1 and AN2 on its own, and DMA 3 stores each
+  result in turn into adc_ring (see init_adc() in main.c), so sampling
+  takes no CPU time. The ring holds a whole number of scans, so entry
+  i is always channel i % ADC_CHANNELS.
+
+  A reading is the sum of the latest samples of a channel, counted
+  back from the DMA pointer. A sample the DMA stores while they are
+  summed only replaces an older one of the same channel.
+*/
+
+volatile uint16_t adc_ring[ADC_RING];
+
+static uint32_t adc_shift = 0;			/* log2 samples averaged */
+
+void adc_update_average(uint32_t n)
+{
+	uint32_t k = 0;
+
+	if (!n)
+		n = ADC_AVERAGE;
+	else if (n > PICNC_ADC_AVERAGE_MAX)
+		n = PICNC_ADC_AVERAGE_MAX;
+
+	while ((2u << k) <= n)
+		k++;
+	adc_shift = k;
+}
+
+/* FB_ADC(0) onwards, 10 bit samples summed to 16 bits */
+void adc_get_readings(volatile uint32_t *buf)
+{
+	uint32_t sum[ADC_CHANNELS] = { 0 }, i, c, k, n;
+
+	i = (DCH3DPTR / 2) % ADC_RING;
+	c = i % ADC_CHANNELS;
+	n = ADC_CHANNELS << adc_shift;
+
+	for (k = 0; k < n; k++) {
+		i = i ? i - 1 : ADC_RING - 1;
+		c = c ? c - 1 : ADC_CHANNELS - 1;
+		sum[c] += adc_ring[i];
+	}
+
+	for (c = 0; c < ADC_CHANNELS; c++)
+		sum[c] = (sum[c] << (6 - adc_shift)) & 0xFFFF;
+
+	buf[0] = sum[0] << 16 | sum[1];
+	buf[1] = sum[2] << 16;
+}
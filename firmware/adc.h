@@ -0,0 +1,35 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __ADC_H__
+#define __ADC_H__
+
+#include "picnc_proto.h"
+#include "hardware.h"
+
+/* the DMA destination, a whole number of scans of all channels */
+#define ADC_RING		(ADC_CHANNELS * PICNC_ADC_AVERAGE_MAX)
+
+/* DMA cells and blocks are at most 256 bytes */
+PICNC_STATIC_ASSERT(sizeof(uint16_t) * ADC_RING <= 256, adc_ring_fits_dma);
+
+extern volatile uint16_t adc_ring[ADC_RING];
+
+void adc_update_average(uint32_t n);
+void adc_get_readings(volatile uint32_t *buf);
+
+#endif				/* __ADC_H__ */
@@ -0,0 +1,291 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <p32xxxx.h>
+#include <plib.h>
+
+#include "hardware.h"
+#include "stepgen.h"
+#include "encoder.h"
+#include "probe.h"
+#include "adc.h"
+#include "command.h"
+
+/*
+  SPI command handling, kept apart from main.c so that it only touches
+  the port and output compare registers. This lets the host simulator
+  (see sim/) build it together with stepgen.c.
+*/
+
+volatile uint32_t health[HEALTH_ITEMS];
+static int health_item = 0;			/* sent with the next >STA */
+
+volatile uint32_t tick_rate = CORE_TICK_RATE;
+
+static int compact = 0;				/* >STC replies, >CFG */
+
+/* with a step output by output compare the PWM counts a quarter of
+   the clock, or is gone, see hardware.h */
+static inline void update_pwm_period(uint32_t val)
+{
+#if STEPGEN_OC == 1
+	PR2 = ((val + 1) >> 2) - 1;
+#elif STEPGEN_OC == 0
+	PR2 = val;
+#else
+	(void)val;
+#endif
+}
+
+static inline void update_pwm_duty(uint32_t val1, uint32_t val2)
+{
+#if STEPGEN_OC == 1
+	OC1RS = val1 >> 18;
+	OC2RS = (val1 & 0xFFFF) >> 2;
+	OC3RS = val2 >> 18;
+#elif STEPGEN_OC == 0
+	OC1RS = val1 >> 16;
+	OC2RS = val1 & 0xFFFF;
+	OC3RS = val2 >> 16;
+#else
+	(void)val1;
+	(void)val2;
+#endif
+}
+
+/* the ISR picks the new rate up at its next compare; the count is
+   kept even, so that the output compare timers, at half the core
+   timer rate, count a whole number per tick */
+static void update_basefreq(uint32_t freq)
+{
+	if (!freq)
+		freq = BASEFREQ;
+	else if (freq < PICNC_BASEFREQ_MIN)
+		freq = PICNC_BASEFREQ_MIN;
+	else if (freq > PICNC_BASEFREQ_MAX)
+		freq = PICNC_BASEFREQ_MAX;
+
+	tick_rate = (CORE_TIMER_FREQ / freq + 1) & ~1;
+	stepgen_update_tick_rate(tick_rate);
+}
+
+static inline uint32_t read_inputs()
+{
+	return (PORTB >> 3);
+}
+
+static inline void update_outputs(uint32_t val)
+{
+	LATDCLR =  PORTD_OUT_MASK & ~(val << 3);
+	LATDSET =  PORTD_OUT_MASK &  (val << 3);
+	val = val >> 9;
+	if (val && 0b100)
+		val = 0b1000 | (val && 0b11);
+	else
+		val = val && 0b11;
+	LATFCLR =  PORTF_OUT_MASK & ~(val);
+	LATFSET =  PORTF_OUT_MASK &  (val);
+}
+
+void reset_board()
+{
+	stepgen_reset();
+	update_outputs(0);
+	update_pwm_duty(0,0);
+}
+
+static inline int reply_words(void)
+{
+	return compact ? FBC_WORDS : FB_WORDS;
+}
+
+/* the feedback into the >STC layout, in place: each word only takes
+   from words at or after it */
+static void pack_reply(volatile uint32_t *buf)
+{
+	int i;
+
+	for (i = 0; i < NUMAXES; i += 2)
+		buf[FBC_POS(i)] = FBC_PACK(buf[FB_POS(i)] >> FBC_POS_SHIFT,
+			i + 1 < NUMAXES ?
+			buf[FB_POS(i + 1)] >> FBC_POS_SHIFT : 0);
+
+	buf[FBC_INPUTS] = buf[FB_INPUTS];
+	buf[FBC_ADC(0)] = buf[FB_ADC(0)];
+	buf[FBC_ADC(1)] = buf[FB_ADC(1)];
+	buf[FBC_QUEUE] = buf[FB_QUEUE];
+	buf[FBC_HEALTH] = buf[FB_HEALTH];
+
+	for (i = 0; i < PICNC_ENCODERS; i += 2)
+		buf[FBC_ENC(i)] = FBC_PACK(buf[FB_ENC(i)],
+			i + 1 < PICNC_ENCODERS ? buf[FB_ENC(i + 1)] : 0);
+
+	buf[FBC_PROBE] = buf[FB_PROBE];
+	buf[FBC_PROBE_TIME] = buf[FB_PROBE_TIME];
+
+	for (i = 0; i < NUMAXES; i += 2)
+		buf[FBC_PROBE_POS(i)] = FBC_PACK(
+			buf[FB_PROBE_POS(i)] >> FBC_POS_SHIFT,
+			i + 1 < NUMAXES ?
+			buf[FB_PROBE_POS(i + 1)] >> FBC_POS_SHIFT : 0);
+}
+
+/* called while the host holds DATA REQUEST low */
+void command_prepare_reply(volatile uint32_t *txbuf)
+{
+	uint32_t queue_status;
+
+	stepgen_get_position((void *)&txbuf[FB_POS(0)], &queue_status);
+	txbuf[FB_QUEUE] = queue_status;
+
+	/* read inputs */
+	txbuf[FB_INPUTS] = read_inputs();
+	adc_get_readings(&txbuf[FB_ADC(0)]);
+
+	encoder_get_counts((void *)&txbuf[FB_ENC(0)]);
+	probe_get_latch(&txbuf[FB_PROBE]);
+
+	health[HEALTH_UNDERRUNS] = stepgen_underruns();
+	health[HEALTH_ENC_ERRORS] = encoder_errors();
+	txbuf[FB_HEALTH] = HEALTH(health_item, health[health_item]);
+
+	if (compact)
+		pack_reply(txbuf);
+	picnc_crc_seal((void *)txbuf, reply_words());
+}
+
+/* called as soon as a complete frame has been received, crc is what
+   is left of the CRC over the whole frame, 0 if it came in intact.
+   Everything that goes back with the next frame is written here, so
+   that txbuf can be handed to the SPI before the command is carried
+   out; returns 0 if the frame has to be dropped */
+int command_frame_done(volatile uint32_t *rxbuf, volatile uint32_t *txbuf,
+	uint32_t crc)
+{
+	int i;
+
+	/* data integrity check */
+	txbuf[0] = rxbuf[0] ^ ~0;
+
+	health[HEALTH_FRAMES]++;
+
+	/* the reply to this poll carried the item, move on to the next */
+	if ((rxbuf[0] == PICNC_STA) || (rxbuf[0] == PICNC_STC))
+		health_item = (health_item + 1) % HEALTH_ITEMS;
+
+	if (crc) {
+		health[HEALTH_CRC]++;
+		picnc_crc_seal((void *)txbuf, reply_words());
+		return 0;
+	}
+
+	switch (rxbuf[0]) {
+	case PICNC_TST:
+		for (i=0; i<BUFSIZE; i++)
+			txbuf[i] = rxbuf[i] ^ ~0;
+		picnc_crc_seal((void *)txbuf, FB_WORDS);
+		break;
+	case PICNC_VER:
+		txbuf[VER_VERSION] = PICNC_PROTO_VERSION;
+		txbuf[VER_CAPS] = PICNC_CAP_QUEUE | PICNC_CAP_POSITION |
+			PICNC_CAP_BATCH | PICNC_CAP_PVT | PICNC_CAP_PROBE |
+			PICNC_CAP_ADC;
+		txbuf[VER_AXES] = NUMAXES;
+		txbuf[VER_BATCH] = PICNC_BATCH;
+		txbuf[VER_OC] = (1 << STEPGEN_OC) - 1;
+		txbuf[VER_TICK] = tick_rate;
+		txbuf[VER_ENCODERS] = PICNC_ENCODERS;
+		picnc_crc_seal((void *)txbuf, VER_REPLY_WORDS);
+		break;
+	default:
+		picnc_crc_seal((void *)txbuf, reply_words());
+		break;
+	}
+
+	return 1;
+}
+
+/* the samples of a >BAT go into the queue one after the other */
+static void queue_batch(volatile uint32_t *rxbuf)
+{
+	uint32_t seg = rxbuf[CMD_SEGMENT], ticks;
+	int k, n = BATCH_SAMPLES(seg);
+
+	if (n > PICNC_BATCH)
+		n = PICNC_BATCH;
+
+	for (k = 0; k < n; k++) {
+		ticks = picnc_batch_ticks(SEGMENT_TICKS(seg), n, k);
+		stepgen_queue_segment((const void *)&rxbuf[BAT_VEL(k, 0)],
+			SEGMENT(SEGMENT_SEQ(seg) + k, ticks ? ticks : 1));
+	}
+}
+
+/* the replies are already written, see command_frame_done() */
+void command_process(volatile uint32_t *rxbuf)
+{
+	/* the first byte received is a command byte */
+	switch (rxbuf[0]) {
+	case PICNC_RST:
+		reset_board();
+		break;
+	case PICNC_CMD:
+		if (SEGMENT_TICKS(rxbuf[CMD_SEGMENT]))
+			stepgen_queue_segment((const void *)&rxbuf[CMD_VEL(0)],
+				rxbuf[CMD_SEGMENT]);
+		else
+			stepgen_update_input((const void *)&rxbuf[CMD_VEL(0)]);
+		break;
+	case PICNC_BAT:
+		queue_batch(rxbuf);
+		break;
+	case PICNC_POS:
+		stepgen_update_target((const void *)&rxbuf[CMD_POS(0)]);
+		break;
+	case PICNC_PVT:
+		stepgen_update_curve((const void *)&rxbuf[CMD_POS(0)],
+			(const void *)&rxbuf[PVT_VEL(0)],
+			SEGMENT_TICKS(rxbuf[CMD_SEGMENT]));
+		break;
+	case PICNC_OUT:
+		update_outputs(rxbuf[OUT_OUTPUTS]);
+		update_pwm_duty(rxbuf[OUT_PWM(0)],rxbuf[OUT_PWM(1)]);
+		break;
+	case PICNC_LIM:
+		stepgen_update_limits(rxbuf[LIM_PERIOD],
+			(const void *)&rxbuf[LIM_ACCEL(0)]);
+		break;
+	case PICNC_CFG:
+		stepgen_update_stepwidth(rxbuf[CFG_STEPWIDTH]);
+		update_pwm_period(rxbuf[CFG_PWM_PERIOD]);
+		stepgen_queue_depth(rxbuf[CFG_QUEUE_DEPTH]);
+		update_basefreq(rxbuf[CFG_BASEFREQ]);
+		probe_update_edges(rxbuf[CFG_PROBE]);
+		adc_update_average(rxbuf[CFG_ADC_AVERAGE]);
+		compact = rxbuf[CFG_COMPACT] != 0;
+		stepgen_reset();
+		break;
+	case PICNC_TST:
+	case PICNC_VER:
+	case PICNC_STA:
+	case PICNC_STC:
+		break;
+	default:
+		health[HEALTH_UNKNOWN]++;
+		break;
+	}
+}
@@ -0,0 +1,35 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __COMMAND_H__
+#define __COMMAND_H__
+
+#include "picnc_proto.h"
+
+/* firmware health counters, indexed by HEALTH_* (picnc_proto.h) */
+extern volatile uint32_t health[HEALTH_ITEMS];
+
+/* core timer counts per ISR tick, set by >CFG */
+extern volatile uint32_t tick_rate;
+
+void reset_board(void);
+void command_prepare_reply(volatile uint32_t *txbuf);
+int command_frame_done(volatile uint32_t *rxbuf, volatile uint32_t *txbuf,
+	uint32_t crc);
+void command_process(volatile uint32_t *rxbuf);
+
+#endif				/* __COMMAND_H__ */
@@ -0,0 +1,103 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <p32xxxx.h>
+#include <plib.h>
+
+#include "hardware.h"
+#include "encoder.h"
+
+/*
+  Quadrature decoding, once per ISR tick.
+
+  The A and B inputs of each encoder are sampled together, and the
+  step from the last state to the new one is looked up: forward runs
+  AB 00, 10, 11, 01. When both inputs changed in one tick the encoder
+  moved two counts and the direction is lost; that is counted as an
+  error, not as a count. Up to one count per tick is followed, 160k
+  counts/s at 160 kHz, a 40k line encoder decoded 4x.
+
+  The counts are 32 bits and wrap, the host works with differences.
+  They are not cleared by a board reset.
+*/
+
+#if PICNC_ENCODERS > 0
+#define QUAD_ERR	2
+
+/* indexed by old state << 2 | new state, state = B << 1 | A */
+static const int8_t quad[16] = {
+	0, 1, -1, QUAD_ERR,
+	-1, 0, QUAD_ERR, 1,
+	1, QUAD_ERR, 0, -1,
+	QUAD_ERR, -1, 1, 0
+};
+
+static volatile int32_t count[PICNC_ENCODERS];
+static uint32_t state[PICNC_ENCODERS];
+#endif
+static volatile uint32_t errors = 0;
+
+/* sample the inputs as they are, so that the first tick counts
+   nothing */
+void encoder_init(void)
+{
+#if PICNC_ENCODERS > 0
+	uint32_t in = PORTB;
+	int i;
+
+	for (i = 0; i < PICNC_ENCODERS; i++)
+		state[i] = (in >> ENCODER_SHIFT(i)) & 3;
+#endif
+}
+
+/* called from the ISR */
+void encoder(void)
+{
+#if PICNC_ENCODERS > 0
+	uint32_t in = PORTB, s;
+	int i, d;
+
+	for (i = 0; i < PICNC_ENCODERS; i++) {
+		s = (in >> ENCODER_SHIFT(i)) & 3;
+		d = quad[(state[i] << 2) | s];
+		state[i] = s;
+		if (d == QUAD_ERR)
+			errors++;
+		else
+			count[i] += d;
+	}
+#endif
+}
+
+/* 32 bit reads, no need to hold off the ISR */
+void encoder_get_counts(void *buf)
+{
+#if PICNC_ENCODERS > 0
+	int32_t *p = buf;
+	int i;
+
+	for (i = 0; i < PICNC_ENCODERS; i++)
+		p[i] = count[i];
+#else
+	(void)buf;
+#endif
+}
+
+uint32_t encoder_errors(void)
+{
+	return errors;
+}
@@ -18,13 +18,24 @@
 #ifndef __HARDWARE_H__
 #define __HARDWARE_H__
 
+#include "picnc_config.h"
+
 #define SYS_FREQ		(80000000ul)    /* 80 MHz */
+#define BASEFREQ		160000		/* stepgen ISR default, Hz */
+#define CORE_TIMER_FREQ		(SYS_FREQ/2)
+#define CORE_TICK_RATE		(CORE_TIMER_FREQ/BASEFREQ)
 #define GetSystemClock()	(SYS_FREQ)
 #define	GetPeripheralClock()	(GetSystemClock())
 #define	GetInstructionClock()	(GetSystemClock())
 
 #define SPICHAN			2
 
+/* with SPI_SS set to 1 at build time SPI2 only drives MISO while SS2
+   is low, so that two boards can share the bus on CE0 and CE1 */
+#ifndef SPI_SS
+#define SPI_SS			0
+#endif
+
 /*    PORT USAGE
  *
  *	Port	Dir	Signal
@@ -37,6 +48,8 @@
  *	RE5	OUT	STEP_Z
  *	RE6	OUT	DIR_A
  *	RE7	OUT	STEP_A
+ *	RF4	OUT	DIR_B		NUMAXES > 4
+ *	RF5	OUT	STEP_B		NUMAXES > 4
  *	RG8	OUT	MISO
  *	RC13	OUT	Status LED
  *	RC14	OUT	DATA READY
@@ -58,10 +71,15 @@
  *	RF1	OUT	OUTPUT 10
  *	RF3	OUT	OUTPUT 11
  *
+ *	Step generators past the fifth take over OUTPUT 8 down to
+ *	OUTPUT 1, see the step/dir pin table below. Step outputs by
+ *	output compare take over OUTPUT 0 and 1.
+ *
  *	RG2	IN	DATA REQUEST
  *	RG3	IN	AUX
  *	RG6	IN	SCLK
  *	RG7	IN	MOSI
+ *	RG9	IN	SS		SPI_SS
  *
  *	RB0	IN	ADC 0
  *	RB1	IN	ADC 1
@@ -83,32 +101,133 @@
  *
  */
 
+/* quadrature encoder inputs
+
+	encoder	A	B
+	0	RB3	RB4	INPUT 0, 1
+	1	RB5	RB6	INPUT 2, 3
+	2	RB7	RB8	INPUT 4, 5
+	3	RB9	RB10	INPUT 6, 7
+
+   PICNC_ENCODERS of them, see encoder.c. The pins still read as
+   inputs as well.
+*/
+#define ENCODER_SHIFT(i)	(3 + 2 * (i))	/* bit of A in PORTB */
+
+/* ADC 0-2 (AN0-AN2) are scanned in turn and stored by DMA, see adc.c;
+   a conversion takes SAMC + 12 TAD, TAD = 2 * (ADCS + 1) TPB, 17.2 us */
+#define ADC_CHANNELS		3
+#define ADC_ADCS		15
+#define ADC_SAMC		31
+#define ADC_CONV_COUNTS		((ADC_SAMC + 12) * (ADC_ADCS + 1))
+#define ADC_AVERAGE		16		/* default, samples */
+
 #define LED_TOGGLE		(LATCINV = BIT_13)
 #define REQ_IN			(PORTGbits.RG2)
 #define RDY_LO			(LATCCLR = BIT_14)
 #define RDY_HI			(LATCSET = BIT_14)
 
-#define PORTD_OUT_MASK		(0xFF8)
-#define PORTF_OUT_MASK		(BIT_0  | BIT_1  | BIT_3)
+/* step and dir outputs
+
+	axis	step	dir
+	0 X	RE1	RE0
+	1 Y	RE3	RE2
+	2 Z	RE5	RE4
+	3 A	RE7	RE6
+	4 B	RF5	RF4
+	5 C	RD11	RD10	OUTPUT 8, 7
+	6 U	RD9	RD8	OUTPUT 6, 5
+	7 V	RD7	RD6	OUTPUT 4, 3
+	8 W	RD5	RD4	OUTPUT 2, 1
+
+   Outputs sharing a pin with a step generator are ignored.
+*/
+#define STEPGEN_PORT_E		0
+#define STEPGEN_PORT_F		1
+#define STEPGEN_PORT_D		2
+
+#define STEPGEN_SET_E(m)	(LATESET = (m))
+#define STEPGEN_CLR_E(m)	(LATECLR = (m))
+#define STEPGEN_SET_F(m)	(LATFSET = (m))
+#define STEPGEN_CLR_F(m)	(LATFCLR = (m))
+#define STEPGEN_SET_D(m)	(LATDSET = (m))
+#define STEPGEN_CLR_D(m)	(LATDCLR = (m))
+
+/* port, step bit, dir bit; one entry for each of MAXAXES */
+#define STEPGEN_PIN_TABLE						\
+	{ STEPGEN_PORT_E, BIT_1,  BIT_0  },	/* X */			\
+	{ STEPGEN_PORT_E, BIT_3,  BIT_2  },	/* Y */			\
+	{ STEPGEN_PORT_E, BIT_5,  BIT_4  },	/* Z */			\
+	{ STEPGEN_PORT_E, BIT_7,  BIT_6  },	/* A */			\
+	{ STEPGEN_PORT_F, BIT_5,  BIT_4  },	/* B */			\
+	{ STEPGEN_PORT_D, BIT_11, BIT_10 },	/* C */			\
+	{ STEPGEN_PORT_D, BIT_9,  BIT_8  },	/* U */			\
+	{ STEPGEN_PORT_D, BIT_7,  BIT_6  },	/* V */			\
+	{ STEPGEN_PORT_D, BIT_5,  BIT_4  },	/* W */
 
-#define STEP_X_LO		(LATECLR = BIT_1)
-#define STEP_X_HI		(LATESET = BIT_1)
-#define DIR_X_LO		(LATECLR = BIT_0)
-#define DIR_X_HI		(LATESET = BIT_0)
-
-#define STEP_Y_LO		(LATECLR = BIT_3)
-#define STEP_Y_HI		(LATESET = BIT_3)
-#define DIR_Y_LO		(LATECLR = BIT_2)
-#define DIR_Y_HI		(LATESET = BIT_2)
-
-#define STEP_Z_LO		(LATECLR = BIT_5)
-#define STEP_Z_HI		(LATESET = BIT_5)
-#define DIR_Z_LO		(LATECLR = BIT_4)
-#define DIR_Z_HI		(LATESET = BIT_4)
-
-#define STEP_A_LO		(LATECLR = BIT_7)
-#define STEP_A_HI		(LATESET = BIT_7)
-#define DIR_A_LO		(LATECLR = BIT_6)
-#define DIR_A_HI		(LATESET = BIT_6)
+#if NUMAXES > 5
+#define STEPGEN_NPORTS		3
+#elif NUMAXES > 4
+#define STEPGEN_NPORTS		2
+#else
+#define STEPGEN_NPORTS		1
+#endif
+
+/* PORTD pins taken over by step generators */
+#if NUMAXES > 8
+#define STEPGEN_PORTD_PINS	(0xFF0)
+#elif NUMAXES > 7
+#define STEPGEN_PORTD_PINS	(0xFC0)
+#elif NUMAXES > 6
+#define STEPGEN_PORTD_PINS	(0xF00)
+#elif NUMAXES > 5
+#define STEPGEN_PORTD_PINS	(0xC00)
+#else
+#define STEPGEN_PORTD_PINS	(0)
+#endif
+
+/* step outputs by output compare
+
+	axis	step		time base
+	0 X	RD3  OC4	Timer3		OUTPUT 0
+	1 Y	RD4  OC5	Timer2		OUTPUT 1
+
+   With STEPGEN_OC set to 1 or 2 at build time, the step pulses of X,
+   or of X and Y, come from an output compare module in continuous
+   pulse mode, see stepgen.c; the dir outputs stay in the table above.
+   OC1-OC5 can only count Timer2 or Timer3, and Timer2 also runs the
+   PWM: with one such axis the PWM moves to Timer2 alone, 16 bits at a
+   quarter of the clock, with two there is no PWM.
+*/
+#ifndef STEPGEN_OC
+#define STEPGEN_OC		0
+#endif
+
+#define STEPGEN_OC_CLOCK	(SYS_FREQ/4)	/* Timer2/3, 1:4 prescale */
+#define STEPGEN_OC_CORE		2		/* core timer counts per
+						   timer count */
+
+/* timer, period, compare registers and mode of each */
+#define STEPGEN_OC_TABLE						\
+	{ &TMR3, &PR3, &OC4CON, &OC4R, &OC4RS, 0x800D },	/* X */	\
+	{ &TMR2, &PR2, &OC5CON, &OC5R, &OC5RS, 0x8005 },	/* Y */
+
+/* step pin of output compare axis i, on port D */
+#define STEPGEN_OC_STEP(i)	(BIT_3 << (i))
+
+#if STEPGEN_OC > 1
+#define STEPGEN_OC_PINS		(BIT_3 | BIT_4)
+#elif STEPGEN_OC > 0
+#define STEPGEN_OC_PINS		(BIT_3)
+#else
+#define STEPGEN_OC_PINS		(0)
+#endif
+
+PICNC_STATIC_ASSERT(STEPGEN_OC >= 0 && STEPGEN_OC <= 2, oc_axes_in_range);
+PICNC_STATIC_ASSERT(STEPGEN_OC <= NUMAXES, oc_axes_exist);
+PICNC_STATIC_ASSERT(!(STEPGEN_PORTD_PINS & STEPGEN_OC_PINS), oc_pins_free);
+
+#define PORTD_OUT_MASK		(0xFF8 & ~STEPGEN_PORTD_PINS & ~STEPGEN_OC_PINS)
+#define PORTF_OUT_MASK		(BIT_0  | BIT_1  | BIT_3)
 
 #endif /* __HARDWARE_H__ */
\ No newline at end of file
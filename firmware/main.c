@@ -20,6 +20,10 @@
 #include <plib.h>
 #include "hardware.h"
 #include "stepgen.h"
+#include "command.h"
+#include "encoder.h"
+#include "probe.h"
+#include "adc.h"
 
 #pragma config POSCMOD = XT		/* Primary Oscillator XT mode */
 #pragma config FNOSC = PRIPLL		/* Primary Osc w/PLL */
@@ -35,16 +39,23 @@
 #pragma config FVBUSONIO = OFF		/* VBUSON pin is GPIO */
 #pragma config FUSBIDIO = OFF		/* USBID pin is GPIO */
 
-#define BASEFREQ			160000
-#define CORE_TICK_RATE	        	(SYS_FREQ/2/BASEFREQ)
 #define CORE_DIVIDER			(BASEFREQ/CLOCK_CONF_SECOND)
 
-#define SPIBUFSIZE			32
-#define BUFSIZE				(SPIBUFSIZE/4)
+/* the DMA CRC engine works like the textbook LFSR that shifts the
+   data in ahead of the register, so it needs the augmented form of
+   the 0xFFFF seed; the zero upper half of the CRC word flushes it */
+#define CRC_SEED			0x84CF
 
 #define ENABLE_WATCHDOG
 
-static volatile uint32_t rxBuf[BUFSIZE], txBuf[BUFSIZE];
+/* two rx/tx buffer pairs, the DMA works on one of each while the
+   other rx buffer is carried out or the other tx buffer prepared, see
+   SpiDmaHandler() and refresh_reply() */
+static volatile uint32_t rxBuf[2][BUFSIZE], txBuf[2][BUFSIZE];
+static volatile uint32_t txHead;		/* word 0 of the reply */
+static volatile int rx_cur, tx_cur;		/* the ones on the bus */
+static volatile int rx_body;			/* past the command word */
+static volatile uint32_t frame_seq;		/* frames received */
 static volatile int spi_data_ready;
 
 static void init_io_ports()
@@ -65,6 +76,9 @@ static void init_io_ports()
 	TRISECLR = 0xFF;
 	TRISFCLR = BIT_0 | BIT_1 | BIT_3;
 	TRISGCLR = BIT_8;
+#if NUMAXES > 4
+	TRISFCLR = BIT_4 | BIT_5;
+#endif
 
 	/* enable open drain on step and dir outputs*/
 	ODCESET = BIT_7 | BIT_6 | BIT_5 | BIT_4 | BIT_3 | BIT_2 | BIT_1 | BIT_0;
@@ -73,6 +87,9 @@ static void init_io_ports()
 	ODCDSET = BIT_7 | BIT_6 | BIT_5 | BIT_4 | BIT_3 | BIT_2 | BIT_1 | BIT_0;
 	ODCDSET = BIT_11 | BIT_10 | BIT_9 | BIT_8;
 	ODCFSET = BIT_3 | BIT_1 | BIT_0;
+#if NUMAXES > 4
+	ODCFSET = BIT_5 | BIT_4;
+#endif
 
 	/* data ready, active low */
 	RDY_HI;
@@ -85,28 +102,165 @@ static void init_spi()
 	SPI2CON = 0;		/* stop SPI 2, set Slave mode, 8 bits, std buffer */
 	i = SPI2BUF;		/* clear rcv buffer */
 	SPI2CON = 1<<8 | 0<<6;	/* Clock Edge */
+	/* enhanced buffer: 16 bytes wait in the receive FIFO until DMA 0
+	   is armed again, only one reply byte is queued ahead */
+	SPI2CONSET = 1<<16 | 0b01<<2 | 0b01;
+#if SPI_SS
+	SPI2CONSET = 1<<7;	/* SSEN, chip select on SS2 */
+#endif
 	SPI2CONSET = 1<<15;	/* start SPI 2 */
 }
 
+/* DMA 0 takes the command word of a frame into rxBuf[rx_cur] first,
+   then the rest of it, n words from word k. The receive interrupt
+   stays raised while the FIFO holds bytes, so any that came in before
+   the channel was armed go first */
+static void arm_rx(int k, int n)
+{
+	DmaChnSetTxfer(DMA_CHANNEL0, (void *)&SPI2BUF,
+		(void *)&rxBuf[rx_cur][k], 1, n * 4, 1);
+	DmaChnEnable(0);
+}
+
+/* DMA 1 feeds word 0 of the reply to the SPI, from byte k on */
+static void arm_head(int k)
+{
+	DmaChnSetTxfer(DMA_CHANNEL1, (unsigned char *)&txHead + k,
+		(void *)&SPI2BUF, 4 - k, 1, 1);
+	DmaChnEnable(1);
+}
+
+/* DMA 2 follows it with the rest of txBuf[tx_cur], which has to be
+   complete and sealed by now: chained to DMA 1, or at once if word 0
+   is already out */
+static void arm_body()
+{
+	DmaChnSetTxfer(DMA_CHANNEL2, (unsigned char *)txBuf[tx_cur] + 4,
+		(void *)&SPI2BUF, SPIBUFSIZE - 4, 1, 1);
+	DCH2CONSET = _DCH2CON_CHCHN_MASK;
+	if (!(DCH1CON & _DCH1CON_CHEN_MASK))
+		DmaChnEnable(2);
+}
+
+/* nothing more goes to the SPI until arm_head() */
+static void stop_tx()
+{
+	DCH2CONCLR = _DCH2CON_CHCHN_MASK;
+	DmaChnAbortTxfer(DMA_CHANNEL1);
+	DmaChnAbortTxfer(DMA_CHANNEL2);
+}
+
+/* the next frame starts again at word 0, with both FIFOs empty; the
+   DMA interrupt has to be off */
+static void restart_spi()
+{
+	int i;
+
+	DmaChnAbortTxfer(DMA_CHANNEL0);
+	stop_tx();
+	DCRCDATA = CRC_SEED;
+
+	SPI2CONCLR = 1<<15;
+	i = SPI2BUF;
+	SPI2CONSET = 1<<15;
+
+	rx_body = 0;
+	arm_rx(0, 1);
+	txHead = txBuf[tx_cur][0];
+	arm_head(0);
+	arm_body();
+}
+
 static void init_dma()
 {
 	/* open and configure the DMA channels
-	     DMA 0 is for SPI -> buffer, this is the master channel, auto enabled
-	     DMA 1 is for buffer -> SPI, this channel is chained to DMA 0 */
-	DmaChnOpen(DMA_CHANNEL0, DMA_CHN_PRI3, DMA_OPEN_AUTO);
+	     DMA 0 is for SPI -> buffer, armed for each part of a frame
+	     DMA 1 is for word 0 -> SPI, armed for each frame
+	     DMA 2 is for the rest of the reply -> SPI, chained to DMA 1 */
+	DmaChnOpen(DMA_CHANNEL0, DMA_CHN_PRI3, DMA_OPEN_DEFAULT);
 	DmaChnOpen(DMA_CHANNEL1, DMA_CHN_PRI0, DMA_OPEN_DEFAULT);
+	DmaChnOpen(DMA_CHANNEL2, DMA_CHN_PRI0, DMA_OPEN_DEFAULT);
+	DCH2CONSET = _DCH2CON_CHCHNS_MASK;	/* chain from DMA 1 */
 
 	/* DMA channels trigger on SPI RX, buffer not empty signal */
 	DmaChnSetEventControl(DMA_CHANNEL0, DMA_EV_START_IRQ(_SPI2_RX_IRQ));
 	DmaChnSetEventControl(DMA_CHANNEL1, DMA_EV_START_IRQ(_SPI2_TX_IRQ));
+	DmaChnSetEventControl(DMA_CHANNEL2, DMA_EV_START_IRQ(_SPI2_TX_IRQ));
+
+	/* each part of a frame ends in an interrupt, below the core
+	   timer so that stepgen keeps its tick */
+	DmaChnSetEvEnableFlags(DMA_CHANNEL0, DMA_EV_BLOCK_DONE);
+	DmaChnSetIntPriority(DMA_CHANNEL0, INT_PRIORITY_LEVEL_5,
+		INT_SUB_PRIORITY_LEVEL_0);
+	DmaChnIntEnable(DMA_CHANNEL0);
+
+	/* the CRC engine follows DMA 0 in background mode, each byte
+	   received goes through it on its way to rxBuf */
+	DCRCCON = 0;
+	DCRCXOR = PICNC_CRC_POLY;
+	DCRCDATA = CRC_SEED;
+	DCRCCON = (PICNC_CRC_BITS - 1) << 8 | 1 << 7 | DMA_CHANNEL0;
+
+	/* wait for the first frame */
+	restart_spi();
+}
 
-	/* transfer 8bits at a time */
-	DmaChnSetTxfer(DMA_CHANNEL0, (void *)&SPI2BUF, (void *)rxBuf, 1, SPIBUFSIZE, 1);
-	DmaChnSetTxfer(DMA_CHANNEL1, (void *)txBuf, (void *)&SPI2BUF, SPIBUFSIZE, 1, 1);
+/* the ADC scans AN0-AN2 on its own, interrupting after each
+   conversion, and DMA 3 copies every result into the ring, see adc.c */
+static void init_adc()
+{
+	AD1CON1 = 0;
+	AD1CON1 = 0b111 << 5 | 1 << 2;	/* auto convert, auto sample */
+	AD1CON2 = 1 << 10;		/* scan, AVdd/AVss, SMPI 0 */
+	AD1CON3 = ADC_SAMC << 8 | ADC_ADCS;
+	AD1CHS = 0;
+	AD1CSSL = (1 << ADC_CHANNELS) - 1;
+
+	/* 16 bits from ADC1BUF0 at a time, wrapping around the ring */
+	DmaChnOpen(DMA_CHANNEL3, DMA_CHN_PRI1, DMA_OPEN_AUTO);
+	DmaChnSetEventControl(DMA_CHANNEL3, DMA_EV_START_IRQ(_ADC_IRQ));
+	DmaChnSetTxfer(DMA_CHANNEL3, (void *)&ADC1BUF0, (void *)adc_ring, 2,
+		sizeof(adc_ring), 2);
+	DmaChnEnable(3);
+
+	adc_update_average(0);
+	AD1CON1SET = 1 << 15;		/* start the scan with AN0 */
+}
 
-	/* start DMA 0 */
-	DmaChnEnable(0);
-	DmaChnEnable(1);
+/* the host holds DATA REQUEST low until it has seen DATA READY, and
+   only then clocks the next frame. The feedback is prepared in the
+   idle tx buffer, with interrupts on, and swapped in unless a frame
+   has ended since or DMA 2 has started on the rest of the reply. A
+   frame that ends meanwhile changes word 0, so the feedback is
+   prepared again at once instead of on the next pass of the main
+   loop, and DATA READY does not depend on when the frame came in.
+   Returns 1 once a fresh reply is in place */
+static int refresh_reply()
+{
+	int idle, done;
+	uint32_t seq, con;
+	unsigned int status;
+
+	do {
+		idle = tx_cur ^ 1;
+		seq = frame_seq;
+		txBuf[idle][0] = txHead;
+		command_prepare_reply(txBuf[idle]);
+
+		status = INTDisableInterrupts();
+		con = DCH2CON & (_DCH2CON_CHEN_MASK | _DCH2CON_CHCHN_MASK);
+		DCH2CONCLR = con;
+		done = (seq == frame_seq) && !rx_body && !DCH2SPTR;
+		if (done) {
+			tx_cur = idle;
+			arm_body();
+		} else {
+			DCH2CONSET = con;
+		}
+		INTRestoreInterrupts(status);
+	} while (!done && (seq != frame_seq));
+
+	return done;
 }
 
 /* PWM is using OC1, OC2, OC3 and Timer2 */
@@ -121,6 +275,19 @@ static inline void configure_pwm()
 	OC1RS = 0;
 	OC2RS = 0;
 	OC3RS = 0;
+#if STEPGEN_OC > 1
+	/* both timers step, see hardware.h */
+#elif STEPGEN_OC > 0
+	OC1CON = 0x0006;	/* PWM mode, fault pin disabled */
+	OC2CON = 0x0006;
+	OC3CON = 0x0006;
+	T2CON = 0x0020;		/* Timer2 16 bit mode, 1:4 prescale */
+	PR2 = 0x9C3F;		/* set period, 500Hz */
+	T2CONSET = 0x8000;	/* start timer */
+	OC1CONSET = 0x8000;	/* enable OCx in 16 bit mode */
+	OC2CONSET = 0x8000;
+	OC3CONSET = 0x8000;
+#else
 	OC1CON = 0x0006;	/* PWM mode, fault pin disabled */
 	OC2CON = 0x0006;
 	OC3CON = 0x0006;
@@ -130,49 +297,32 @@ static inline void configure_pwm()
 	OC1CONSET = 0x8020;	/* enable OCx in 32 bit mode */
 	OC2CONSET = 0x8020;
 	OC3CONSET = 0x8020;
+#endif
 }
 
-static inline void update_pwm_period(uint32_t val)
-{
-	PR2 = val;
-}
-
-static inline void update_pwm_duty(uint32_t val1, uint32_t val2)
-{
-	OC1RS = val1 >> 16;
-	OC2RS = val1 & 0xFFFF;
-	OC3RS = val2 >> 16;
-}
-
-static inline uint32_t read_inputs()
-{
-	return (PORTB >> 3);
-}
-
-static inline void update_outputs(uint32_t val) 
-{
-	LATDCLR =  PORTD_OUT_MASK & ~(val << 3);
-	LATDSET =  PORTD_OUT_MASK &  (val << 3);
-	val = val >> 9;
-	if (val && 0b100) 
-		val = 0b1000 | (val && 0b11);
-	else
-		val = val && 0b11;
-	LATFCLR =  PORTF_OUT_MASK & ~(val);
-	LATFSET =  PORTF_OUT_MASK &  (val);
-}
-
-void reset_board()
+/* step outputs by output compare, see stepgen.c; the modules are
+   started and stopped by the ISR, the timers run all the time */
+static inline void configure_oc_steps()
 {
-	stepgen_reset();
-	update_outputs(0);
-	update_pwm_duty(0,0);
+#if STEPGEN_OC > 0
+	OC4CON = 0x0000;
+	T3CON = 0x0020;		/* Timer3 1:4 prescale */
+	PR3 = 0xFFFF;
+	T3CONSET = 0x8000;
+#endif
+#if STEPGEN_OC > 1
+	OC5CON = 0x0000;
+	T2CON = 0x0020;		/* Timer2 16 bit mode, 1:4 prescale */
+	PR2 = 0xFFFF;
+	T2CONSET = 0x8000;
+#endif
 }
 
 int main(void)
 {
-	int spi_timeout, i;
+	int spi_timeout;
 	unsigned long counter;
+	unsigned int status;
 
 	BMXCONbits.BMXARB = 0x02;
 	
@@ -194,9 +344,12 @@ int main(void)
 	INTEnableInterrupts();
 
 	init_io_ports();
+	encoder_init();
 	configure_pwm();
+	configure_oc_steps();
 	init_spi();
 	init_dma();
+	init_adc();
 
 	reset_board();
 	spi_data_ready = 0;
@@ -209,61 +362,34 @@ int main(void)
 	/* main loop */
 	while (1) {
 		if (!REQ_IN) {
-			stepgen_get_position((void *)&txBuf[1]);
-
-			/* read inputs */
-			txBuf[1+MAXGEN] = read_inputs();
-
 			/* the ready line is active low */
-			RDY_LO;
+			if (refresh_reply())
+				RDY_LO;
 		} else {
 			RDY_HI;
 		}
 
+		/* frames are carried out by SpiDmaHandler() */
 		if (spi_data_ready) {
 			spi_data_ready = 0;
 
 			/* reset spi_timeout */
 			spi_timeout = 20000L;
-
-			/* the first byte received is a command byte */
-			switch (rxBuf[0]) {
-			case 0x5453523E:	/* >RST */
-				reset_board();
-				break;
-			case 0x444D433E:	/* >CMD */
-				stepgen_update_input((const void *)&rxBuf[1]);
-				update_outputs(rxBuf[1+MAXGEN]);
-				update_pwm_duty(rxBuf[2+MAXGEN],rxBuf[3+MAXGEN]);
-				break;
-			case 0x4746433E:	/* >CFG */
-				stepgen_update_stepwidth(rxBuf[1]);
-				update_pwm_period(rxBuf[2]);
-				stepgen_reset();
-				break;
-			case 0x5453543E:	/* >TST */
-				for (i=0; i<BUFSIZE; i++)
-					txBuf[i] = rxBuf[i] ^ ~0;
-				break;
-			}
 		}
 
-		if (DCH0INTbits.CHBCIF) {
-			DCH0INTCLR = 1<<3;
-
-			/* data integrity check */
-			txBuf[0] = rxBuf[0] ^ ~0;
-			spi_data_ready = 1;
-
-			/* restart rx DMA */
-			DmaChnEnable(1);
-		}
-
-		/* shutdown stepgen if no activity */
-		if (spi_timeout)
+		/* shutdown stepgen if no activity, and start over with
+		   the SPI in case it lost track of the frames */
+		if (spi_timeout) {
 			spi_timeout--;
-		else
+			if (!spi_timeout) {
+				health[HEALTH_TIMEOUTS]++;
+				status = INTDisableInterrupts();
+				restart_spi();
+				INTRestoreInterrupts(status);
+			}
+		} else {
 			reset_board();
+		}
 
 		/* blink onboard led */
 		if (!(counter++ % (spi_timeout ? 0x10000 : 0x20000))) {
@@ -277,16 +403,97 @@ int main(void)
 	return 0;
 }
 
+/* frames are only as long as their command needs, see picnc_proto.h:
+   the first block done is the command word, the DMA is then set up
+   for the rest, and the second ends the frame. DMA 0 and word 0 of
+   the reply are armed again first thing, without touching the SPI:
+   the next frame waits in the receive FIFO until then. The rest of
+   the reply follows once it is sealed, and only then is this frame
+   carried out, from the other rx buffer */
+void __ISR(_DMA_0_VECTOR, ipl5) SpiDmaHandler(void)
+{
+	volatile uint32_t *rx = rxBuf[rx_cur];
+	uint32_t crc;
+	int n, ok;
+
+	DCH0INTCLR = 1<<3;
+	INTClearFlag(INT_SOURCE_DMA(DMA_CHANNEL0));
+
+	n = picnc_frame_words(rx[0]);
+	if (!rx_body && (n > 1)) {
+		rx_body = 1;
+		arm_rx(1, n - 1);
+
+		/* DMA 2 runs a byte ahead of the bus, stop it at the end
+		   of the frame so that nothing is left queued; word 0 is
+		   out, so it has been started */
+		DmaChnDisable(2);
+		if (DCH2SPTR < n * 4 - 4)
+			DCH2SSIZ = n * 4 - 4;
+		DmaChnEnable(2);
+		return;
+	}
+	rx_body = 0;
+
+	crc = DCRCDATA & 0xFFFF;
+	DCRCDATA = CRC_SEED;
+	rx_cur ^= 1;
+	arm_rx(0, 1);
+
+	/* word 0 goes out first, on its own. Should the command word
+	   have come in too late to stop DMA 2, the byte it left queued,
+	   TXBUFELM, takes the place of byte 0 and the reply stays in
+	   step */
+	stop_tx();
+	txHead = rx[0] ^ ~0;
+	arm_head((SPI2STAT >> 16) & 0x1F);
+	frame_seq++;
+
+	/* no channel reads txBuf[tx_cur] until arm_body(), so the reply
+	   is written and sealed in place. Should that take longer than
+	   the host's frame gap plus word 0, the bytes clocked meanwhile
+	   are garbage and the host sees a bad CRC, never a reply half
+	   old and half new. Frames with a bad CRC are dropped, and do not
+	   keep the board from timing out either */
+	ok = command_frame_done(rx, txBuf[tx_cur], crc);
+	arm_body();
+
+	if (ok) {
+		command_process(rx);
+		spi_data_ready = 1;
+	}
+}
+
 void __ISR(_CORE_TIMER_VECTOR, ipl6) CoreTimerHandler(void)
 {
-	/* update the period */
-	UpdateCoreTimer(CORE_TICK_RATE);
+	uint32_t start, compare, cycles;
 
-	/* do repetitive tasks here */
-	stepgen();
+	start = _CP0_GET_COUNT();
 
-	/* clear the interrupt flag */
+	/* update the period; when the last tick ran late by more than a
+	   period the next compare is already behind, and the core timer
+	   would not fire again until Count wraps, so skip ahead */
+	compare = _CP0_GET_COMPARE() + tick_rate;
+	while ((int32_t)(start - compare) >= 0) {
+		compare += tick_rate;
+		health[HEALTH_MISSED]++;
+	}
+	_CP0_SET_COMPARE(compare);
+
+	/* clear the interrupt flag before the work, so that a tick that
+	   overruns into the next one is only late */
 	mCTClearIntFlag();
+
+	/* do repetitive tasks here */
+	stepgen();
+	encoder();
+	probe();
+
+	/* ISR time in core timer counts, without the prologue */
+	cycles = _CP0_GET_COUNT() - start;
+	health[HEALTH_ISR_LAST] = cycles;
+	if (cycles > health[HEALTH_ISR_MAX])
+		health[HEALTH_ISR_MAX] = cycles;
 }
 
 
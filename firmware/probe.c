@@ -0,0 +1,94 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <p32xxxx.h>
+#include <plib.h>
+
+#include "hardware.h"
+#include "stepgen.h"
+#include "probe.h"
+
+/*
+  Probe and home inputs, latched once per ISR tick.
+
+  The inputs are sampled after stepgen() has run, and an edge selected
+  by >CFG latches the DDS position of every axis and the core timer
+  count of that tick, so a probe or home switch is resolved to one
+  tick, 6.25 us at 160 kHz, however long the servo period.
+
+  Only the first edge after each reply is kept; a switch that bounces
+  does not move the latch on before the host has seen it. The latch
+  number counts the latches, the host tells a new one by it.
+*/
+
+static uint32_t rise = 0, fall = 0;		/* edges to latch on */
+static uint32_t old;				/* inputs at the last tick */
+
+static volatile struct {
+	int pending;				/* not sent yet */
+	uint32_t seq;
+	uint32_t inputs;
+	uint32_t time;
+	int32_t pos[MAXGEN];
+} latch;
+
+/* the edge masks come with >CFG, the inputs as they are now do not
+   count as an edge */
+void probe_update_edges(uint32_t edges)
+{
+	disable_int();
+	rise = PROBE_RISE(edges);
+	fall = PROBE_FALL(edges);
+	old = PORTB >> 3;
+	enable_int();
+}
+
+/* called from the ISR, after stepgen() */
+void probe(void)
+{
+	uint32_t in, edge;
+
+	if (!(rise | fall))
+		return;
+
+	in = PORTB >> 3;
+	edge = (in & ~old & rise) | (~in & old & fall);
+	old = in;
+
+	if (!edge || latch.pending)
+		return;
+
+	latch.time = _CP0_GET_COUNT();
+	stepgen_latch_position((int32_t *)latch.pos);
+	latch.inputs = in;
+	latch.seq++;
+	latch.pending = 1;
+}
+
+/* the last latch into the reply, FB_PROBE onwards */
+void probe_get_latch(volatile uint32_t *buf)
+{
+	int i;
+
+	disable_int();
+	buf[0] = PROBE(latch.seq, latch.inputs);
+	buf[1] = latch.time;
+	for (i = 0; i < MAXGEN; i++)
+		buf[2 + i] = latch.pos[i];
+	latch.pending = 0;
+	enable_int();
+}
@@ -0,0 +1,233 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Compares the ISR cost of the baseline if-chain stepgen (stepgen_ref.c)
+  with the current one. Both are driven with the same velocity profile;
+  the port E state after every tick must match, and the SFR stores,
+  host time and estimated PIC32 cycles per tick (mean/worst) are
+  reported. Axes stepped by output compare (STEPGEN_OC) are left out
+  of the comparison.
+
+  usage: isrbench [-f basefreq] [-t seconds] [-p period_us]
+		  [-r reverse_periods] rate[,rate...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <plib.h>
+
+#include "sim.h"
+#include "hardware.h"
+#include "stepgen.h"
+#include "stepgen_ref.h"
+
+static const struct {
+	int port;
+	uint32_t step, dir;
+} pins[] = { STEPGEN_PIN_TABLE };
+
+typedef struct {
+	const char *name;
+	int call_cycles;		/* extra model cost per store */
+	void (*isr)(void);
+	void (*reset)(void);
+	void (*update_input)(const void *);
+	void (*update_stepwidth)(int);
+} impl_t;
+
+static const impl_t impl[2] = {
+	{ "if-chain (baseline)", STEPGEN_REF_CALL_CYCLES,
+	  stepgen_ref, stepgen_ref_reset,
+	  stepgen_ref_update_input, stepgen_ref_update_stepwidth },
+	{ "set/clr masks", 0,
+	  stepgen, stepgen_reset,
+	  stepgen_update_input, stepgen_update_stepwidth },
+};
+
+typedef struct {
+	uint64_t stores;
+	unsigned long max_stores;
+	double ns;
+} result_t;
+
+static unsigned long basefreq = 160000, period_us = 1000, reverse = 0;
+static double rate[MAXGEN];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void set_velocity(const impl_t *p, uint64_t periods)
+{
+	stepgen_input_struct in;
+	int sign = 1, i;
+
+	if (reverse && ((periods / reverse) & 1))
+		sign = -1;
+
+	for (i = 0; i < MAXGEN; i++)
+		in.velocity[i] = (int32_t)(sign * rate[i] * HALFSTEP_MASK /
+			basefreq);
+	p->update_input(&in);
+}
+
+/* record (trace != NULL) or time one implementation */
+static void run(const impl_t *p, uint64_t ticks, uint32_t *trace,
+	result_t *r)
+{
+	uint64_t period_ticks, t, periods = 0;
+	double t0 = 0;
+
+	period_ticks = basefreq * period_us / 1000000;
+	if (!period_ticks)
+		period_ticks = 1;
+
+	sim_reset();
+	p->update_stepwidth(1);
+	p->reset();
+	sim_flush();
+	sim.stores = 0;
+
+	memset(r, 0, sizeof(*r));
+	for (t = 0; t < ticks; t++) {
+		if (!(t % period_ticks)) {
+			if (!trace && t)
+				r->ns += now() - t0;
+			set_velocity(p, periods++);
+			if (!trace)
+				t0 = now();
+		}
+
+		p->isr();
+
+		if (trace) {
+			trace[t] = sim_sfr_read(SIM_PORTE);
+			r->stores += sim.stores;
+			if (sim.stores > r->max_stores)
+				r->max_stores = sim.stores;
+			sim.stores = 0;
+		}
+	}
+	if (!trace)
+		r->ns += now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+	double seconds = 1.0, budget, base, store, mean, worst;
+	uint64_t ticks, t;
+	uint32_t *trace[2], skip = 0;
+	result_t res[2], timing;
+	int opt, i;
+	char *s;
+
+	while ((opt = getopt(argc, argv, "f:t:p:r:")) != -1) {
+		switch (opt) {
+		case 'f':
+			basefreq = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 'p':
+			period_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reverse = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: isrbench [-f basefreq] "
+				"[-t seconds] [-p period_us] "
+				"[-r reverse_periods] rate[,rate...]\n");
+			return 1;
+		}
+	}
+
+	if (optind < argc) {
+		s = argv[optind];
+		for (i = 0; i < MAXGEN && *s; i++) {
+			rate[i] = strtod(s, &s);
+			if (*s == ',')
+				s++;
+		}
+	} else {
+		/* default load: all axes stepping */
+		for (i = 0; i < MAXGEN; i++)
+			rate[i] = 10000.0 * (i + 1);
+	}
+
+	if (!basefreq)
+		return 1;
+
+	ticks = (uint64_t)(seconds * basefreq);
+	budget = (double)SYS_FREQ / basefreq;
+	base = SIM_ISR_CYCLES + MAXGEN * SIM_AXIS_CYCLES;
+
+	for (i = 0; i < 2; i++) {
+		trace[i] = malloc(ticks * sizeof(uint32_t));
+		if (!trace[i]) {
+			perror("malloc");
+			return 1;
+		}
+		run(&impl[i], ticks, trace[i], &res[i]);
+	}
+
+	for (i = 0; i < STEPGEN_OC; i++)
+		if (pins[i].port == STEPGEN_PORT_E)
+			skip |= pins[i].step | pins[i].dir;
+
+	for (t = 0; t < ticks; t++)
+		if ((trace[0][t] ^ trace[1][t]) & ~skip)
+			break;
+
+	printf("base frequency %lu Hz, %llu ticks, budget %.0f cycles\n\n",
+		basefreq, (unsigned long long)ticks, budget);
+	printf("%-22s %12s %12s %12s %12s\n", "", "stores/tick",
+		"max stores", "host ns/tick", "est. cycles");
+
+	for (i = 0; i < 2; i++) {
+		run(&impl[i], ticks, NULL, &timing);
+		store = SIM_SFR_CYCLES + impl[i].call_cycles;
+		mean = (double)res[i].stores / ticks;
+		worst = base + res[i].max_stores * store;
+		printf("%-22s %12.2f %12lu %12.1f %7.1f/%.0f\n", impl[i].name,
+			mean, res[i].max_stores, timing.ns / ticks,
+			base + mean * store, worst);
+	}
+
+	if (t == ticks) {
+		printf("\nstep/dir output identical on every tick\n");
+	} else {
+		printf("\noutputs differ at tick %llu: %08x vs %08x\n",
+			(unsigned long long)t, trace[0][t], trace[1][t]);
+		return 1;
+	}
+
+	free(trace[0]);
+	free(trace[1]);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* host stand-in for the Microchip device header, only the SFRs used by
+   stepgen.c and command.c are provided */
+
+#ifndef __P32XXXX_SIM_H__
+#define __P32XXXX_SIM_H__
+
+#include <stdint.h>
+
+#include "sim.h"
+
+#define PORTB		(sim_sfr_read(SIM_PORTB))
+
+#define LATC		(*sim_sfr_write(SIM_PORTC, SIM_WRITE))
+#define LATCSET		(*sim_sfr_write(SIM_PORTC, SIM_SET))
+#define LATCCLR		(*sim_sfr_write(SIM_PORTC, SIM_CLR))
+#define LATCINV		(*sim_sfr_write(SIM_PORTC, SIM_INV))
+
+#define LATD		(*sim_sfr_write(SIM_PORTD, SIM_WRITE))
+#define LATDSET		(*sim_sfr_write(SIM_PORTD, SIM_SET))
+#define LATDCLR		(*sim_sfr_write(SIM_PORTD, SIM_CLR))
+#define LATDINV		(*sim_sfr_write(SIM_PORTD, SIM_INV))
+
+#define LATE		(*sim_sfr_write(SIM_PORTE, SIM_WRITE))
+#define LATESET		(*sim_sfr_write(SIM_PORTE, SIM_SET))
+#define LATECLR		(*sim_sfr_write(SIM_PORTE, SIM_CLR))
+#define LATEINV		(*sim_sfr_write(SIM_PORTE, SIM_INV))
+
+#define LATF		(*sim_sfr_write(SIM_PORTF, SIM_WRITE))
+#define LATFSET		(*sim_sfr_write(SIM_PORTF, SIM_SET))
+#define LATFCLR		(*sim_sfr_write(SIM_PORTF, SIM_CLR))
+#define LATFINV		(*sim_sfr_write(SIM_PORTF, SIM_INV))
+
+#define LATG		(*sim_sfr_write(SIM_PORTG, SIM_WRITE))
+#define LATGSET		(*sim_sfr_write(SIM_PORTG, SIM_SET))
+#define LATGCLR		(*sim_sfr_write(SIM_PORTG, SIM_CLR))
+#define LATGINV		(*sim_sfr_write(SIM_PORTG, SIM_INV))
+
+#define OC1RS		(*sim_sfr_write(SIM_OC1RS, SIM_WRITE))
+#define OC2RS		(*sim_sfr_write(SIM_OC2RS, SIM_WRITE))
+#define OC3RS		(*sim_sfr_write(SIM_OC3RS, SIM_WRITE))
+
+/* step outputs by output compare, see sim_tick() */
+#define TMR2		(sim.reg[SIM_TMR2])
+#define PR2		(sim.reg[SIM_PR2])
+#define TMR3		(sim.reg[SIM_TMR3])
+#define PR3		(sim.reg[SIM_PR3])
+#define OC4CON		(sim.reg[SIM_OC4CON])
+#define OC4R		(sim.reg[SIM_OC4R])
+#define OC4RS		(sim.reg[SIM_OC4RS])
+#define OC5CON		(sim.reg[SIM_OC5CON])
+#define OC5R		(sim.reg[SIM_OC5R])
+#define OC5RS		(sim.reg[SIM_OC5RS])
+
+/* ADC results by DMA, see sim_adc() */
+#define DCH3DPTR	(sim.reg[SIM_DCH3DPTR])
+
+#define _CP0_GET_COUNT()	sim_core_count()
+
+#endif				/* __P32XXXX_SIM_H__ */
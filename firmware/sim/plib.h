@@ -0,0 +1,58 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* host stand-in for the peripheral library header */
+
+#ifndef __PLIB_SIM_H__
+#define __PLIB_SIM_H__
+
+#include "p32xxxx.h"
+
+#define BIT_0		(1ul << 0)
+#define BIT_1		(1ul << 1)
+#define BIT_2		(1ul << 2)
+#define BIT_3		(1ul << 3)
+#define BIT_4		(1ul << 4)
+#define BIT_5		(1ul << 5)
+#define BIT_6		(1ul << 6)
+#define BIT_7		(1ul << 7)
+#define BIT_8		(1ul << 8)
+#define BIT_9		(1ul << 9)
+#define BIT_10		(1ul << 10)
+#define BIT_11		(1ul << 11)
+#define BIT_12		(1ul << 12)
+#define BIT_13		(1ul << 13)
+#define BIT_14		(1ul << 14)
+#define BIT_15		(1ul << 15)
+#define BIT_16		(1ul << 16)
+#define BIT_17		(1ul << 17)
+#define BIT_18		(1ul << 18)
+#define BIT_19		(1ul << 19)
+#define BIT_20		(1ul << 20)
+#define BIT_21		(1ul << 21)
+#define BIT_22		(1ul << 22)
+#define BIT_23		(1ul << 23)
+#define BIT_24		(1ul << 24)
+#define BIT_25		(1ul << 25)
+#define BIT_26		(1ul << 26)
+#define BIT_27		(1ul << 27)
+#define BIT_28		(1ul << 28)
+#define BIT_29		(1ul << 29)
+#define BIT_30		(1ul << 30)
+#define BIT_31		(1ul << 31)
+
+#endif				/* __PLIB_SIM_H__ */
@@ -0,0 +1,148 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+
+#include <plib.h>
+
+#include "sim.h"
+#include "hardware.h"
+#include "command.h"
+#include "adc.h"
+
+sim_state_t sim;
+
+static struct {
+	int pending;
+	int reg, op;
+	volatile uint32_t val;
+} slot;
+
+void sim_flush(void)
+{
+	uint32_t oldval, newval;
+
+	if (!slot.pending)
+		return;
+	slot.pending = 0;
+
+	oldval = sim.reg[slot.reg];
+	switch (slot.op) {
+	case SIM_SET:
+		newval = oldval | slot.val;
+		break;
+	case SIM_CLR:
+		newval = oldval & ~slot.val;
+		break;
+	case SIM_INV:
+		newval = oldval ^ slot.val;
+		break;
+	default:
+		newval = slot.val;
+		break;
+	}
+	sim.reg[slot.reg] = newval;
+
+	if ((newval != oldval) && sim.edge)
+		sim.edge(slot.reg, oldval, newval);
+}
+
+volatile uint32_t *sim_sfr_write(int reg, int op)
+{
+	sim_flush();
+
+	slot.pending = 1;
+	slot.reg = reg;
+	slot.op = op;
+	slot.val = 0;
+	sim.stores++;
+
+	return &slot.val;
+}
+
+uint32_t sim_sfr_read(int reg)
+{
+	sim_flush();
+	return sim.reg[reg];
+}
+
+void sim_reset(void)
+{
+	void (*edge)(int, uint32_t, uint32_t) = sim.edge;
+
+	slot.pending = 0;
+	memset(&sim, 0, sizeof(sim));
+	sim.edge = edge;
+}
+
+/* output compare step outputs: timer, period, module, pin on port D */
+static const struct {
+	int tmr, pr, con, r, rs;
+	uint32_t pin;
+} oc[] = {
+	{ SIM_TMR3, SIM_PR3, SIM_OC4CON, SIM_OC4R, SIM_OC4RS, BIT_3 },
+	{ SIM_TMR2, SIM_PR2, SIM_OC5CON, SIM_OC5R, SIM_OC5RS, BIT_4 },
+};
+
+static void oc_pin(uint32_t pin, int high)
+{
+	uint32_t oldval = sim.reg[SIM_PORTD];
+
+	sim.reg[SIM_PORTD] = high ? oldval | pin : oldval & ~pin;
+	if ((sim.reg[SIM_PORTD] != oldval) && sim.edge)
+		sim.edge(SIM_PORTD, oldval, sim.reg[SIM_PORTD]);
+}
+
+/* end of an ISR tick: the timers of the step outputs by output compare
+   count on, a module in continuous pulse mode drives its pin high at
+   the first compare and low at the second */
+void sim_tick(void)
+{
+	uint32_t *r = sim.reg, k;
+	int i;
+
+	sim_flush();
+
+	for (i = 0; i < STEPGEN_OC; i++) {
+		if (!(r[oc[i].con] & 0x8000))
+			oc_pin(oc[i].pin, 0);
+
+		for (k = 0; k < tick_rate / STEPGEN_OC_CORE; k++) {
+			r[oc[i].tmr] = r[oc[i].tmr] >= r[oc[i].pr] ? 0 :
+				(r[oc[i].tmr] + 1) & 0xFFFF;
+			if (!(r[oc[i].con] & 0x8000))
+				continue;
+			if (r[oc[i].tmr] == r[oc[i].r])
+				oc_pin(oc[i].pin, 1);
+			else if (r[oc[i].tmr] == r[oc[i].rs])
+				oc_pin(oc[i].pin, 0);
+		}
+	}
+
+	sim.tick++;
+	sim.count += tick_rate;
+}
+
+/* one ADC conversion, stored by DMA 3 where its pointer is; the ring
+   holds whole scans, so the pointer also tells the channel */
+void sim_adc(uint16_t val)
+{
+	uint32_t i = sim.reg[SIM_DCH3DPTR] / 2;
+
+	adc_ring[i] = val & 0x3FF;
+	sim.reg[SIM_DCH3DPTR] = (i + 1) % ADC_RING * 2;
+}
@@ -0,0 +1,105 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+/*
+  Host shim for the PIC32 special function registers.
+
+  Every SFR store made by the firmware goes through sim_sfr_write(),
+  which hands out a one-entry write slot. The slot is committed on the
+  next SFR access or on sim_flush(), so SET/CLR/INV semantics and
+  edge callbacks work without the firmware noticing. Each store is
+  counted, which feeds the per-tick cost estimate.
+
+  The timer and output compare registers of the step outputs by output
+  compare are plain variables instead, read and written in place. The
+  modules run in sim_tick(), which drives their pins on port D. So is
+  the pointer of the DMA channel that stores the ADC results, which
+  sim_adc() moves on.
+*/
+
+enum {
+	SIM_PORTB,
+	SIM_PORTC,
+	SIM_PORTD,
+	SIM_PORTE,
+	SIM_PORTF,
+	SIM_PORTG,
+	SIM_PR2,
+	SIM_OC1RS,
+	SIM_OC2RS,
+	SIM_OC3RS,
+	SIM_TMR2,
+	SIM_TMR3,
+	SIM_PR3,
+	SIM_OC4CON,
+	SIM_OC4R,
+	SIM_OC4RS,
+	SIM_OC5CON,
+	SIM_OC5R,
+	SIM_OC5RS,
+	SIM_DCH3DPTR,
+	SIM_NREGS
+};
+
+enum {
+	SIM_WRITE,
+	SIM_SET,
+	SIM_CLR,
+	SIM_INV
+};
+
+typedef struct {
+	uint32_t reg[SIM_NREGS];
+	unsigned long stores;		/* SFR stores since reset */
+	unsigned long critical;		/* disable_int() sections */
+	uint64_t tick;			/* ISR ticks since reset */
+	uint32_t count;			/* core timer */
+	void (*edge)(int reg, uint32_t oldval, uint32_t newval);
+} sim_state_t;
+
+extern sim_state_t sim;
+
+/*
+  Rough PIC32MX cost model in SYSCLK cycles, read off the -O3
+  disassembly: interrupt entry/exit with the register save/restore,
+  UpdateCoreTimer() and the flag clear; one pass of the per-axis loop
+  body; one store across the peripheral bus; one encoder decoded.
+*/
+#define SIM_ISR_CYCLES		60
+#define SIM_AXIS_CYCLES		24
+#define SIM_SFR_CYCLES		3
+#define SIM_ENC_CYCLES		10
+
+volatile uint32_t *sim_sfr_write(int reg, int op);
+uint32_t sim_sfr_read(int reg);
+void sim_flush(void);
+void sim_reset(void);
+void sim_tick(void);
+void sim_adc(uint16_t val);
+
+/* the core timer runs at half SYSCLK, tick_rate counts per tick */
+#define sim_core_count()	(sim.count)
+
+#define sim_disable_int()	do { sim.critical++; } while (0)
+#define sim_enable_int()	do { } while (0)
+
+#endif				/* __SIM_H__ */
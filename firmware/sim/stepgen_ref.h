@@ -0,0 +1,33 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef __STEPGEN_REF_H__
+#define __STEPGEN_REF_H__
+
+/* baseline if-chain stepgen, see stepgen_ref.c */
+
+/* each store is reached through a call walking the 4-way if chain:
+   four compare-and-branch pairs plus the call overhead */
+#define STEPGEN_REF_CALL_CYCLES	12
+
+void stepgen_ref(void);
+void stepgen_ref_reset(void);
+void stepgen_ref_get_position(void *buf);
+void stepgen_ref_update_input(const void *buf);
+void stepgen_ref_update_stepwidth(int width);
+
+#endif				/* __STEPGEN_REF_H__ */
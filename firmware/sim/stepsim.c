@@ -0,0 +1,476 @@
+/*    Copyright (C) 2013 GP Orcullo
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+  Host driver for the firmware stepgen.
+
+  Runs stepgen() at the base frequency and feeds it >CFG and >CMD
+  frames through the firmware command dispatch once per servo period,
+  the same way the HAL driver does. Reports:
+
+    - achieved step rate, and the step count seen on the pins against
+      the DDS position in the reply frame (a mismatch means lost steps)
+    - SFR stores and estimated PIC32 cycles per ISR tick
+    - optionally, a VCD trace of every step/dir edge
+
+  With -q the velocities are sent as queued segments one servo period
+  long, with the given queue depth. -j delays the arrival of each frame
+  by a random amount, to mimic servo thread latency on the host. -b
+  sends them with >BAT instead, cut into the given number of samples;
+  the depth stays in servo periods.
+
+  With -a the rates are turned into target positions sent with >POS,
+  and the board ramps to them with the given acceleration; the largest
+  following error seen at a servo period is reported.
+
+  With -c the targets are sent with >PVT instead, each with the rate
+  as its velocity, and the board follows a cubic curve to them; the
+  following error is taken against the target due at that time.
+
+  With -e the encoder inputs are driven in quadrature at the given
+  rates, in counts/s, and the counts in the last reply are checked
+  against them.
+
+  usage: stepsim [-f basefreq] [-t seconds] [-p period_us] [-w stepwidth]
+		 [-r reverse_periods] [-q depth] [-j jitter_us]
+		 [-a accel | -c] [-b samples] [-e rate[,rate...]]
+		 [-o trace.vcd] rate[,rate...]
+
+  rates are in steps/s, one per axis
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <plib.h>
+
+#include "sim.h"
+#include "hardware.h"
+#include "stepgen.h"
+#include "command.h"
+#include "encoder.h"
+#include "probe.h"
+
+static const struct {
+	int port;
+	uint32_t step, dir;
+} pins[] = { STEPGEN_PIN_TABLE };
+
+static const int port_reg[] = {
+	[STEPGEN_PORT_E] = SIM_PORTE,
+	[STEPGEN_PORT_F] = SIM_PORTF,
+	[STEPGEN_PORT_D] = SIM_PORTD,
+};
+
+#define VCD_STEP(a)		('!' + 2*(a))
+#define VCD_DIR(a)		('!' + 2*(a) + 1)
+
+static FILE *vcd;
+
+static struct {
+	long steps;			/* signed step count seen on the pins */
+	long pulses;
+	long dirchanges;
+	double target;			/* >POS or >PVT target, DDS units */
+	double max_err;			/* following error, steps */
+	int64_t accum;			/* DDS position from the reply frame */
+	int32_t old_count;
+} axis[MAXGEN];
+
+static void edge(int reg, uint32_t oldval, uint32_t newval)
+{
+	uint32_t changed = oldval ^ newval, step, dir, port;
+	int i, stamped = 0;
+
+	for (i = 0; i < MAXGEN; i++) {
+		/* output compare pins are on port D */
+		step = i < STEPGEN_OC ? STEPGEN_OC_STEP(i) : pins[i].step;
+		if (port_reg[i < STEPGEN_OC ? STEPGEN_PORT_D :
+		    pins[i].port] != reg)
+			step = 0;
+		dir = port_reg[pins[i].port] == reg ? pins[i].dir : 0;
+		if (!(changed & (step | dir)))
+			continue;
+
+		if (vcd && !stamped) {
+			fprintf(vcd, "#%llu\n", (unsigned long long)sim.tick);
+			stamped = 1;
+		}
+
+		if (changed & step) {
+			if (newval & step) {
+				axis[i].pulses++;
+				port = sim.reg[port_reg[pins[i].port]];
+				axis[i].steps += (port & pins[i].dir) ? -1 : 1;
+			}
+			if (vcd)
+				fprintf(vcd, "%d%c\n", (newval & step) ? 1 : 0,
+					VCD_STEP(i));
+		}
+		if (changed & dir) {
+			axis[i].dirchanges++;
+			if (vcd)
+				fprintf(vcd, "%d%c\n", (newval & dir) ? 1 : 0,
+					VCD_DIR(i));
+		}
+	}
+}
+
+static void vcd_header(unsigned long basefreq)
+{
+	int i;
+
+	fprintf(vcd, "$timescale %lu ns $end\n", 1000000000ul / basefreq);
+	fprintf(vcd, "$scope module picnc $end\n");
+	for (i = 0; i < MAXGEN; i++) {
+		fprintf(vcd, "$var wire 1 %c step%d $end\n", VCD_STEP(i), i);
+		fprintf(vcd, "$var wire 1 %c dir%d $end\n", VCD_DIR(i), i);
+	}
+	fprintf(vcd, "$upscope $end\n$enddefinitions $end\n#0\n");
+	for (i = 0; i < MAXGEN; i++)
+		fprintf(vcd, "0%c\n0%c\n", VCD_STEP(i), VCD_DIR(i));
+}
+
+static void transfer(uint32_t *rx, uint32_t *tx)
+{
+	int n = picnc_frame_words(rx[0]);
+
+	/* DATA REQUEST, then the frame itself */
+	picnc_crc_seal(rx, n);
+	command_prepare_reply(tx);
+	if (command_frame_done(rx, tx, picnc_crc16(PICNC_CRC_INIT, rx, n * 4)))
+		command_process(rx);
+}
+
+#if PICNC_ENCODERS > 0
+static double enc_rate[PICNC_ENCODERS];
+static int64_t enc_pos[PICNC_ENCODERS];		/* counts, 32.32 */
+
+/* move the encoder inputs on by one tick, AB 00, 10, 11, 01 */
+static void drive_encoders(unsigned long basefreq)
+{
+	static const uint32_t ab[4] = { 0, 1, 3, 2 };
+	uint32_t in = sim.reg[SIM_PORTB];
+	int i;
+
+	for (i = 0; i < PICNC_ENCODERS; i++) {
+		enc_pos[i] += (int64_t)(enc_rate[i] * 4294967296.0 / basefreq);
+		in &= ~(3 << ENCODER_SHIFT(i));
+		in |= ab[(enc_pos[i] >> 32) & 3] << ENCODER_SHIFT(i);
+	}
+	sim.reg[SIM_PORTB] = in;
+}
+#endif
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: stepsim [-f basefreq] [-t seconds] "
+		"[-p period_us] [-w stepwidth]\n"
+		"\t\t[-r reverse_periods] [-q depth] [-j jitter_us]\n"
+		"\t\t[-a accel | -c] [-b samples] [-e rate[,rate...]]\n"
+		"\t\t[-o trace.vcd] rate[,rate...]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long basefreq = 160000, period_us = 1000, reverse = 0;
+	unsigned long depth = 0, jitter_us = 0, batch = 0;
+	double seconds = 1.0, rate[MAXGEN] = { 0 }, accel = 0;
+	int stepwidth = 1, pvt = 0, opt, i;
+	uint64_t ticks, period_ticks, jitter_ticks, next_frame, periods, t;
+	unsigned long min_level = ~0ul;
+	unsigned long max_stores = 0;
+	uint64_t total_stores = 0;
+	double budget, cycles, mean_cycles, max_cycles;
+	uint32_t rx[BUFSIZE], tx[BUFSIZE];
+	char *p;
+
+	while ((opt = getopt(argc, argv, "f:t:p:w:r:q:j:a:cb:e:o:")) != -1) {
+		switch (opt) {
+		case 'f':
+			basefreq = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 'p':
+			period_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			stepwidth = atoi(optarg);
+			break;
+		case 'r':
+			reverse = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			jitter_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			accel = strtod(optarg, NULL);
+			break;
+		case 'c':
+			pvt = 1;
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+#if PICNC_ENCODERS > 0
+			p = optarg;
+			for (i = 0; i < PICNC_ENCODERS && *p; i++) {
+				enc_rate[i] = strtod(p, &p);
+				if (*p == ',')
+					p++;
+			}
+#endif
+			break;
+		case 'o':
+			vcd = fopen(optarg, "w");
+			if (!vcd) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind < argc) {
+		p = argv[optind];
+		for (i = 0; i < MAXGEN && *p; i++) {
+			rate[i] = strtod(p, &p);
+			if (*p == ',')
+				p++;
+		}
+	}
+
+	if (basefreq < PICNC_BASEFREQ_MIN || basefreq > PICNC_BASEFREQ_MAX ||
+	    !period_us || depth > PICNC_QUEUE_MAX ||
+	    (depth && accel > 0) || (pvt && (depth || accel > 0)))
+		usage();
+	if (batch && (!depth || batch > PICNC_BATCH ||
+	    depth * batch > PICNC_QUEUE_MAX))
+		usage();
+
+	period_ticks = (uint64_t)basefreq * period_us / 1000000;
+	if (!period_ticks)
+		period_ticks = 1;
+	if (depth && (period_ticks > 0xFFFF || period_ticks < batch))
+		usage();
+	if (pvt && (period_ticks > 0xFFFF || period_ticks < 2))
+		usage();
+	jitter_ticks = (uint64_t)basefreq * jitter_us / 1000000;
+	ticks = (uint64_t)(seconds * basefreq);
+
+	sim.edge = edge;
+	sim_reset();
+	if (vcd)
+		vcd_header(basefreq);
+
+	/* >RST then >CFG, as done by the HAL at load time */
+	memset(rx, 0, sizeof(rx));
+	rx[0] = PICNC_RST;
+	transfer(rx, tx);
+	rx[0] = PICNC_CFG;
+	rx[CFG_STEPWIDTH] = stepwidth;
+	rx[CFG_PWM_PERIOD] = (SYS_FREQ/500) - 1;
+	rx[CFG_QUEUE_DEPTH] = batch ? depth * batch : depth;
+	rx[CFG_BASEFREQ] = basefreq;
+	transfer(rx, tx);
+	if (accel > 0) {
+		rx[0] = PICNC_LIM;
+		rx[LIM_PERIOD] = period_ticks;
+		for (i = 0; i < MAXGEN; i++)
+			rx[LIM_ACCEL(i)] = (int32_t)(accel * HALFSTEP_MASK /
+				((double)basefreq * basefreq) *
+				PICNC_RAMP_TICKS + 0.5);
+		transfer(rx, tx);
+	}
+	sim_flush();
+	sim.stores = 0;
+
+	periods = 0;
+	next_frame = 0;
+	for (t = 0; t < ticks; t++) {
+		if (t == next_frame) {
+			int sign = 1;
+
+			if (reverse && ((periods / reverse) & 1))
+				sign = -1;
+
+			/* positions, as read by the HAL */
+			rx[0] = PICNC_STA;
+			transfer(rx, tx);
+			for (i = 0; i < MAXGEN; i++) {
+				axis[i].accum += (int32_t)(tx[FB_POS(i)] -
+					axis[i].old_count);
+				axis[i].old_count = tx[FB_POS(i)];
+			}
+			if (depth && periods > depth) {
+				if (QUEUE_LEVEL(tx[FB_QUEUE]) < min_level)
+					min_level = QUEUE_LEVEL(tx[FB_QUEUE]);
+			}
+
+			/* one step per HALFSTEP_MASK of DDS travel */
+			memset(rx, 0, sizeof(rx));
+			rx[0] = pvt ? PICNC_PVT :
+				accel > 0 ? PICNC_POS : PICNC_CMD;
+			for (i = 0; i < MAXGEN; i++)
+				rx[CMD_VEL(i)] = (int32_t)(sign * rate[i] *
+					HALFSTEP_MASK / basefreq);
+			for (i = 0; (pvt || accel > 0) && i < MAXGEN; i++) {
+				double err;
+
+				/* a >PVT target is due one period later */
+				if (pvt) {
+					rx[PVT_VEL(i)] = rx[CMD_VEL(i)];
+					err = fabs(axis[i].target -
+						axis[i].accum);
+				}
+				axis[i].target += sign * rate[i] *
+					HALFSTEP_MASK * period_ticks / basefreq;
+				if (!pvt)
+					err = fabs(axis[i].target -
+						axis[i].accum);
+				err /= HALFSTEP_MASK;
+				if (periods && err > axis[i].max_err)
+					axis[i].max_err = err;
+				rx[CMD_POS(i)] = (int32_t)(int64_t)axis[i].target;
+			}
+			if (pvt)
+				rx[CMD_SEGMENT] = SEGMENT(0, period_ticks);
+			if (depth)
+				rx[CMD_SEGMENT] = SEGMENT(periods, period_ticks);
+
+			/* the same rates in every sample of a batch */
+			if (batch) {
+				int k;
+
+				rx[0] = PICNC_BAT;
+				for (k = 1; k < (int)batch; k++)
+					for (i = 0; i < MAXGEN; i++)
+						rx[BAT_VEL(k, i)] =
+							rx[CMD_VEL(i)];
+				rx[CMD_SEGMENT] = BATCH(batch,
+					periods * batch, period_ticks);
+			}
+			transfer(rx, tx);
+
+			sim_flush();
+			sim.stores = 0;
+			periods++;
+
+			/* the next frame is due one period after this one
+			   was, plus some latency */
+			next_frame = periods * period_ticks;
+			if (jitter_ticks)
+				next_frame += rand() % (jitter_ticks + 1);
+			if (next_frame <= t)
+				next_frame = t + 1;
+		}
+
+#if PICNC_ENCODERS > 0
+		drive_encoders(basefreq);
+#endif
+		stepgen();
+		encoder();
+		probe();
+		sim_tick();
+
+		total_stores += sim.stores;
+		if (sim.stores > max_stores)
+			max_stores = sim.stores;
+		sim.stores = 0;
+	}
+
+	/* final position read */
+	rx[0] = PICNC_STA;
+	transfer(rx, tx);
+	for (i = 0; i < MAXGEN; i++) {
+		axis[i].accum += (int32_t)(tx[FB_POS(i)] -
+			axis[i].old_count);
+		axis[i].old_count = tx[FB_POS(i)];
+	}
+
+	printf("base frequency %lu Hz, servo period %lu us, "
+		"stepwidth %d, %llu ticks\n\n", basefreq, period_us,
+		stepwidth, (unsigned long long)ticks);
+
+	printf("axis  cmd rate   achieved    pulses     steps  dds steps"
+		"  dir  lost\n");
+	for (i = 0; i < MAXGEN; i++) {
+		long dds = (long)(axis[i].accum >> (STEPBIT - 1));
+		long lost = labs(dds - axis[i].steps);
+
+		/* a step in flight at the end is not lost */
+		if (lost)
+			lost--;
+
+		printf("%4d %9.1f %10.1f %9ld %9ld %10ld %4ld %5ld\n", i,
+			rate[i], axis[i].pulses / seconds, axis[i].pulses,
+			axis[i].steps, dds, axis[i].dirchanges, lost);
+	}
+
+#if PICNC_ENCODERS > 0
+	printf("\nencoder  cmd rate     counts         fb\n");
+	for (i = 0; i < PICNC_ENCODERS; i++)
+		printf("%7d %9.1f %10ld %10d\n", i, enc_rate[i],
+			(long)(enc_pos[i] >> 32), (int32_t)tx[FB_ENC(i)]);
+	printf("(%u ticks with two counts at once)\n", encoder_errors());
+#endif
+
+	budget = (double)SYS_FREQ / basefreq;
+	cycles = SIM_ISR_CYCLES + MAXGEN * SIM_AXIS_CYCLES +
+		PICNC_ENCODERS * SIM_ENC_CYCLES;
+	mean_cycles = cycles + (ticks ? (double)total_stores / ticks : 0) *
+		SIM_SFR_CYCLES;
+	max_cycles = cycles + max_stores * SIM_SFR_CYCLES;
+
+	if (pvt || accel > 0) {
+		if (pvt)
+			printf("\ncubic, max following error (steps):");
+		else
+			printf("\naccel %.0f steps/s^2, max following error "
+				"(steps):", accel);
+		for (i = 0; i < MAXGEN; i++)
+			printf(" %.2f", axis[i].max_err);
+		printf("\n");
+	}
+
+	if (depth)
+		printf("\nqueue depth %lu, jitter %lu us: lowest level %lu\n",
+			depth, jitter_us, min_level == ~0ul ? 0 : min_level);
+
+	printf("\nISR cost per tick (estimate): %.1f cycles mean, "
+		"%.0f cycles worst case (%lu SFR stores)\n",
+		mean_cycles, max_cycles, max_stores);
+	printf("budget %.0f cycles, worst case headroom %.1f%%\n",
+		budget, 100.0 * (budget - max_cycles) / budget);
+
+	if (vcd)
+		fclose(vcd);
+
+	return 0;
+}
@@ -36,160 +36,756 @@
 
 */
 
-static void step_hi(int);
-static void step_lo(int);
-static void dir_hi(int);
-static void dir_lo(int);
+/* per-axis state, packed so that the ISR walks one struct per axis */
+typedef struct {
+	int32_t position;
+	int32_t oldpos;
+	int32_t oldvel;
+	int stepwdth;
+	int dirchange;
+	int do_step_hi;
+} stepgen_axis_struct;
 
-static volatile int32_t position[MAXGEN] = { 0 };
+static volatile stepgen_axis_struct axis[MAXGEN];
 
-static int32_t oldpos[MAXGEN] = { 0 },
-	       oldvel[MAXGEN] = { 0 };
+typedef struct {
+	int port;
+	uint32_t step_mask;
+	uint32_t dir_mask;
+} stepgen_pins_struct;
 
-static int dirchange[MAXGEN] = { 0 };
+static const stepgen_pins_struct pins[] = { STEPGEN_PIN_TABLE };
+
+PICNC_STATIC_ASSERT(sizeof(pins)/sizeof(pins[0]) >= MAXGEN, pin_table_size);
 
 static volatile stepgen_input_struct stepgen_input = { {0} };
 
-static int do_step_hi[MAXGEN] = { 1 };
+/*
+  Segment queue
+
+  The host sends velocity segments a few servo periods ahead; the ISR
+  plays them back to back, each for its own number of ticks, so that
+  servo thread jitter on the host does not reach the step outputs.
+  Playback starts once queue_prime segments are waiting. When the
+  queue runs dry the last velocity is held.
+
+  queue_head is only written by SpiDmaHandler() in main.c, queue_tail
+  and the current segment only by the ISR. The tick interrupts the SPI
+  handler, never the other way round, so it sees queue_head either
+  before or after an entry is published, never a half written one.
+*/
+typedef struct {
+	stepgen_input_struct input;
+	uint32_t segment;
+} stepgen_segment_struct;
+
+static stepgen_segment_struct queue[PICNC_QUEUE_SIZE];
+static volatile unsigned queue_head = 0, queue_tail = 0;
+static volatile int queue_running = 0;
+static unsigned queue_prime = 1;
+
+static volatile uint32_t seg_ticks = 0,		/* ticks left, current */
+			 seg_seq = 0;
+static volatile uint32_t queue_underruns = 0;	/* since power up */
 
-void stepgen_get_position(void *buf)
+#define QUEUE_MASK		(PICNC_QUEUE_SIZE - 1)
+
+/*
+  Position following
+
+  In position mode the host sends target positions instead of
+  velocities. The target velocity is the change between two targets
+  over one servo period; the target is moved on at that velocity
+  between frames. Every PICNC_RAMP_TICKS ticks each axis is steered
+  towards its target with a proportional term on the position error,
+  braking early enough not to overshoot, and its velocity changes by
+  at most accel per ramp step.
+
+  The 32 bit DDS position wraps every 512 steps, less than the error
+  can grow to under a low accel limit, so the error is kept in 64 bits
+  and only ever updated by differences.
+*/
+typedef struct {
+	int32_t target;			/* moved on between frames */
+	int32_t last;			/* last target received */
+	int32_t tvel;			/* target velocity */
+	int32_t accel;			/* max velocity change per ramp */
+	int32_t lastpos;		/* position at the last ramp */
+	int64_t err;			/* target - position */
+} stepgen_follow_struct;
+
+static volatile stepgen_follow_struct follow[MAXGEN];
+static volatile int follow_on = 0;
+static int32_t follow_period = 0;	/* servo period in ticks */
+static int32_t follow_vmax = (1L << (STEPBIT-2)) / STEPWIDTH;
+
+/* output compare axes have their own limit, see below */
+#define OC_VMAX(rate)	((int32_t)((1LL << STEPBIT) * PICNC_OC_MAX_VEL * \
+			 (rate) / CORE_TIMER_FREQ))
+static int32_t oc_vmax = OC_VMAX(CORE_TICK_RATE);
+#define vmax(i)		((i) < STEPGEN_OC ? oc_vmax : follow_vmax)
+
+/* time constant of the position loop is 2^FOLLOW_SHIFT ticks */
+#define FOLLOW_SHIFT		6
+#define RAMP_MASK		(PICNC_RAMP_TICKS - 1)
+
+/*
+  Cubic (PVT) following
+
+  The host sends the position and velocity each axis should have at
+  the end of the servo period. From the frame on, an axis follows the
+  cubic Hermite curve from where its previous curve was at that moment,
+  at the velocity it had there, to the new target at the new velocity;
+  past the end of the period the curve goes on at the end velocity.
+
+  With T the period in ticks, u the time since the start as a fraction
+  of T in 16 bit fixed point, d the distance to the target and v0, v1
+  the velocities in DDS units per tick, the curve is
+
+	p(u) = p0 + ((c3 u + c2) u + c1) u
+	c1 = T v0,  c2 = 3 d - 2 T v0 - T v1,  c3 = T v0 + T v1 - 2 d
+
+  The coefficients are worked out in SpiDmaHandler(), which the tick
+  may interrupt at any point; the curves are only swapped with the
+  tick held off, and the SPI handler, their only writer, does not run
+  twice at once. Every PICNC_RAMP_TICKS ticks the ISR sets the
+  velocity of an axis so that it gets to the curve one ramp later,
+  which also takes up the DDS rounding. The velocity stays piecewise
+  constant, but it changes once a ramp instead of once a servo
+  period.
+*/
+typedef struct {
+	int32_t p0;			/* start of the curve */
+	int32_t d;			/* distance to the target */
+	int32_t v1;			/* velocity at the target */
+	int64_t c1, c2, c3;
+} stepgen_curve_struct;
+
+static volatile stepgen_curve_struct curve[MAXGEN];
+static volatile int curve_on = 0;
+static volatile uint32_t curve_t = 0;		/* ticks since the start */
+static uint32_t curve_ticks = 2,		/* T */
+		curve_scale = 1UL << 31;	/* 2^32 / T */
+
+void stepgen_get_position(void *buf, uint32_t *queue_status)
 {
+	int32_t *pos = buf;
+	int i;
+
 	disable_int();
-	memcpy(buf, (const void *)position, sizeof(position));
+	for (i = 0; i < MAXGEN; i++)
+		pos[i] = axis[i].position;
+	*queue_status = QUEUE_STATUS(seg_ticks > 0xFFFF ? 0xFFFF : seg_ticks,
+		seg_seq, queue_head - queue_tail);
 	enable_int();
 }
 
+/* called from the ISR, see probe.c */
+void stepgen_latch_position(int32_t *buf)
+{
+	int i;
+
+	for (i = 0; i < MAXGEN; i++)
+		buf[i] = axis[i].position;
+}
+
+uint32_t stepgen_underruns(void)
+{
+	return queue_underruns;
+}
+
+/* apply velocities at once, dropping anything queued */
 void stepgen_update_input(const void *buf)
 {
 	disable_int();
 	memcpy((void *)&stepgen_input, buf, sizeof(stepgen_input));
+	queue_tail = queue_head;
+	seg_ticks = 0;
+	follow_on = 0;
+	curve_on = 0;
 	enable_int();
 }
 
+int stepgen_queue_segment(const void *buf, uint32_t segment)
+{
+	stepgen_segment_struct *seg;
+
+	if (queue_head - queue_tail >= PICNC_QUEUE_SIZE)
+		return -1;
+
+	seg = &queue[queue_head & QUEUE_MASK];
+	memcpy(&seg->input, buf, sizeof(seg->input));
+	seg->segment = segment;
+	follow_on = 0;
+	curve_on = 0;
+
+	/* publish only after the entry is complete */
+	queue_head++;
+
+	return 0;
+}
+
+void stepgen_queue_depth(int depth)
+{
+	if (depth < 1)
+		depth = 1;
+	if (depth > PICNC_QUEUE_MAX)
+		depth = PICNC_QUEUE_MAX;
+	queue_prime = depth;
+}
+
+/* called from the ISR once per tick */
+static inline void queue_tick(void)
+{
+	stepgen_segment_struct *seg;
+	unsigned level;
+	int i;
+
+	if (seg_ticks) {
+		seg_ticks--;
+		return;
+	}
+
+	level = queue_head - queue_tail;
+	if (!level) {
+		if (queue_running)
+			queue_underruns++;
+		return;
+	}
+
+	if (!queue_running && (level < queue_prime))
+		return;
+	queue_running = 1;
+
+	seg = &queue[queue_tail & QUEUE_MASK];
+	for (i = 0; i < MAXGEN; i++)
+		stepgen_input.velocity[i] = seg->input.velocity[i];
+	seg_seq = SEGMENT_SEQ(seg->segment);
+	seg_ticks = SEGMENT_TICKS(seg->segment) - 1;
+	queue_tail++;
+}
+
 static int step_width = STEPWIDTH;
 
 void stepgen_update_stepwidth(int width)
 {
 	step_width = width;
+
+	/* one step per 4 * width ticks, the same limit as on the host */
+	if (width < 1)
+		width = 1;
+	follow_vmax = (1L << (STEPBIT-2)) / width;
 }
 
-void stepgen_reset(void)
+void stepgen_update_target(const void *buf)
 {
+	const int32_t *target = buf;
 	int i;
 
 	disable_int();
-
 	for (i = 0; i < MAXGEN; i++) {
-		position[i] = 0;
-		oldpos[i] = 0;
-		oldvel[i] = 0;
-
-		stepgen_input.velocity[i] = 0;
-		do_step_hi[i] = 1;
+		if (follow_on) {
+			follow[i].err += target[i] - follow[i].target;
+			follow[i].tvel = follow_period ?
+				(target[i] - follow[i].last) / follow_period : 0;
+		} else {
+			follow[i].lastpos = axis[i].position;
+			follow[i].err = target[i] - axis[i].position;
+			follow[i].tvel = 0;
+		}
+		follow[i].target = target[i];
+		follow[i].last = target[i];
 	}
 
+	/* position mode replaces the velocity queue */
+	queue_tail = queue_head;
+	seg_ticks = 0;
+	follow_on = 1;
+	curve_on = 0;
 	enable_int();
+}
 
-	for (i = 0; i < MAXGEN; i++) {
-		step_lo(i);
-		dir_lo(i);
+void stepgen_update_limits(uint32_t period, const void *buf)
+{
+	const int32_t *accel = buf;
+	int i;
+
+	disable_int();
+	follow_period = period;
+	for (i = 0; i < MAXGEN; i++)
+		follow[i].accel = accel[i] > 0 ? accel[i] : 1;
+	enable_int();
+}
+
+/* called from the ISR, ramps one axis per tick */
+static inline void follow_tick(void)
+{
+	static unsigned slot = 0;
+	stepgen_follow_struct *f;
+	int64_t vr_des, dist;
+	int32_t d, vr, dv, vel;
+	int i;
+
+	i = slot;
+	slot = (slot + 1) & RAMP_MASK;
+	if (!follow_on || (i >= MAXGEN))
+		return;
+
+	f = (stepgen_follow_struct *)&follow[i];
+	d = f->tvel * PICNC_RAMP_TICKS;
+	f->target += d;
+	f->err += d - (axis[i].position - f->lastpos);
+	f->lastpos = axis[i].position;
+
+	vr = stepgen_input.velocity[i] - f->tvel;
+	vr_des = f->err >> FOLLOW_SHIFT;
+
+	/* brake if stopping from vr takes us up to the target */
+	if (vr && ((vr < 0) == (f->err < 0))) {
+		dist = f->err < 0 ? -f->err : f->err;
+		if (dist > (1LL << 40))
+			dist = 1LL << 40;
+		if ((int64_t)vr * vr * PICNC_RAMP_TICKS >=
+				2 * f->accel * dist)
+			vr_des = 0;
 	}
+
+	dv = vr_des - vr;
+	if (dv > f->accel)
+		dv = f->accel;
+	else if (dv < -f->accel)
+		dv = -f->accel;
+
+	vel = f->tvel + vr + dv;
+	if (vel > vmax(i))
+		vel = vmax(i);
+	else if (vel < -vmax(i))
+		vel = -vmax(i);
+
+	stepgen_input.velocity[i] = vel;
 }
 
-static int stepwdth[MAXGEN] = { 0 };
+/* offset of a curve from its start at t ticks */
+static inline int64_t curve_offset(const stepgen_curve_struct *c, uint32_t t)
+{
+	int64_t u, p;
 
-void stepgen(void)
+	if (t >= curve_ticks)
+		return c->d + (int64_t)c->v1 * (t - curve_ticks);
+
+	u = ((uint64_t)t * curve_scale) >> 16;
+	p = (c->c3 * u) >> 16;
+	p = ((p + c->c2) * u) >> 16;
+	return ((p + c->c1) * u) >> 16;
+}
+
+/* velocity of a curve at t ticks */
+static inline int32_t curve_velocity(const stepgen_curve_struct *c,
+	uint32_t t)
+{
+	int64_t u, v;
+
+	if (t >= curve_ticks)
+		return c->v1;
+
+	u = ((uint64_t)t * curve_scale) >> 16;
+	v = (3 * c->c3 * u) >> 16;
+	v = ((v + 2 * c->c2) * u) >> 16;
+	return (v + c->c1) / (int32_t)curve_ticks;
+}
+
+void stepgen_update_curve(const void *pos, const void *vel, uint32_t ticks)
 {
-	uint32_t stepready;
+	const int32_t *target = pos, *v1 = vel;
+	stepgen_curve_struct next[MAXGEN];
+	int64_t tv0, tv1;
+	int32_t p, v0;
+	uint32_t t;
 	int i;
 
+	if (ticks < 2)
+		ticks = 2;
+
+	/* the new curves start where the old ones are now, worked out
+	   with the tick still running; the ticks that go by meanwhile
+	   are carried over below */
+	t = curve_t;
 	for (i = 0; i < MAXGEN; i++) {
+		if (curve_on) {
+			p = curve[i].p0 + (int32_t)curve_offset(
+				(const stepgen_curve_struct *)&curve[i], t);
+			v0 = curve_velocity(
+				(const stepgen_curve_struct *)&curve[i], t);
+		} else {
+			p = axis[i].position;
+			v0 = stepgen_input.velocity[i];
+		}
 
-		/* check if a step pulse can be generated */
-		stepready = (position[i] ^ oldpos[i]) & HALFSTEP_MASK;
+		tv0 = (int64_t)ticks * v0;
+		tv1 = (int64_t)ticks * v1[i];
+		next[i].p0 = p;
+		next[i].d = target[i] - p;
+		next[i].v1 = v1[i];
+		next[i].c1 = tv0;
+		next[i].c2 = 3 * (int64_t)next[i].d - 2 * tv0 - tv1;
+		next[i].c3 = tv0 + tv1 - 2 * (int64_t)next[i].d;
+	}
 
-		/* generate a step pulse */
-		if (stepready) {
-			oldpos[i] = position[i];
-			stepwdth[i] =  step_width + 1;
-			do_step_hi[i] = 0;
-		}
+	disable_int();
+	memcpy((void *)curve, next, sizeof(next));
+	curve_ticks = ticks;
+	curve_scale = (uint32_t)((1ULL << 32) / ticks);
+	curve_t -= t;
+
+	/* PVT replaces the velocity queue and position following */
+	queue_tail = queue_head;
+	seg_ticks = 0;
+	follow_on = 0;
+	curve_on = 1;
+	enable_int();
+}
 
-		if (stepwdth[i]) {
-			if (--stepwdth[i]) {
-				step_hi(i);
+/* called from the ISR, steers one axis per tick onto its curve */
+static inline void curve_tick(void)
+{
+	static unsigned slot = 0;
+	stepgen_curve_struct *c;
+	int32_t vel;
+	int i;
+
+	i = slot;
+	slot = (slot + 1) & RAMP_MASK;
+	if (!curve_on)
+		return;
+
+	curve_t++;
+	if (i >= MAXGEN)
+		return;
+
+	c = (stepgen_curve_struct *)&curve[i];
+	vel = (int32_t)(c->p0 + (int32_t)curve_offset(c,
+		curve_t + PICNC_RAMP_TICKS - 1) - axis[i].position) /
+		PICNC_RAMP_TICKS;
+
+	if (vel > vmax(i))
+		vel = vmax(i);
+	else if (vel < -vmax(i))
+		vel = -vmax(i);
+
+	stepgen_input.velocity[i] = vel;
+}
+
+/*
+  Step pulses by output compare
+
+  The first STEPGEN_OC axes do not step from the ISR. Their step pins
+  are driven by an output compare module in continuous pulse mode, one
+  pulse per period of its timer, so the step rate is set in counts of
+  STEPGEN_OC_CLOCK instead of in ticks, and a pulse costs no CPU time.
+  The DDS position of these axes still moves on every tick, it is what
+  the host reads back.
+
+  Every PICNC_RAMP_TICKS ticks, in the slot of the axis, the pulses
+  sent since the last ramp are counted: the timer went from tmr to its
+  count now in the core timer time that passed, and every wrap was a
+  pulse. With the fraction of the period under way, that gives where
+  the pins are in DDS units. The period is then set so that the pins
+  get to the DDS position due one ramp later. A shorter period takes
+  effect at once, the timer is pulled back if it is already past it.
+
+  The pins never step against the DDS direction. When they are ahead,
+  or the DDS turns round, the module is stopped once its pulse is
+  over. The dir pin only changes while it is stopped, and the next
+  pulse waits for the ramp after. Pins that fall too far behind, above
+  the rate limit, skip ahead, much as the ISR loses steps there. The
+  pulses are OC_WIDTH counts wide whatever the step width, 2.5 us, as
+  the fastest have to fit.
+*/
+typedef struct {
+	volatile uint32_t *tmr, *pr, *con, *r, *rs;
+	uint32_t mode;
+} stepgen_oc_pins_struct;
+
+typedef struct {
+	int32_t pos;			/* DDS position of the last pulse */
+	uint32_t period;		/* timer counts, 0 while stopped */
+	uint32_t tmr;			/* timer at the last ramp */
+	uint32_t count;			/* core timer at the last ramp */
+	int dir;			/* 1 or -1 */
+	int hold;			/* ramps to wait after a dir change */
+} stepgen_oc_struct;
+
+#define OC_MIN_PERIOD		(STEPGEN_OC_CLOCK / (2 * PICNC_OC_MAX_VEL))
+#define OC_MAX_LAG		(256L << (STEPBIT-1))	/* 256 pulses */
+#define OC_MAX_PERIOD		0x10000
+#define OC_WIDTH		(OC_MIN_PERIOD / 2)
+
+/* timer counts per pulse at one DDS unit per tick */
+#define OC_PERIOD_K(rate)	((uint32_t)((rate) / STEPGEN_OC_CORE) << \
+				 (STEPBIT-1))
+static uint32_t oc_period_k = OC_PERIOD_K(CORE_TICK_RATE);
+
+#if STEPGEN_OC > 0
+static const stepgen_oc_pins_struct oc_pins[] = { STEPGEN_OC_TABLE };
+static stepgen_oc_struct oc[STEPGEN_OC];
+
+/* period to cover dist DDS units in one ramp */
+static inline uint32_t oc_period(int32_t dist)
+{
+	uint32_t v = dist / PICNC_RAMP_TICKS, p;
+
+	if (!v)
+		return OC_MAX_PERIOD;
+
+	p = oc_period_k / v;
+	if (p < OC_MIN_PERIOD)
+		return OC_MIN_PERIOD;
+	if (p > OC_MAX_PERIOD)
+		return OC_MAX_PERIOD;
+	return p;
+}
+
+/* called from the ISR in the ramp slot of axis i */
+static inline void oc_tick(int i, uint32_t *set, uint32_t *clr)
+{
+	const stepgen_oc_pins_struct *hw = &oc_pins[i];
+	stepgen_oc_struct *o = &oc[i];
+	int32_t p, dist, d;
+	uint32_t c, x, n;
+
+	c = _CP0_GET_COUNT();
+	x = *hw->tmr;
+
+	p = o->pos;
+	if (o->period) {
+		/* rounded, the core timer and the timer are read a few
+		   cycles apart */
+		n = (o->tmr + (c - o->count) / STEPGEN_OC_CORE +
+			o->period / 2 - x) / o->period;
+		o->pos += (int32_t)(n << (STEPBIT-1)) * o->dir;
+		p = o->pos + o->dir * (int32_t)(((x << 16) / o->period) <<
+			(STEPBIT-17));
+	}
+
+	/* how far the pins have to go by the next ramp */
+	dist = axis[i].position +
+		stepgen_input.velocity[i] * PICNC_RAMP_TICKS - p;
+	d = o->dir > 0 ? dist : -dist;
+
+	/* above the rate limit the pins drop behind, let go of what
+	   they cannot make up, as the ISR drops steps */
+	if (d > OC_MAX_LAG) {
+		o->pos += o->dir * (d - OC_MAX_LAG);
+		d = OC_MAX_LAG;
+	}
+
+	if (o->period) {
+		if (d <= 0) {
+			/* stop, but not in the middle of a pulse */
+			if (x > OC_WIDTH + 1) {
+				*hw->con = 0;
+				o->period = 0;
 			} else {
-				do_step_hi[i] = 1;
-				step_lo(i);
+				*hw->pr = OC_MAX_PERIOD - 1;
+				o->period = OC_MAX_PERIOD;
 			}
-		}
-
-		/* check for direction change */
-		if (!dirchange[i]) {
-			if ((stepgen_input.velocity[i] ^ oldvel[i]) & DIR_MASK) {
-				dirchange[i] = 1;
-				oldvel[i] = stepgen_input.velocity[i];
+		} else {
+			n = oc_period(d);
+			*hw->pr = n - 1;
+			if (x >= n) {
+				x = n - 1;
+				*hw->tmr = x;
 			}
+			o->period = n;
 		}
+		o->tmr = x;
+		o->count = c;
+	} else if (o->hold) {
+		o->hold--;
+	} else if (d <= -HALFSTEP_MASK) {
+		/* turn round, the pulse waits for the dir setup */
+		o->dir = -o->dir;
+		if (o->dir > 0)
+			clr[pins[i].port] |= pins[i].dir_mask;
+		else
+			set[pins[i].port] |= pins[i].dir_mask;
+		o->hold = 1;
+	} else if (d >= HALFSTEP_MASK) {
+		/* the first pulse goes out at once */
+		n = oc_period(d - HALFSTEP_MASK);
+		*hw->pr = n - 1;
+		*hw->tmr = 0;
+		*hw->con = hw->mode;
+		o->pos += o->dir * HALFSTEP_MASK;
+		o->period = n;
+		o->tmr = 0;
+		o->count = c;
+	}
+}
 
-		/* generate direction pulse after step hi-lo transition */
-		if (do_step_hi[i] && dirchange[i]) {
-			dirchange[i] = 0;
-			if (oldvel[i] >= 0)
-				dir_lo(i);
-			if (oldvel[i] < 0)
-				dir_hi(i);
-		}
+/* called from the ISR, one output compare axis per tick */
+static inline void oc_ramp(uint32_t *set, uint32_t *clr)
+{
+	static unsigned slot = 0;
+	int i;
 
-		/* update position counter */
-		position[i] += stepgen_input.velocity[i];
-	}
+	i = slot;
+	slot = (slot + 1) & RAMP_MASK;
+	if (i < STEPGEN_OC)
+		oc_tick(i, set, clr);
 }
+#else
+#define oc_ramp(set, clr)	do { } while (0)
+#endif
 
-__inline__ void step_hi(int i)
+static void oc_reset(void)
 {
-	if (i == 0)
-		STEP_X_HI;
-	if (i == 1)
-		STEP_Y_HI;
-	if (i == 2)
-		STEP_Z_HI;
-	if (i == 3)
-		STEP_A_HI;
+#if STEPGEN_OC > 0
+	int i;
+
+	for (i = 0; i < STEPGEN_OC; i++) {
+		*oc_pins[i].con = 0;
+		*oc_pins[i].r = 1;
+		*oc_pins[i].rs = 1 + OC_WIDTH;
+		oc[i].pos = 0;
+		oc[i].period = 0;
+		oc[i].dir = 1;
+		oc[i].hold = 0;
+	}
+#endif
 }
 
-__inline__ void step_lo(int i)
+/* core timer counts per tick, the output compare axes time their
+   pulses by it */
+void stepgen_update_tick_rate(uint32_t rate)
 {
-	if (i == 0)
-		STEP_X_LO;
-	if (i == 1)
-		STEP_Y_LO;
-	if (i == 2)
-		STEP_Z_LO;
-	if (i == 3)
-		STEP_A_LO;
+	oc_vmax = OC_VMAX(rate);
+	oc_period_k = OC_PERIOD_K(rate);
 }
 
-__inline__ void dir_hi(int i)
+void stepgen_reset(void)
 {
-	if (i == 0)
-		DIR_X_HI;
-	if (i == 1)
-		DIR_Y_HI;
-	if (i == 2)
-		DIR_Z_HI;
-	if (i == 3)
-		DIR_A_HI;
+	uint32_t mask[STEPGEN_NPORTS] = { 0 };
+	int i;
+
+	disable_int();
+
+	for (i = 0; i < MAXGEN; i++) {
+		axis[i].position = 0;
+		axis[i].oldpos = 0;
+		axis[i].oldvel = 0;
+		axis[i].do_step_hi = 1;
+
+		stepgen_input.velocity[i] = 0;
+		mask[pins[i].port] |= pins[i].step_mask | pins[i].dir_mask;
+	}
+
+	queue_head = queue_tail = 0;
+	queue_running = 0;
+	seg_ticks = 0;
+	seg_seq = 0;
+
+	follow_on = 0;
+	curve_on = 0;
+	for (i = 0; i < MAXGEN; i++) {
+		follow[i].target = 0;
+		follow[i].tvel = 0;
+		follow[i].accel = vmax(i);
+	}
+
+	oc_reset();
+
+	enable_int();
+
+	STEPGEN_CLR_E(mask[STEPGEN_PORT_E]);
+#if STEPGEN_NPORTS > 1
+	STEPGEN_CLR_F(mask[STEPGEN_PORT_F]);
+#endif
+#if STEPGEN_NPORTS > 2
+	STEPGEN_CLR_D(mask[STEPGEN_PORT_D]);
+#endif
 }
 
-__inline__ void dir_lo(int i)
+/*
+  Step and dir edges of all axes are collected into one SET and one
+  CLR mask per port and written once per tick. The CLR store goes first
+  so that a direction change still follows the falling edge of the step
+  pulse.
+*/
+void stepgen(void)
 {
-	if (i == 0)
-		DIR_X_LO;
-	if (i == 1)
-		DIR_Y_LO;
-	if (i == 2)
-		DIR_Z_LO;
-	if (i == 3)
-		DIR_A_LO;
+	/* no other writer can run while the ISR is active */
+	stepgen_axis_struct *a = (stepgen_axis_struct *)axis;
+	uint32_t set[STEPGEN_NPORTS] = { 0 }, clr[STEPGEN_NPORTS] = { 0 };
+	int32_t vel;
+	int i;
+
+	queue_tick();
+	follow_tick();
+	curve_tick();
+	oc_ramp(set, clr);
+
+	for (i = 0; i < MAXGEN; i++, a++) {
+		vel = stepgen_input.velocity[i];
+
+		/* the output compare steps these */
+		if (i < STEPGEN_OC) {
+			a->position += vel;
+			continue;
+		}
+
+		/* check if a step pulse can be generated */
+		if ((a->position ^ a->oldpos) & HALFSTEP_MASK) {
+			/* generate a step pulse */
+			a->oldpos = a->position;
+			a->stepwdth = step_width + 1;
+			a->do_step_hi = 0;
+		}
+
+		if (a->stepwdth) {
+			if (--a->stepwdth) {
+				set[pins[i].port] |= pins[i].step_mask;
+			} else {
+				a->do_step_hi = 1;
+				clr[pins[i].port] |= pins[i].step_mask;
+			}
+		}
+
+		/* check for direction change */
+		if (!a->dirchange) {
+			if ((vel ^ a->oldvel) & DIR_MASK) {
+				a->dirchange = 1;
+				a->oldvel = vel;
+			}
+		}
+
+		/* generate direction pulse after step hi-lo transition */
+		if (a->do_step_hi && a->dirchange) {
+			a->dirchange = 0;
+			if (a->oldvel >= 0)
+				clr[pins[i].port] |= pins[i].dir_mask;
+			else
+				set[pins[i].port] |= pins[i].dir_mask;
+		}
+
+		/* update position counter */
+		a->position += vel;
+	}
+
+	if (clr[STEPGEN_PORT_E])
+		STEPGEN_CLR_E(clr[STEPGEN_PORT_E]);
+	if (set[STEPGEN_PORT_E])
+		STEPGEN_SET_E(set[STEPGEN_PORT_E]);
+#if STEPGEN_NPORTS > 1
+	if (clr[STEPGEN_PORT_F])
+		STEPGEN_CLR_F(clr[STEPGEN_PORT_F]);
+	if (set[STEPGEN_PORT_F])
+		STEPGEN_SET_F(set[STEPGEN_PORT_F]);
+#endif
+#if STEPGEN_NPORTS > 2
+	if (clr[STEPGEN_PORT_D])
+		STEPGEN_CLR_D(clr[STEPGEN_PORT_D]);
+	if (set[STEPGEN_PORT_D])
+		STEPGEN_SET_D(set[STEPGEN_PORT_D]);
+#endif
 }
@@ -18,13 +18,19 @@
 #ifndef __STEPGEN_H__
 #define __STEPGEN_H__
 
-#define STEPBIT		23
+#include "picnc_proto.h"
+
 #define HALFSTEP_MASK	(1L<<(STEPBIT-1))
 #define DIR_MASK	(1L<<31)
 
 #define STEPWIDTH	1
-#define MAXGEN		4
+#define MAXGEN		NUMAXES
 
+#if defined(PICNC_SIM)
+/* the host simulator runs the ISR synchronously, see sim/sim.h */
+#define disable_int()	sim_disable_int()
+#define enable_int()	sim_enable_int()
+#else
 #define disable_int()								\
 	do {									\
 		asm volatile("di");						\
@@ -35,6 +41,7 @@
 	do {									\
 		asm volatile("ei");						\
 	} while (0)
+#endif
 
 typedef struct {
 	int32_t velocity[MAXGEN];
@@ -42,8 +49,16 @@ typedef struct {
 
 void stepgen(void);
 void stepgen_reset(void);
-void stepgen_get_position(void *buf);
+void stepgen_get_position(void *buf, uint32_t *queue_status);
+void stepgen_latch_position(int32_t *buf);
+uint32_t stepgen_underruns(void);
 void stepgen_update_input(const void *buf);
 void stepgen_update_stepwidth(int width);
+void stepgen_update_tick_rate(uint32_t rate);
+int stepgen_queue_segment(const void *buf, uint32_t segment);
+void stepgen_queue_depth(int depth);
+void stepgen_update_target(const void *buf);
+void stepgen_update_limits(uint32_t period, const void *buf);
+void stepgen_update_curve(const void *pos, const void *vel, uint32_t ticks);
 
 #endif				/* __STEPGEN_H__ */